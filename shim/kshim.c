@@ -0,0 +1,728 @@
+/*
+ * kshim.c
+ *
+ *      Author: Maxim Kouprianov
+ */
+
+#include <stdarg.h>
+
+#include "kshim.h"
+
+int shim_loglevel = 4;
+
+void
+shim_printk(int level, const char *fmt, ...) {
+	va_list args;
+
+	if (level > shim_loglevel) {
+		return;
+	}
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* =============================================== */
+
+static __thread struct task_struct shim_task;
+static __thread wait_queue_t *shim_wait;
+static __thread struct task_struct *shim_kthread;
+
+struct task_struct *
+shim_current(void) {
+	if (shim_task.pid == 0) {
+		shim_task.pid = (int) gettid();
+	}
+	return &shim_task;
+}
+
+void
+init_waitqueue_head(wait_queue_head_t *wq) {
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	wq->seq = 0;
+}
+
+unsigned long
+shim_wait_seq(wait_queue_head_t *wq) {
+	unsigned long seq;
+
+	pthread_mutex_lock(&wq->lock);
+	seq = wq->seq;
+	pthread_mutex_unlock(&wq->lock);
+	return seq;
+}
+
+/*
+ * A kthread can't be woken up by kthread_stop() here, it doesn't know
+ * the queue, so kthreads also wake up every tick to look. Spurious wake
+ * ups are fine for wait_event() callers.
+ */
+void
+shim_wait_change(wait_queue_head_t *wq, unsigned long seq) {
+	struct timespec ts;
+
+	pthread_mutex_lock(&wq->lock);
+	while (wq->seq == seq) {
+		if (shim_kthread == NULL) {
+			pthread_cond_wait(&wq->cond, &wq->lock);
+			continue;
+		}
+		if (__atomic_load_n(&shim_kthread->should_stop, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 1000000000L / HZ;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_nsec -= 1000000000L;
+			++ts.tv_sec;
+		}
+		pthread_cond_timedwait(&wq->cond, &wq->lock, &ts);
+	}
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void
+__wake_up(wait_queue_head_t *wq) {
+	pthread_mutex_lock(&wq->lock);
+	++wq->seq;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void
+prepare_to_wait(wait_queue_head_t *wq, wait_queue_t *wait, int state) {
+	wait->wq = wq;
+	wait->seq = shim_wait_seq(wq);
+	shim_wait = wait;
+}
+
+void
+finish_wait(wait_queue_head_t *wq, wait_queue_t *wait) {
+	shim_wait = NULL;
+}
+
+/* sleeps until a wake up after prepare_to_wait(), otherwise yields */
+void
+schedule(void) {
+	if (shim_wait != NULL) {
+		shim_wait_change(shim_wait->wq, shim_wait->seq);
+		shim_wait = NULL;
+	} else {
+		sched_yield();
+	}
+}
+
+static void *
+shim_kthread_fn(void *arg) {
+	struct task_struct *task = arg;
+
+	shim_kthread = task;
+	task->ret = task->threadfn(task->data);
+	return NULL;
+}
+
+struct task_struct *
+kthread_run(int (*threadfn)(void *data), void *data, const char *namefmt,
+		...) {
+	struct task_struct *task = calloc(1, sizeof(*task));
+
+	if (task == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	task->threadfn = threadfn;
+	task->data = data;
+	if (pthread_create(&task->thread, NULL, shim_kthread_fn, task)) {
+		free(task);
+		return ERR_PTR(-EAGAIN);
+	}
+	return task;
+}
+
+bool
+kthread_should_stop(void) {
+	return shim_kthread != NULL
+			&& __atomic_load_n(&shim_kthread->should_stop, __ATOMIC_SEQ_CST);
+}
+
+int
+kthread_stop(struct task_struct *task) {
+	int ret;
+
+	__atomic_store_n(&task->should_stop, true, __ATOMIC_SEQ_CST);
+	pthread_join(task->thread, NULL);
+	ret = task->ret;
+	free(task);
+	return ret;
+}
+
+struct workqueue_struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* work queued or stopping */
+	pthread_cond_t idle; /* nothing queued or running */
+	struct list_head works;
+	unsigned int running;
+	bool stop;
+	int nr_threads;
+	pthread_t threads[];
+};
+
+static void *
+shim_worker(void *arg) {
+	struct workqueue_struct *wq = arg;
+	struct work_struct *work;
+
+	pthread_mutex_lock(&wq->lock);
+	for (;;) {
+		while (list_empty(&wq->works) && !wq->stop) {
+			pthread_cond_wait(&wq->cond, &wq->lock);
+		}
+		if (list_empty(&wq->works)) {
+			break;
+		}
+
+		work = list_first_entry(&wq->works, struct work_struct, entry);
+		list_del_init(&work->entry);
+		++wq->running;
+		pthread_mutex_unlock(&wq->lock);
+
+		work->func(work); /* may free it */
+
+		pthread_mutex_lock(&wq->lock);
+		if (--wq->running == 0 && list_empty(&wq->works)) {
+			pthread_cond_broadcast(&wq->idle);
+		}
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+struct workqueue_struct *
+alloc_workqueue(const char *fmt, unsigned int flags, int max_active, ...) {
+	int i, threads = max_active > 0 ? max_active : 4;
+	struct workqueue_struct *wq;
+
+	wq = calloc(1, sizeof(*wq) + threads * sizeof(pthread_t));
+	if (wq == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	pthread_cond_init(&wq->idle, NULL);
+	INIT_LIST_HEAD(&wq->works);
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&wq->threads[i], NULL, shim_worker, wq);
+	}
+	wq->nr_threads = threads;
+	return wq;
+}
+
+bool
+queue_work(struct workqueue_struct *wq, struct work_struct *work) {
+	bool queued;
+
+	pthread_mutex_lock(&wq->lock);
+	queued = list_empty(&work->entry);
+	if (queued) {
+		list_add_tail(&work->entry, &wq->works);
+		pthread_cond_signal(&wq->cond);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return queued;
+}
+
+void
+flush_workqueue(struct workqueue_struct *wq) {
+	pthread_mutex_lock(&wq->lock);
+	while (wq->running > 0 || !list_empty(&wq->works)) {
+		pthread_cond_wait(&wq->idle, &wq->lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* drains the queue first, like the kernel does */
+void
+destroy_workqueue(struct workqueue_struct *wq) {
+	int i;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nr_threads; ++i) {
+		pthread_join(wq->threads[i], NULL);
+	}
+	free(wq);
+}
+
+u64
+local_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+msleep(unsigned int msecs) {
+	usleep(msecs * 1000UL);
+}
+
+unsigned long
+msleep_interruptible(unsigned int msecs) {
+	msleep(msecs);
+	return 0;
+}
+
+/* =============================================== */
+
+static char shim_zero[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static struct page shim_zero_struct = { .virtual = shim_zero,
+		._count = ATOMIC_INIT(INT_MAX / 2) };
+
+struct page *
+shim_zero_page(void) {
+	return &shim_zero_struct;
+}
+
+struct page *
+alloc_pages(gfp_t gfp, unsigned int order) {
+	unsigned long i, n = 1UL << order;
+	struct page *pages;
+	char *data;
+
+	pages = calloc(n, sizeof(struct page));
+	data = aligned_alloc(PAGE_SIZE, n * PAGE_SIZE);
+	if (pages == NULL || data == NULL) {
+		free(pages);
+		free(data);
+		return NULL;
+	}
+
+	/* poison, so that missing zeroing shows up in tests */
+	memset(data, gfp & __GFP_ZERO ? 0 : 0xa5, n * PAGE_SIZE);
+
+	for (i = 0; i < n; ++i) {
+		pages[i].virtual = data + i * PAGE_SIZE;
+		pages[i].head = pages;
+	}
+	atomic_set(&pages[0]._count, 1);
+	atomic_set(&pages[0].units, 1);
+	return pages;
+}
+
+void
+split_page(struct page *page, unsigned int order) {
+	unsigned long i, n = 1UL << order;
+
+	for (i = 1; i < n; ++i) {
+		atomic_set(&page[i]._count, 1);
+	}
+	atomic_set(&page->units, n);
+}
+
+void
+put_page(struct page *page) {
+	struct page *head = page->head;
+
+	if (!atomic_dec_and_test(&page->_count) || head == NULL) {
+		return;
+	}
+
+	if (atomic_dec_and_test(&head->units)) {
+		free(head->virtual);
+		free(head);
+	}
+}
+
+/* =============================================== */
+
+static void **
+radix_slot(struct radix_tree_root *root, unsigned long index, bool create) {
+	void ***dir = __atomic_load_n(&root->dir, __ATOMIC_ACQUIRE);
+	void **leaf;
+
+	if (index >= SHIM_RADIX_MAX) {
+		return NULL;
+	}
+
+	if (dir == NULL) {
+		if (!create || (dir = calloc(SHIM_RADIX_LEAF, sizeof(void **))) == NULL) {
+			return NULL;
+		}
+		__atomic_store_n(&root->dir, dir, __ATOMIC_RELEASE);
+	}
+
+	leaf = __atomic_load_n(&dir[index >> SHIM_RADIX_SHIFT], __ATOMIC_ACQUIRE);
+	if (leaf == NULL) {
+		if (!create || (leaf = calloc(SHIM_RADIX_LEAF, sizeof(void *))) == NULL) {
+			return NULL;
+		}
+		__atomic_store_n(&dir[index >> SHIM_RADIX_SHIFT], leaf,
+				__ATOMIC_RELEASE);
+	}
+
+	return &leaf[index & (SHIM_RADIX_LEAF - 1)];
+}
+
+int
+radix_tree_insert(struct radix_tree_root *root, unsigned long index,
+		void *item) {
+	void **slot = radix_slot(root, index, true);
+
+	if (slot == NULL) {
+		return -ENOMEM;
+	}
+	if (*slot != NULL) {
+		return -EEXIST;
+	}
+
+	__atomic_store_n(slot, item, __ATOMIC_RELEASE);
+	++root->count;
+	return 0;
+}
+
+void *
+radix_tree_lookup(struct radix_tree_root *root, unsigned long index) {
+	void **slot = radix_slot(root, index, false);
+	return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+}
+
+void **
+radix_tree_lookup_slot(struct radix_tree_root *root, unsigned long index) {
+	void **slot = radix_slot(root, index, false);
+	return slot && *slot ? slot : NULL;
+}
+
+/* tags are only touched under the tree's lock, no atomics needed */
+static unsigned char *
+radix_tags(struct radix_tree_root *root, unsigned long index, bool create) {
+	unsigned char *leaf;
+
+	if (index >= SHIM_RADIX_MAX) {
+		return NULL;
+	}
+
+	if (root->tags == NULL) {
+		if (!create || (root->tags = calloc(SHIM_RADIX_LEAF,
+				sizeof(unsigned char *))) == NULL) {
+			return NULL;
+		}
+	}
+
+	leaf = root->tags[index >> SHIM_RADIX_SHIFT];
+	if (leaf == NULL) {
+		if (!create || (leaf = calloc(SHIM_RADIX_LEAF, 1)) == NULL) {
+			return NULL;
+		}
+		root->tags[index >> SHIM_RADIX_SHIFT] = leaf;
+	}
+
+	return &leaf[index & (SHIM_RADIX_LEAF - 1)];
+}
+
+void *
+radix_tree_tag_set(struct radix_tree_root *root, unsigned long index,
+		unsigned int tag) {
+	void *item = radix_tree_lookup(root, index);
+	unsigned char *tags = radix_tags(root, index, true);
+
+	BUG_ON(item == NULL || tags == NULL);
+	if (!(*tags & (1U << tag))) {
+		*tags |= 1U << tag;
+		__atomic_add_fetch(&root->tagged[tag], 1, __ATOMIC_RELAXED);
+	}
+
+	return item;
+}
+
+void *
+radix_tree_tag_clear(struct radix_tree_root *root, unsigned long index,
+		unsigned int tag) {
+	unsigned char *tags = radix_tags(root, index, false);
+
+	if (tags != NULL && (*tags & (1U << tag))) {
+		*tags &= ~(1U << tag);
+		__atomic_sub_fetch(&root->tagged[tag], 1, __ATOMIC_RELAXED);
+	}
+
+	return radix_tree_lookup(root, index);
+}
+
+int
+radix_tree_tag_get(struct radix_tree_root *root, unsigned long index,
+		unsigned int tag) {
+	unsigned char *tags = radix_tags(root, index, false);
+	return tags != NULL && (*tags & (1U << tag));
+}
+
+int
+radix_tree_tagged(struct radix_tree_root *root, unsigned int tag) {
+	return __atomic_load_n(&root->tagged[tag], __ATOMIC_RELAXED) != 0;
+}
+
+/* the table is released once it's empty, so tests don't see leaks */
+void *
+radix_tree_delete(struct radix_tree_root *root, unsigned long index) {
+	void **slot = radix_slot(root, index, false);
+	void *item;
+	unsigned long i;
+
+	if (slot == NULL || (item = *slot) == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < RADIX_TREE_MAX_TAGS; ++i) {
+		radix_tree_tag_clear(root, index, i);
+	}
+
+	__atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+	if (--root->count == 0) {
+		for (i = 0; i < SHIM_RADIX_LEAF; ++i) {
+			free(root->dir[i]);
+			free(root->tags ? root->tags[i] : NULL);
+		}
+		free(root->dir);
+		free(root->tags);
+		root->dir = NULL;
+		root->tags = NULL;
+	}
+
+	return item;
+}
+
+void **
+shim_radix_next_slot(struct radix_tree_root *root, unsigned long *index) {
+	void ***dir = __atomic_load_n(&root->dir, __ATOMIC_ACQUIRE);
+	unsigned long i = *index;
+	void **leaf;
+
+	while (dir != NULL && i < SHIM_RADIX_MAX) {
+		leaf = __atomic_load_n(&dir[i >> SHIM_RADIX_SHIFT], __ATOMIC_ACQUIRE);
+		if (leaf == NULL) {
+			i = ((i >> SHIM_RADIX_SHIFT) + 1) << SHIM_RADIX_SHIFT;
+			continue;
+		}
+		if (__atomic_load_n(&leaf[i & (SHIM_RADIX_LEAF - 1)],
+				__ATOMIC_ACQUIRE) != NULL) {
+			*index = i;
+			return &leaf[i & (SHIM_RADIX_LEAF - 1)];
+		}
+		++i;
+	}
+
+	return NULL;
+}
+
+unsigned int
+radix_tree_gang_lookup(struct radix_tree_root *root, void **results,
+		unsigned long first_index, unsigned int max_items) {
+	unsigned long index = first_index;
+	unsigned int found = 0;
+	void **slot;
+
+	while (found < max_items
+			&& (slot = shim_radix_next_slot(root, &index)) != NULL) {
+		results[found++] = *slot;
+		++index;
+	}
+
+	return found;
+}
+
+unsigned int
+radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results,
+		unsigned long first_index, unsigned int max_items, unsigned int tag) {
+	unsigned long index = first_index;
+	unsigned int found = 0;
+	void **slot;
+
+	while (found < max_items
+			&& (slot = shim_radix_next_slot(root, &index)) != NULL) {
+		if (radix_tree_tag_get(root, index, tag)) {
+			results[found++] = *slot;
+		}
+		++index;
+	}
+
+	return found;
+}
+
+/* =============================================== */
+
+void
+iov_iter_init(struct iov_iter *i, int direction, const struct iovec *iov,
+		unsigned long nr_segs, size_t count) {
+	i->type = direction;
+	i->iov = iov;
+	i->nr_segs = nr_segs;
+	i->iov_offset = 0;
+	i->count = count;
+}
+
+/* copies between @buf and the iterator, @to_iter picks the direction */
+static size_t
+copy_iter(char *buf, size_t bytes, struct iov_iter *i, bool to_iter) {
+	size_t copied = 0, chunk;
+	char *base;
+
+	bytes = min(bytes, i->count);
+	while (copied < bytes) {
+		chunk = min(bytes - copied, i->iov->iov_len - i->iov_offset);
+		base = (char *) i->iov->iov_base + i->iov_offset;
+		if (to_iter) {
+			memcpy(base, buf + copied, chunk);
+		} else {
+			memcpy(buf + copied, base, chunk);
+		}
+
+		copied += chunk;
+		iov_iter_advance(i, chunk);
+	}
+
+	return copied;
+}
+
+size_t
+copy_page_to_iter(struct page *page, size_t offset, size_t bytes,
+		struct iov_iter *i) {
+	return copy_iter((char *) page->virtual + offset, bytes, i, true);
+}
+
+size_t
+copy_page_from_iter(struct page *page, size_t offset, size_t bytes,
+		struct iov_iter *i) {
+	return copy_iter((char *) page->virtual + offset, bytes, i, false);
+}
+
+void
+iov_iter_advance(struct iov_iter *i, size_t bytes) {
+	size_t chunk;
+
+	bytes = min(bytes, i->count);
+	i->count -= bytes;
+	while (bytes > 0) {
+		chunk = min(bytes, i->iov->iov_len - i->iov_offset);
+		i->iov_offset += chunk;
+		bytes -= chunk;
+		if (i->iov_offset == i->iov->iov_len) {
+			++i->iov;
+			--i->nr_segs;
+			i->iov_offset = 0;
+		}
+	}
+}
+
+/* =============================================== */
+
+static struct class shim_class;
+static struct device shim_device;
+static struct dentry shim_dentry;
+
+int
+alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count,
+		const char *name) {
+	static unsigned int major = 240; /* first "local/experimental" one */
+
+	*dev = MKDEV(__atomic_fetch_add(&major, 1, __ATOMIC_RELAXED), baseminor);
+	return 0;
+}
+
+struct class *
+shim_class_create(const char *name) {
+	return &shim_class;
+}
+
+struct device *
+device_create(struct class *cls, struct device *parent, dev_t devt,
+		void *drvdata, const char *fmt, ...) {
+	return &shim_device;
+}
+
+struct dentry *
+debugfs_create_dir(const char *name, struct dentry *parent) {
+	return &shim_dentry;
+}
+
+struct dentry *
+debugfs_create_file(const char *name, umode_t mode, struct dentry *parent,
+		void *data, const struct file_operations *fops) {
+	return &shim_dentry;
+}
+
+/* =============================================== */
+
+#define SHIM_MODULES_MAX 64
+
+static struct shim_module {
+	const char *name;
+	int (*init)(void);
+	void (*exit)(void);
+	bool loaded;
+} shim_modules[SHIM_MODULES_MAX];
+
+static struct shim_module *
+find_shim_module(const char *name, bool create) {
+	int i;
+
+	for (i = 0; i < SHIM_MODULES_MAX && shim_modules[i].name; ++i) {
+		if (!strcmp(shim_modules[i].name, name)) {
+			return &shim_modules[i];
+		}
+	}
+
+	if (!create || i == SHIM_MODULES_MAX) {
+		return NULL;
+	}
+
+	shim_modules[i].name = name;
+	return &shim_modules[i];
+}
+
+void
+shim_register_module(const char *name, int (*init)(void),
+		void (*exit)(void)) {
+	struct shim_module *mod = find_shim_module(name, true);
+
+	BUG_ON(mod == NULL);
+	if (init != NULL) {
+		mod->init = init;
+	}
+	if (exit != NULL) {
+		mod->exit = exit;
+	}
+}
+
+/* like insmod, the module's init runs now rather than at startup */
+int
+shim_load_module(const char *name) {
+	struct shim_module *mod = find_shim_module(name, false);
+	int err;
+
+	if (mod == NULL) {
+		return -ENOENT;
+	}
+	if (mod->loaded) {
+		return -EEXIST;
+	}
+
+	err = mod->init ? mod->init() : 0;
+	mod->loaded = err == 0;
+	return err;
+}
+
+void
+shim_unload_module(const char *name) {
+	struct shim_module *mod = find_shim_module(name, false);
+
+	if (mod != NULL && mod->loaded) {
+		if (mod->exit) {
+			mod->exit();
+		}
+		mod->loaded = false;
+	}
+}
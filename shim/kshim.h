@@ -0,0 +1,975 @@
+/*
+ * kshim.h
+ *
+ *      Author: Maxim Kouprianov
+ */
+
+/*
+ * Userspace stand-in for the bits of the kernel API the modules use, so
+ * their data paths build as plain programs for unit tests, benchmarks,
+ * perf and sanitizers. Headers in shim/linux and shim/asm just include
+ * this file. Semantics are kept where tests depend on them (refcounts,
+ * wait queues, page zeroing), everything else is a stub.
+ */
+
+#ifndef _KSHIM_H
+#define _KSHIM_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* =============================================== */
+/* types & attributes */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef unsigned long pgoff_t;
+typedef unsigned int gfp_t;
+typedef unsigned int fmode_t;
+typedef unsigned short umode_t;
+
+#define __user
+#define __kernel
+#define __percpu
+#define __rcu
+#define __init
+#define __exit
+#define __must_check
+#define SMP_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(SMP_CACHE_BYTES)))
+
+#ifndef KBUILD_MODNAME
+#define KBUILD_MODNAME "shim"
+#endif
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define smp_mb() __sync_synchronize()
+#define smp_rmb() __sync_synchronize()
+#define smp_wmb() __sync_synchronize()
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ACCESS_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+
+#define min(x, y) ({ __typeof__(x) _x = (x); __typeof__(y) _y = (y); \
+		_x < _y ? _x : _y; })
+#define max(x, y) ({ __typeof__(x) _x = (x); __typeof__(y) _y = (y); \
+		_x > _y ? _x : _y; })
+#define min_t(type, x, y) ({ type _x = (x); type _y = (y); _x < _y ? _x : _y; })
+#define max_t(type, x, y) ({ type _x = (x); type _y = (y); _x > _y ? _x : _y; })
+#define swap(a, b) do { __typeof__(a) _t = (a); (a) = (b); (b) = _t; } while (0)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((__typeof__(x)) (a) - 1))
+#define swab64(x) __builtin_bswap64(x)
+#define get_unaligned(p) ({ \
+	union { __typeof__(*(p)) v; char b[sizeof(*(p))]; } _u; \
+	memcpy(_u.b, (p), sizeof(_u.b)); \
+	_u.v; \
+})
+#define put_unaligned(v, p) do { __typeof__(*(p)) _v = (v); \
+		memcpy((p), &_v, sizeof(_v)); } while (0)
+#define is_power_of_2(n) ((n) != 0 && ((n) & ((n) - 1)) == 0)
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define BUG() abort()
+#define BUG_ON(cond) do { if (unlikely(cond)) abort(); } while (0)
+#define WARN_ON(cond) ({ int _c = !!(cond); \
+		if (unlikely(_c)) fprintf(stderr, "WARN_ON %s:%d\n", __FILE__, \
+				__LINE__); _c; })
+#define BUILD_BUG_ON(cond) ((void) sizeof(char[1 - 2 * !!(cond)]))
+
+/* =============================================== */
+/* errors & logging */
+
+#define ERESTARTSYS 512
+#define ENOIOCTLCMD 515
+#define MAX_ERRNO 4095
+
+#define IS_ERR_VALUE(x) unlikely((unsigned long) (x) >= (unsigned long) -MAX_ERRNO)
+
+static inline void *ERR_PTR(long error) { return (void *) error; }
+static inline long PTR_ERR(const void *ptr) { return (long) ptr; }
+static inline bool IS_ERR(const void *ptr) { return IS_ERR_VALUE(ptr); }
+static inline bool IS_ERR_OR_NULL(const void *ptr) {
+	return ptr == NULL || IS_ERR_VALUE(ptr);
+}
+
+/* 3 = errors, 4 = + warnings (default), 6 = + info, 7 = everything */
+extern int shim_loglevel;
+
+void
+shim_printk(int level, const char *fmt, ...)
+		__attribute__((format(printf, 2, 3)));
+
+#define pr_err(fmt, ...) shim_printk(3, fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) shim_printk(4, fmt, ##__VA_ARGS__)
+#define pr_warning pr_warn
+#define pr_info(fmt, ...) shim_printk(6, fmt, ##__VA_ARGS__)
+#define pr_debug(fmt, ...) shim_printk(7, fmt, ##__VA_ARGS__)
+
+/* =============================================== */
+/* memory */
+
+#define GFP_KERNEL 0x01u
+#define GFP_ATOMIC 0x02u
+#define GFP_NOWAIT 0x04u
+#define GFP_HIGHUSER 0x08u
+#define __GFP_ZERO 0x100u
+#define __GFP_NORETRY 0x200u
+#define __GFP_NOWARN 0x400u
+#define __GFP_COMP 0x800u
+
+static inline void *kmalloc(size_t size, gfp_t flags) {
+	return flags & __GFP_ZERO ? calloc(1, size ? size : 1)
+			: malloc(size ? size : 1);
+}
+static inline void *kzalloc(size_t size, gfp_t flags) {
+	return calloc(1, size ? size : 1);
+}
+static inline void *kzalloc_node(size_t size, gfp_t flags, int node) {
+	return kzalloc(size, flags);
+}
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags) {
+	return calloc(n ? n : 1, size ? size : 1);
+}
+static inline void *kmalloc_array(size_t n, size_t size, gfp_t flags) {
+	return n && size > SIZE_MAX / n ? NULL : kmalloc(n * size, flags);
+}
+static inline void kfree(const void *ptr) { free((void *) ptr); }
+static inline void *vmalloc(unsigned long size) { return malloc(size); }
+static inline void *vzalloc(unsigned long size) { return calloc(1, size); }
+static inline void vfree(const void *ptr) { free((void *) ptr); }
+
+struct kmem_cache {
+	size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+		size_t size, size_t align, unsigned long flags, void (*ctor)(void *)) {
+	struct kmem_cache *cache = malloc(sizeof(*cache));
+
+	if (cache != NULL) {
+		cache->size = size;
+	}
+	return cache;
+}
+static inline void kmem_cache_destroy(struct kmem_cache *cache) {
+	free(cache);
+}
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags) {
+	return kmalloc(cache->size, flags);
+}
+static inline void kmem_cache_free(struct kmem_cache *cache, void *ptr) {
+	free(ptr);
+}
+
+/* a single CPU for per-CPU data, the ops are atomic as on any CPU */
+#define DEFINE_PER_CPU(type, name) type name
+#define per_cpu(var, cpu) (*((void) (cpu), &(var)))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; ++(cpu))
+#define this_cpu_xchg(pcp, val) __atomic_exchange_n(&(pcp), val, \
+		__ATOMIC_SEQ_CST)
+#define this_cpu_cmpxchg(pcp, oval, nval) ({ \
+	__typeof__(pcp) _old = (oval); \
+	__atomic_compare_exchange_n(&(pcp), &_old, nval, false, \
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+	_old; \
+})
+
+/* a single node machine */
+#define NUMA_NO_NODE (-1)
+#define nr_node_ids 1
+#define node_online(node) ((node) == 0)
+#define numa_node_id() 0
+
+/* =============================================== */
+/* lists */
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list) {
+	list->next = list->prev = list;
+}
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+		struct list_head *next) {
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+static inline void list_add(struct list_head *new, struct list_head *head) {
+	__list_add(new, head, head->next);
+}
+static inline void list_add_tail(struct list_head *new,
+		struct list_head *head) {
+	__list_add(new, head->prev, head);
+}
+static inline void list_del(struct list_head *entry) {
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = entry->prev = NULL;
+}
+static inline void list_del_init(struct list_head *entry) {
+	list_del(entry);
+	INIT_LIST_HEAD(entry);
+}
+static inline int list_empty(const struct list_head *head) {
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+#define list_first_entry_or_null(ptr, type, member) \
+	(!list_empty(ptr) ? list_first_entry(ptr, type, member) : NULL)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, __typeof__(*pos), member); \
+			&pos->member != (head); \
+			pos = list_entry(pos->member.next, __typeof__(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_entry((head)->next, __typeof__(*pos), member), \
+			n = list_entry(pos->member.next, __typeof__(*pos), member); \
+			&pos->member != (head); \
+			pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+/* =============================================== */
+/* atomics & refcounts */
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+
+#define ATOMIC_INIT(i) { (i) }
+#define ATOMIC64_INIT(i) { (i) }
+
+/* acquire: the barriers kernel code puts after it are fences TSan can't see */
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_ACQUIRE)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_add_return(i, v) __atomic_add_fetch(&(v)->counter, (i), \
+		__ATOMIC_SEQ_CST)
+#define atomic_sub_return(i, v) __atomic_sub_fetch(&(v)->counter, (i), \
+		__ATOMIC_SEQ_CST)
+#define atomic_inc_return(v) atomic_add_return(1, v)
+#define atomic_dec_return(v) atomic_sub_return(1, v)
+#define atomic_add(i, v) ((void) atomic_add_return(i, v))
+#define atomic_sub(i, v) ((void) atomic_sub_return(i, v))
+#define atomic_inc(v) atomic_add(1, v)
+#define atomic_dec(v) atomic_sub(1, v)
+#define atomic_dec_and_test(v) (atomic_dec_return(v) == 0)
+#define atomic_cmpxchg(v, old, new) ({ __typeof__((v)->counter) _o = (old); \
+		__atomic_compare_exchange_n(&(v)->counter, &_o, (new), false, \
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); _o; })
+
+#define atomic64_read atomic_read
+#define atomic64_set atomic_set
+#define atomic64_add_return atomic_add_return
+#define atomic64_sub_return atomic_sub_return
+#define atomic64_inc_return atomic_inc_return
+#define atomic64_dec_return atomic_dec_return
+#define atomic64_add atomic_add
+#define atomic64_sub atomic_sub
+#define atomic64_inc atomic_inc
+#define atomic64_dec atomic_dec
+#define atomic64_cmpxchg atomic_cmpxchg
+
+struct kref {
+	atomic_t refcount;
+};
+
+static inline void kref_init(struct kref *kref) {
+	atomic_set(&kref->refcount, 1);
+}
+static inline void kref_get(struct kref *kref) {
+	atomic_inc(&kref->refcount);
+}
+static inline int kref_put(struct kref *kref,
+		void (*release)(struct kref *kref)) {
+	if (atomic_dec_and_test(&kref->refcount)) {
+		release(kref);
+		return 1;
+	}
+	return 0;
+}
+
+/* =============================================== */
+/* locking */
+
+typedef pthread_mutex_t spinlock_t;
+
+#define DEFINE_SPINLOCK(x) spinlock_t x = PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(lock) pthread_mutex_init(lock, NULL)
+#define spin_lock(lock) pthread_mutex_lock(lock)
+#define spin_unlock(lock) pthread_mutex_unlock(lock)
+#define spin_lock_irq spin_lock
+#define spin_unlock_irq spin_unlock
+#define spin_lock_bh spin_lock
+#define spin_unlock_bh spin_unlock
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define DEFINE_MUTEX(x) struct mutex x = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(lock) pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_lock(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_unlock(lock) pthread_mutex_unlock(&(lock)->m)
+#define mutex_trylock(lock) (pthread_mutex_trylock(&(lock)->m) == 0)
+#define mutex_lock_interruptible(lock) (mutex_lock(lock), 0)
+#define mutex_destroy(lock) pthread_mutex_destroy(&(lock)->m)
+
+struct rw_semaphore {
+	pthread_rwlock_t rw;
+};
+
+#define DECLARE_RWSEM(x) struct rw_semaphore x = { PTHREAD_RWLOCK_INITIALIZER }
+#define init_rwsem(sem) pthread_rwlock_init(&(sem)->rw, NULL)
+#define down_read(sem) pthread_rwlock_rdlock(&(sem)->rw)
+#define up_read(sem) pthread_rwlock_unlock(&(sem)->rw)
+#define down_write(sem) pthread_rwlock_wrlock(&(sem)->rw)
+#define up_write(sem) pthread_rwlock_unlock(&(sem)->rw)
+#define down_read_trylock(sem) (pthread_rwlock_tryrdlock(&(sem)->rw) == 0)
+#define down_write_trylock(sem) (pthread_rwlock_trywrlock(&(sem)->rw) == 0)
+
+/* no grace periods to wait for: nothing is freed under readers here */
+#define rcu_read_lock() barrier()
+#define rcu_read_unlock() barrier()
+#define synchronize_rcu() smp_mb()
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c) (p)
+#define lockdep_is_held(lock) 1
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELAXED)
+
+/* sleepable RCU: readers are counted, synchronize_srcu() waits them out */
+struct srcu_struct {
+	atomic_t readers;
+};
+
+#define init_srcu_struct(sp) (atomic_set(&(sp)->readers, 0), 0)
+#define cleanup_srcu_struct(sp) ((void) 0)
+#define srcu_read_lock(sp) (atomic_inc(&(sp)->readers), 0)
+#define srcu_read_unlock(sp, idx) ((void) (idx), atomic_dec(&(sp)->readers))
+#define srcu_dereference(p, sp) rcu_dereference(p)
+#define synchronize_srcu(sp) do { \
+	smp_mb(); \
+	while (atomic_read(&(sp)->readers) != 0) { \
+		sched_yield(); \
+	} \
+} while (0)
+
+/* =============================================== */
+/* scheduling & wait queues */
+
+#define TASK_RUNNING 0
+#define TASK_INTERRUPTIBLE 1
+#define TASK_UNINTERRUPTIBLE 2
+
+struct task_struct {
+	int pid;
+	/* kthreads only */
+	pthread_t thread;
+	int (*threadfn)(void *data);
+	void *data;
+	int ret;
+	bool should_stop;
+	bool killed; /* a fatal signal is pending, set by tests */
+	bool unprivileged; /* capable() fails, set by tests */
+};
+
+extern struct task_struct *shim_current(void);
+#define current shim_current()
+
+#define signal_pending(task) ((task)->killed)
+#define fatal_signal_pending(task) ((task)->killed)
+#define set_current_state(state) barrier()
+#define __set_current_state(state) barrier()
+#define cond_resched() ((void) 0)
+#define might_sleep() ((void) 0)
+
+/* a wake up bumps seq, sleepers wait for it to change */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long seq;
+} wait_queue_head_t;
+
+typedef struct {
+	wait_queue_head_t *wq;
+	unsigned long seq;
+} wait_queue_t;
+
+#define __WAIT_QUEUE_HEAD_INITIALIZER(name) \
+	{ PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
+#define DECLARE_WAIT_QUEUE_HEAD(name) \
+	wait_queue_head_t name = __WAIT_QUEUE_HEAD_INITIALIZER(name)
+#define DEFINE_WAIT(name) wait_queue_t name = { NULL, 0 }
+
+void
+init_waitqueue_head(wait_queue_head_t *wq);
+unsigned long
+shim_wait_seq(wait_queue_head_t *wq);
+void
+shim_wait_change(wait_queue_head_t *wq, unsigned long seq);
+void
+__wake_up(wait_queue_head_t *wq);
+void
+prepare_to_wait(wait_queue_head_t *wq, wait_queue_t *wait, int state);
+void
+finish_wait(wait_queue_head_t *wq, wait_queue_t *wait);
+void
+schedule(void);
+
+/* kthreads are plain threads, kthread_stop() joins them */
+struct task_struct *
+kthread_run(int (*threadfn)(void *data), void *data, const char *namefmt,
+		...);
+bool
+kthread_should_stop(void);
+int
+kthread_stop(struct task_struct *task);
+#define wake_up_process(task) 1
+
+#define wake_up(wq) __wake_up(wq)
+#define wake_up_all(wq) __wake_up(wq)
+#define wake_up_interruptible(wq) __wake_up(wq)
+#define wake_up_interruptible_all(wq) __wake_up(wq)
+#define waitqueue_active(wq) 1
+
+#define wait_event(wq, condition) do { \
+	unsigned long __seq; \
+	for (;;) { \
+		__seq = shim_wait_seq(&(wq)); \
+		if (condition) \
+			break; \
+		shim_wait_change(&(wq), __seq); \
+	} \
+} while (0)
+
+#define wait_event_interruptible(wq, condition) ({ \
+	wait_event(wq, condition); \
+	0; \
+})
+
+/* gives up only on a fatal signal, the condition is checked first */
+#define wait_event_killable(wq, condition) ({ \
+	unsigned long __seq; \
+	int __ret = 0; \
+	for (;;) { \
+		__seq = shim_wait_seq(&(wq)); \
+		if (condition) \
+			break; \
+		if (fatal_signal_pending(current)) { \
+			__ret = -ERESTARTSYS; \
+			break; \
+		} \
+		shim_wait_change(&(wq), __seq); \
+	} \
+	__ret; \
+})
+
+/* workqueues: max_active threads draining a FIFO */
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+	struct list_head entry; /* empty unless pending */
+	work_func_t func;
+};
+
+struct workqueue_struct;
+
+#define WQ_UNBOUND (1 << 1)
+#define WQ_MEM_RECLAIM (1 << 3)
+#define WQ_HIGHPRI (1 << 4)
+
+#define INIT_WORK(work, fn) do { \
+	INIT_LIST_HEAD(&(work)->entry); \
+	(work)->func = (fn); \
+} while (0)
+
+struct workqueue_struct *
+alloc_workqueue(const char *fmt, unsigned int flags, int max_active, ...);
+bool
+queue_work(struct workqueue_struct *wq, struct work_struct *work);
+void
+flush_workqueue(struct workqueue_struct *wq);
+void
+destroy_workqueue(struct workqueue_struct *wq);
+
+/* =============================================== */
+/* time */
+
+u64
+local_clock(void);
+
+#define HZ 250
+#define jiffies ((unsigned long) (local_clock() / (1000000000ULL / HZ)))
+#define time_after(a, b) ((long) ((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+#define msecs_to_jiffies(ms) ((unsigned long) (ms) * HZ / 1000)
+#define ktime_get_ns() local_clock()
+#define sched_clock() local_clock()
+
+void
+msleep(unsigned int msecs);
+unsigned long
+msleep_interruptible(unsigned int msecs);
+#define udelay(us) usleep(us)
+#define ndelay(ns) ((void) 0)
+
+/* =============================================== */
+/* pages */
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(addr) ALIGN(addr, PAGE_SIZE)
+#define PAGE_ALLOC_COSTLY_ORDER 3
+#define HPAGE_PMD_ORDER 9
+#define offset_in_page(p) ((unsigned long) (p) & ~PAGE_MASK)
+
+struct address_space;
+
+/* pages of one allocation share head, freed when all of them are */
+struct page {
+	void *virtual;
+	atomic_t _count;
+	pgoff_t index;
+	unsigned long flags;
+	unsigned long private;
+	struct address_space *mapping;
+	struct page *head;
+	atomic_t units; /* head only: independently freed units */
+};
+
+struct page *
+alloc_pages(gfp_t gfp, unsigned int order);
+void
+split_page(struct page *page, unsigned int order);
+void
+put_page(struct page *page);
+struct page *
+shim_zero_page(void);
+
+#define alloc_page(gfp) alloc_pages(gfp, 0)
+#define alloc_pages_node(nid, gfp, order) alloc_pages(gfp, order)
+#define __free_page(page) put_page(page)
+#define __free_pages(page, order) put_page(page)
+#define ZERO_PAGE(vaddr) shim_zero_page()
+#define get_page(page) atomic_inc(&(page)->_count)
+#define page_count(page) atomic_read(&(page)->_count)
+#define page_address(page) ((page)->virtual)
+#define lowmem_page_address(page) ((page)->virtual)
+
+static inline void *kmap(struct page *page) { return page->virtual; }
+static inline void kunmap(struct page *page) { }
+static inline void *kmap_atomic(struct page *page) { return page->virtual; }
+static inline void kunmap_atomic(void *addr) { }
+
+static inline void clear_highpage(struct page *page) {
+	memset(page->virtual, 0, PAGE_SIZE);
+}
+static inline void copy_highpage(struct page *to, struct page *from) {
+	memcpy(to->virtual, from->virtual, PAGE_SIZE);
+}
+static inline void zero_user_segment(struct page *page, unsigned int start,
+		unsigned int end) {
+	memset((char *) page->virtual + start, 0, end - start);
+}
+static inline void zero_user(struct page *page, unsigned int start,
+		unsigned int size) {
+	zero_user_segment(page, start, start + size);
+}
+
+/* =============================================== */
+/* radix tree: two-level table, enough for up to 16G of 4K pages */
+
+#define SHIM_RADIX_SHIFT 12
+#define SHIM_RADIX_LEAF (1UL << SHIM_RADIX_SHIFT)
+#define SHIM_RADIX_MAX (SHIM_RADIX_LEAF * SHIM_RADIX_LEAF)
+#define RADIX_TREE_MAX_TAGS 3
+
+struct radix_tree_root {
+	void ***dir;
+	unsigned char **tags; /* bit per tag, laid out like dir */
+	unsigned long count;
+	unsigned long tagged[RADIX_TREE_MAX_TAGS]; /* items with each tag */
+};
+
+struct radix_tree_iter {
+	unsigned long index;
+};
+
+#define RADIX_TREE_INIT(mask) { NULL, NULL, 0, { 0 } }
+#define RADIX_TREE(name, mask) struct radix_tree_root name = RADIX_TREE_INIT(mask)
+#define INIT_RADIX_TREE(root, mask) \
+	(*(root) = (struct radix_tree_root) RADIX_TREE_INIT(mask))
+
+#define radix_tree_preload(gfp) 0
+#define radix_tree_preload_end() ((void) 0)
+#define radix_tree_deref_slot(slot) (*(slot))
+#define radix_tree_replace_slot(slot, item) \
+	__atomic_store_n((slot), (item), __ATOMIC_RELEASE)
+
+int
+radix_tree_insert(struct radix_tree_root *root, unsigned long index,
+		void *item);
+void *
+radix_tree_lookup(struct radix_tree_root *root, unsigned long index);
+void *
+radix_tree_delete(struct radix_tree_root *root, unsigned long index);
+void **
+radix_tree_lookup_slot(struct radix_tree_root *root, unsigned long index);
+unsigned int
+radix_tree_gang_lookup(struct radix_tree_root *root, void **results,
+		unsigned long first_index, unsigned int max_items);
+void *
+radix_tree_tag_set(struct radix_tree_root *root, unsigned long index,
+		unsigned int tag);
+void *
+radix_tree_tag_clear(struct radix_tree_root *root, unsigned long index,
+		unsigned int tag);
+int
+radix_tree_tag_get(struct radix_tree_root *root, unsigned long index,
+		unsigned int tag);
+int
+radix_tree_tagged(struct radix_tree_root *root, unsigned int tag);
+unsigned int
+radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results,
+		unsigned long first_index, unsigned int max_items, unsigned int tag);
+void **
+shim_radix_next_slot(struct radix_tree_root *root, unsigned long *index);
+
+#define radix_tree_for_each_slot(slot, root, iter, start) \
+	for ((iter)->index = (start); \
+			((slot) = shim_radix_next_slot((root), &(iter)->index)) != NULL; \
+			(iter)->index++)
+
+/* =============================================== */
+/* strings */
+
+static inline void *memchr_inv(const void *start, int c, size_t bytes) {
+	const unsigned char *p = start;
+	size_t i;
+
+	for (i = 0; i < bytes; ++i) {
+		if (p[i] != (unsigned char) c) {
+			return (void *) (p + i);
+		}
+	}
+	return NULL;
+}
+
+/* =============================================== */
+/* user memory & iov_iter */
+
+#define READ 0
+#define WRITE 1
+#define MAX_RW_COUNT (INT_MAX & PAGE_MASK)
+
+#define access_ok(type, addr, size) 1
+#define VERIFY_READ 0
+#define VERIFY_WRITE 1
+
+static inline unsigned long copy_to_user(void __user *to, const void *from,
+		unsigned long n) {
+	if (n) { /* NULL is fine for nothing */
+		memcpy(to, from, n);
+	}
+	return 0;
+}
+static inline unsigned long copy_from_user(void *to, const void __user *from,
+		unsigned long n) {
+	if (n) { /* NULL is fine for nothing */
+		memcpy(to, from, n);
+	}
+	return 0;
+}
+static inline long strncpy_from_user(char *dst, const char __user *src,
+		long count) {
+	long len = strnlen(src, count);
+	memcpy(dst, src, len < count ? len + 1 : count);
+	return len;
+}
+static inline long strnlen_user(const char __user *str, long n) {
+	return strnlen(str, n) + 1;
+}
+static inline void *memdup_user(const void __user *src, size_t len) {
+	void *p = kmalloc(len, GFP_KERNEL);
+
+	if (p == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+	memcpy(p, src, len);
+	return p;
+}
+#define get_user(x, ptr) ({ (x) = *(ptr); 0; })
+#define put_user(x, ptr) ({ *(ptr) = (x); 0; })
+#define clear_user(to, n) (memset((to), 0, (n)), 0)
+
+struct iov_iter {
+	int type;
+	size_t iov_offset;
+	size_t count;
+	const struct iovec *iov;
+	unsigned long nr_segs;
+};
+
+void
+iov_iter_init(struct iov_iter *i, int direction, const struct iovec *iov,
+		unsigned long nr_segs, size_t count);
+size_t
+copy_page_to_iter(struct page *page, size_t offset, size_t bytes,
+		struct iov_iter *i);
+size_t
+copy_page_from_iter(struct page *page, size_t offset, size_t bytes,
+		struct iov_iter *i);
+void
+iov_iter_advance(struct iov_iter *i, size_t bytes);
+
+static inline size_t iov_iter_count(struct iov_iter *i) {
+	return i->count;
+}
+
+/* =============================================== */
+/* files, devices & modules: just enough for the glue to build */
+
+struct module {
+	const char *name;
+};
+
+struct inode {
+	dev_t i_rdev;
+	void *i_private;
+};
+
+struct dentry {
+	struct inode *d_inode;
+};
+
+struct fasync_struct;
+
+#define FMODE_READ 0x1
+#define FMODE_WRITE 0x2
+
+struct file {
+	unsigned int f_flags;
+	fmode_t f_mode;
+	loff_t f_pos;
+	void *private_data;
+	struct dentry *f_dentry;
+	struct address_space *f_mapping;
+	int shim_fd; /* host file behind kernel_read()/kernel_write() */
+};
+
+struct kiocb {
+	struct file *ki_filp;
+	loff_t ki_pos;
+};
+
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+/* the "user" mapping is the kernel memory itself, one address space */
+struct vm_area_struct {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_pgoff;
+	unsigned long vm_flags;
+	void *vm_private_data;
+};
+
+static inline void *vmalloc_user(unsigned long size) {
+	void *p = aligned_alloc(PAGE_SIZE, PAGE_ALIGN(size));
+
+	if (p != NULL) {
+		memset(p, 0, PAGE_ALIGN(size));
+	}
+	return p;
+}
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr,
+		unsigned long pgoff) {
+	vma->vm_start = (unsigned long) addr + (pgoff << PAGE_SHIFT);
+	return 0;
+}
+
+struct file_operations {
+	struct module *owner;
+	loff_t (*llseek)(struct file *, loff_t, int);
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	ssize_t (*read_iter)(struct kiocb *, struct iov_iter *);
+	ssize_t (*write_iter)(struct kiocb *, struct iov_iter *);
+	unsigned int (*poll)(struct file *, poll_table *);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	long (*compat_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*mmap)(struct file *, struct vm_area_struct *);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+	int (*fsync)(struct file *, loff_t, loff_t, int);
+	int (*fasync)(int, struct file *, int);
+};
+
+/* in-kernel file I/O, 3.x signatures */
+static inline int
+kernel_read(struct file *file, loff_t offset, char *addr, unsigned long count) {
+	ssize_t ret = pread(file->shim_fd, addr, count, offset);
+	return ret < 0 ? -errno : ret;
+}
+static inline ssize_t
+kernel_write(struct file *file, const char *buf, size_t count, loff_t pos) {
+	ssize_t ret = pwrite(file->shim_fd, buf, count, pos);
+	return ret < 0 ? -errno : ret;
+}
+static inline loff_t
+vfs_llseek(struct file *file, loff_t offset, int whence) {
+	off_t ret = lseek(file->shim_fd, offset, whence);
+	return ret < 0 ? -errno : ret;
+}
+static inline int
+vfs_fsync(struct file *file, int datasync) {
+	return (datasync ? fdatasync(file->shim_fd) : fsync(file->shim_fd)) < 0
+			? -errno : 0;
+}
+
+#define poll_wait(fp, wq, pt) ((void) 0)
+#define nonseekable_open(inode, fp) 0
+#define kill_fasync(fa, sig, band) ((void) 0)
+#define fasync_helper(fd, fp, on, fa) 0
+
+#define MINORBITS 20
+#define MINORMASK ((1U << MINORBITS) - 1)
+#define MAJOR(dev) ((unsigned int) ((dev) >> MINORBITS))
+#define MINOR(dev) ((unsigned int) ((dev) & MINORMASK))
+#define MKDEV(ma, mi) (((dev_t) (ma) << MINORBITS) | (mi))
+#define iminor(inode) MINOR((inode)->i_rdev)
+#define imajor(inode) MAJOR((inode)->i_rdev)
+
+struct cdev {
+	struct module *owner;
+	const struct file_operations *ops;
+	dev_t dev;
+};
+
+struct class {
+	const char *name;
+};
+
+struct device {
+	dev_t devt;
+	void *driver_data;
+};
+
+static inline void cdev_init(struct cdev *cdev,
+		const struct file_operations *fops) {
+	memset(cdev, 0, sizeof(*cdev));
+	cdev->ops = fops;
+}
+static inline struct cdev *cdev_alloc(void) {
+	return calloc(1, sizeof(struct cdev));
+}
+static inline int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count) {
+	cdev->dev = dev;
+	return 0;
+}
+#define cdev_del(cdev) ((void) 0)
+
+int
+alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count,
+		const char *name);
+#define unregister_chrdev_region(first, count) ((void) 0)
+
+struct class *
+shim_class_create(const char *name);
+#define class_create(owner, name) shim_class_create(name)
+#define class_destroy(cls) ((void) 0)
+
+struct device *
+device_create(struct class *cls, struct device *parent, dev_t devt,
+		void *drvdata, const char *fmt, ...);
+#define device_destroy(cls, devt) ((void) 0)
+#define dev_get_drvdata(dev) ((dev)->driver_data)
+
+struct dentry *
+debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *
+debugfs_create_file(const char *name, umode_t mode, struct dentry *parent,
+		void *data, const struct file_operations *fops);
+#define debugfs_remove(dentry) ((void) 0)
+#define debugfs_remove_recursive(dentry) ((void) 0)
+
+/* module_init()/module_exit() register by KBUILD_MODNAME, see below */
+void
+shim_register_module(const char *name, int (*init)(void),
+		void (*exit)(void));
+int
+shim_load_module(const char *name);
+void
+shim_unload_module(const char *name);
+
+#define THIS_MODULE (&__shim_this_module)
+static struct module __shim_this_module
+		__attribute__((unused)) = { KBUILD_MODNAME };
+
+#define module_init(fn) \
+	static void __attribute__((constructor)) __shim_init_##fn(void) { \
+		shim_register_module(KBUILD_MODNAME, fn, NULL); \
+	}
+#define module_exit(fn) \
+	static void __attribute__((constructor)) __shim_exit_##fn(void) { \
+		shim_register_module(KBUILD_MODNAME, NULL, fn); \
+	}
+
+#define try_module_get(mod) true
+#define module_put(mod) ((void) 0)
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+#define module_param_named(name, var, type, perm)
+
+#define capable(cap) (!current->unprivileged)
+#define CAP_SYS_NICE 23
+#define CAP_SYS_ADMIN 21
+
+static inline bool sysfs_streq(const char *s1, const char *s2) {
+	size_t n1 = strcspn(s1, "\n"), n2 = strcspn(s2, "\n");
+	return n1 == n2 && !strncmp(s1, s2, n1);
+}
+
+#endif /* _KSHIM_H */
@@ -0,0 +1,3 @@
+/* userspace stand-in, see kshim.h */
+#include_next <linux/errno.h>
+#include "../kshim.h"
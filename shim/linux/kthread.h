@@ -0,0 +1,2 @@
+/* userspace stand-in, see kshim.h */
+#include "../kshim.h"
@@ -0,0 +1,8 @@
+/* userspace stand-in, see kshim.h: the kernel's LZO1X is liblzo2's */
+#include <lzo/lzo1x.h>
+#include "../kshim.h"
+
+static void __attribute__((constructor, unused))
+shim_lzo_init(void) {
+	BUG_ON(lzo_init() != LZO_E_OK);
+}
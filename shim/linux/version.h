@@ -0,0 +1,3 @@
+/* userspace stand-in, see kshim.h */
+#include_next <linux/version.h>
+#include "../kshim.h"
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "task21_ioctl.h"
+
+/*
+ *  Task 2.1
+ *  Throughput/latency benchmark for /dev/poumsN. Every combination of
+ *  pattern, thread count and block size is run for a fixed time and
+ *  reported as one CSV line, so results of driver versions can be diffed.
+ *
+ *  ./bench_task21 [-d device] [-c capacity] [-s seconds]
+ *                 [-t threads,...] [-b block,...] [-p pattern,...]
+ *
+ *  Patterns: seqread randread seqwrite randwrite append seekwrite slotwrite
+ *            batchread batchwrite
+ *  slotwrite: every thread overwrites its own block-sized slot of the
+ *  prefilled device with lseek+write, shows how disjoint writers scale
+ *  batch*: random blocks, BATCH of them per IOCTL_IO_BATCH call; ops count
+ *  blocks, latencies are per call
+ */
+
+#define LOG "bench_task21: "
+#define MAXTHREADS 256
+#define MAXLIST 16
+#define MAXSAMPLES (1 << 18) /* latency samples kept per thread */
+#define BATCH 64 /* entries per batch* call */
+
+enum pattern {
+	SEQREAD, RANDREAD, SEQWRITE, RANDWRITE, APPEND, SEEKWRITE, SLOTWRITE,
+	BATCHREAD, BATCHWRITE, NPATTERNS
+};
+
+static const char *pattern_names[NPATTERNS] = { "seqread", "randread",
+		"seqwrite", "randwrite", "append", "seekwrite", "slotwrite",
+		"batchread", "batchwrite" };
+
+static const char *device = "/dev/poums0";
+static long long capacity = 0; /* taken from sysfs if not given */
+static int seconds = 2;
+static volatile int stop = 0;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	enum pattern pattern;
+	size_t block;
+	unsigned long long ops;
+	unsigned long long bytes;
+	unsigned long long *samples; /* latencies in ns, reservoir sampled */
+	unsigned long nsamples;
+	unsigned int seed;
+	int err;
+};
+
+static unsigned long long
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+parse_list(char *arg, long long *list) {
+	char *tok;
+	int n = 0;
+
+	for (tok = strtok(arg, ","); tok != NULL && n < MAXLIST;
+			tok = strtok(NULL, ",")) {
+		list[n++] = atoll(tok);
+	}
+
+	return n;
+}
+
+static int
+parse_patterns(char *arg, int *list) {
+	char *tok;
+	int n = 0, i;
+
+	for (tok = strtok(arg, ","); tok != NULL && n < MAXLIST;
+			tok = strtok(NULL, ",")) {
+		for (i = 0; i < NPATTERNS; ++i) {
+			if (!strcmp(tok, pattern_names[i])) {
+				break;
+			}
+		}
+		if (i == NPATTERNS) {
+			printf(LOG "unknown pattern %s\n", tok);
+			return -1;
+		}
+		list[n++] = i;
+	}
+
+	return n;
+}
+
+static long long
+read_capacity(void) {
+	const char *name = strrchr(device, '/');
+	char path[256];
+	long long value = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/poums/%s/capacity",
+			name ? name + 1 : device);
+	if ((f = fopen(path, "r")) != NULL) {
+		if (fscanf(f, "%lld", &value) != 1) {
+			value = -1;
+		}
+		fclose(f);
+	}
+
+	return value;
+}
+
+static void
+record(struct worker *w, unsigned long long ns) {
+	unsigned long slot;
+
+	if (w->nsamples < MAXSAMPLES) {
+		w->samples[w->nsamples++] = ns;
+		return;
+	}
+
+	slot = rand_r(&w->seed) % (w->ops + 1);
+	if (slot < MAXSAMPLES) {
+		w->samples[slot] = ns;
+	}
+}
+
+static void *
+worker_loop(void *arg) {
+	struct worker *w = arg;
+	long long blocks = capacity / w->block;
+	off_t off = (off_t) (w->id % blocks) * w->block;
+	struct poums_io ios[BATCH];
+	struct poums_io_batch batch = { .count = BATCH,
+			.ios = (unsigned long) ios };
+	unsigned long long start;
+	ssize_t ret;
+	char *buf;
+	int fd, flags, i;
+
+	buf = malloc(w->block);
+	flags = w->pattern <= RANDREAD || w->pattern == BATCHREAD ? O_RDONLY
+			: O_WRONLY;
+	if (w->pattern == APPEND) {
+		flags |= O_APPEND;
+	}
+
+	if (buf == NULL || (fd = open(device, flags)) < 0) {
+		w->err = -1;
+		free(buf);
+		return NULL;
+	}
+
+	memset(buf, 'a' + w->id % 26, w->block);
+	memset(ios, 0, sizeof(ios));
+	for (i = 0; i < BATCH; ++i) {
+		ios[i].op = w->pattern == BATCHWRITE ? POUMS_IO_WRITE : POUMS_IO_READ;
+		ios[i].length = w->block;
+		ios[i].buf = (unsigned long) buf; /* contents don't matter */
+	}
+
+	while (!stop) {
+		if (w->pattern == BATCHREAD || w->pattern == BATCHWRITE) {
+			for (i = 0; i < BATCH; ++i) {
+				ios[i].offset = (rand_r(&w->seed) % blocks) * w->block;
+			}
+
+			start = now_ns();
+			ret = ioctl(fd, IOCTL_IO_BATCH, &batch);
+			record(w, now_ns() - start);
+
+			if (ret != BATCH) {
+				w->err = -1;
+				break;
+			}
+			for (i = 0; i < BATCH; ++i) {
+				w->ops += ios[i].result > 0;
+				w->bytes += ios[i].result > 0 ? ios[i].result : 0;
+			}
+			continue;
+		}
+
+		if (w->pattern == RANDREAD || w->pattern == RANDWRITE
+				|| w->pattern == SEEKWRITE) {
+			off = (off_t) (rand_r(&w->seed) % blocks) * w->block;
+		}
+
+		start = now_ns();
+		switch (w->pattern) {
+		case SEQREAD:
+		case RANDREAD:
+			ret = pread(fd, buf, w->block, off);
+			break;
+		case SEQWRITE:
+		case RANDWRITE:
+			ret = pwrite(fd, buf, w->block, off);
+			break;
+		case APPEND:
+			ret = write(fd, buf, w->block);
+			break;
+		default: /* SEEKWRITE, SLOTWRITE */
+			ret = lseek(fd, off, SEEK_SET) < 0 ? -1
+					: write(fd, buf, w->block);
+			break;
+		}
+		record(w, now_ns() - start);
+
+		if (ret < 0) {
+			w->err = -1;
+			break;
+		}
+
+		/* a full device is truncated outside of the measurement */
+		if (w->pattern == APPEND && ret <= 0) {
+			close(open(device, O_WRONLY | O_TRUNC));
+			continue;
+		}
+
+		++w->ops;
+		w->bytes += ret;
+		if (w->pattern == SLOTWRITE) {
+			continue; /* same slot again */
+		}
+
+		off += w->block;
+		if (off + (off_t) w->block > capacity) {
+			off = 0;
+		}
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int
+compare_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long
+percentile(unsigned long long *sorted, unsigned long n, double p) {
+	unsigned long i = (unsigned long) (p * n);
+	return n == 0 ? 0 : sorted[i < n ? i : n - 1];
+}
+
+static int
+prefill(void) {
+	char buf[65536];
+	long long off;
+	ssize_t ret;
+	int fd;
+
+	if ((fd = open(device, O_WRONLY | O_TRUNC)) < 0) {
+		return -1;
+	}
+
+	memset(buf, '*', sizeof(buf));
+	for (off = 0; off < capacity; off += ret) {
+		ret = write(fd, buf, capacity - off < (long long) sizeof(buf)
+				? capacity - off : (long long) sizeof(buf));
+		if (ret <= 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int
+run(enum pattern pattern, int threads, size_t block) {
+	static struct worker workers[MAXTHREADS];
+	unsigned long long ops = 0, bytes = 0, *all;
+	unsigned long n = 0;
+	double elapsed;
+	unsigned long long start;
+	int i, err = 0;
+
+	if ((pattern <= RANDREAD || pattern == SLOTWRITE || pattern == BATCHREAD)
+			&& prefill() < 0) {
+		printf(LOG "unable to fill %s\n", device);
+		return -1;
+	}
+	if (pattern == APPEND) {
+		close(open(device, O_WRONLY | O_TRUNC));
+	}
+
+	memset(workers, 0, sizeof(workers));
+	stop = 0;
+	start = now_ns();
+
+	for (i = 0; i < threads; ++i) {
+		workers[i].id = i;
+		workers[i].pattern = pattern;
+		workers[i].block = block;
+		workers[i].seed = i + 1;
+		workers[i].samples = malloc(MAXSAMPLES * sizeof(unsigned long long));
+		pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		err |= workers[i].err;
+		ops += workers[i].ops;
+		bytes += workers[i].bytes;
+		n += workers[i].nsamples;
+	}
+	elapsed = (now_ns() - start) / 1e9;
+
+	/* merge per-thread samples */
+	all = malloc((n ? n : 1) * sizeof(unsigned long long));
+	for (i = 0, n = 0; i < threads; ++i) {
+		memcpy(all + n, workers[i].samples,
+				workers[i].nsamples * sizeof(unsigned long long));
+		n += workers[i].nsamples;
+		free(workers[i].samples);
+	}
+	qsort(all, n, sizeof(unsigned long long), compare_ull);
+
+	if (err) {
+		printf(LOG "%s threads=%d block=%zu failed\n", pattern_names[pattern],
+				threads, block);
+	} else {
+		printf("%s,%d,%zu,%.3f,%llu,%.0f,%.2f,%llu,%llu,%llu\n",
+				pattern_names[pattern], threads, block, elapsed, ops,
+				ops / elapsed, bytes / elapsed / (1024 * 1024),
+				percentile(all, n, 0.50), percentile(all, n, 0.99),
+				percentile(all, n, 0.999));
+	}
+
+	fflush(stdout);
+	free(all);
+	return err;
+}
+
+int main(int argc, char **argv) {
+	long long threads[MAXLIST] = { 1, 2, 4, 8 }, blocks[MAXLIST] = { 4096 };
+	int patterns[MAXLIST] = { SEQREAD, RANDREAD, SEQWRITE, RANDWRITE, APPEND,
+			SEEKWRITE, SLOTWRITE, BATCHREAD, BATCHWRITE };
+	int nthreads = 4, nblocks = 1, npatterns = NPATTERNS;
+	int opt, p, t, b, err = 0;
+
+	while ((opt = getopt(argc, argv, "d:c:s:t:b:p:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'c':
+			capacity = atoll(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 't':
+			nthreads = parse_list(optarg, threads);
+			break;
+		case 'b':
+			nblocks = parse_list(optarg, blocks);
+			break;
+		case 'p':
+			npatterns = parse_patterns(optarg, patterns);
+			break;
+		default:
+			npatterns = -1;
+			break;
+		}
+	}
+
+	if (capacity == 0) {
+		capacity = read_capacity();
+	}
+
+	for (t = 0; t < nthreads; ++t) {
+		err |= threads[t] < 1 || threads[t] > MAXTHREADS;
+	}
+	for (b = 0; b < nblocks; ++b) {
+		err |= blocks[b] < 1 || blocks[b] > capacity;
+	}
+
+	if (err || npatterns < 1 || seconds < 1 || capacity < 1) {
+		printf("usage:\n"
+				"./bench_task21 [-d device] [-c capacity] [-s seconds]\n"
+				"               [-t threads,...] [-b block,...] "
+				"[-p pattern,...]\n"
+				"threads: 1-%d, block: 1-capacity, patterns: seqread "
+				"randread seqwrite randwrite append seekwrite slotwrite "
+				"batchread batchwrite\n", MAXTHREADS);
+		return -1;
+	}
+
+	printf("pattern,threads,block,seconds,ops,ops_s,mb_s,p50_ns,p99_ns,"
+			"p999_ns\n");
+
+	for (p = 0; p < npatterns; ++p) {
+		for (t = 0; t < nthreads; ++t) {
+			for (b = 0; b < nblocks; ++b) {
+				err |= run(patterns[p], threads[t], blocks[b]);
+			}
+		}
+	}
+
+	return err ? -1 : 0;
+}
@@ -16,31 +16,123 @@
 #include <linux/err.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/huge_mm.h>
+#include <linux/string.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/poll.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
 #include <linux/mutex.h>
+#include <linux/capability.h>
+#include <linux/numa.h>
+#include <linux/nodemask.h>
+#include <linux/jiffies.h>
+#include <linux/shrinker.h>
+#include <linux/namei.h>
+#include <linux/dcache.h>
 
 #include <asm/uaccess.h>
 
-#define NUM_MAX 8 /* maximum number of devices */
+#include "task21_ioctl.h"
+#include "task21_storage.h"
+
+#define NUM_MAX 256 /* maximum number of devices */
+#define CTL_MINOR NUM_MAX /* minor of the control node, after the devices */
 #define BUFFSIZE 4096 /* default buffer size to store char-data */
 #define BASENAME "poums" /* defines is a good thing xD */
+#define CTL_NAME BASENAME "-ctl"
 #define LOG "task21: "
 
-/* device representation */
-struct poums_device {
-	char *data; /* char buf */
-	ssize_t size; /* amount of data stored in buf */
-	dev_t devt; /* numbers for debug purposes */
-	struct mutex mutex; /* mutex lock */
-	struct cdev cdev;
+#define POUMS_LAT_SHIFT 8 /* first latency bucket covers < 256 ns */
+#define POUMS_LAT_BUCKETS 20 /* log2 buckets, the last one is open-ended */
+
+/* per-CPU device statistics, summed up on sysfs read */
+struct poums_stats {
+	u64 reads; /* read and splice_read calls */
+	u64 writes; /* write calls */
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 lock_wait_ns; /* time spent waiting for dev->sem */
+	u64 latency[POUMS_LAT_BUCKETS]; /* op latency histogram */
 };
 
+/* per open file state */
+struct poums_file {
+	struct poums_device *dev;
+	bool stream; /* block at the end of data instead of EOF */
+};
+
+static inline struct poums_file *
+poums_file(struct file *fp) {
+	return fp->private_data;
+}
+
+static inline struct poums_device *
+poums_dev(struct file *fp) {
+	return poums_file(fp)->dev;
+}
+
+static inline bool
+valid_numa_node(int nid) {
+	return nid == NUMA_NO_NODE
+			|| (nid >= 0 && nid < nr_node_ids && node_online(nid));
+}
+
 /* helpers */
 static int
 init_poums_device(struct poums_device *dev, unsigned int minor);
+static struct poums_device *
+create_poums_device(unsigned long capacity, struct poums_device *origin,
+		int minor);
+static int
+take_poums_snapshot(struct poums_device *snap, struct poums_device *origin);
+static void
+destroy_poums_device(struct poums_device *dev);
+static void
+destroy_poums_devices(void);
+static void
+release_poums_device(struct kref *kref);
+static void
+put_poums_device(struct poums_device *dev);
+static int
+resize_poums_device(struct poums_device *dev, unsigned long capacity);
+static long
+poums_io_batch(struct file *fp, struct poums_io_batch __user *arg);
+static void
+account_poums_op(struct poums_device *dev, bool write, ssize_t ret,
+		u64 start, u64 locked);
+static void
+sum_poums_stats(struct poums_device *dev, struct poums_stats *sum);
+static bool
+poums_device_idle(struct poums_device *dev);
+static unsigned long
+poums_shrink_count(struct shrinker *shrinker, struct shrink_control *sc);
+static unsigned long
+poums_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc);
+static struct file *
+open_poums_backing(struct poums_device *dev, const char *suffix, int flags);
+static int
+commit_poums_backing(struct poums_device *dev, struct file *file);
+static int
+restore_poums_device(struct poums_device *dev);
 static void
-deinit_poums_devices(unsigned int num);
+drop_poums_image(struct poums_device *dev);
+static int
+save_poums_device(struct poums_device *dev);
 static void
-destroy_created_devices(unsigned int num, struct class *dev_class);
+save_poums_devices(void);
 /* =============================================== */
 
 /* fops */
@@ -49,13 +141,63 @@ poums_open(struct inode *, struct file *);
 static int
 poums_close(struct inode *, struct file *);
 static ssize_t
-poums_read(struct file *, char __user *, size_t, loff_t *);
+poums_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t
+poums_write_iter(struct kiocb *, struct iov_iter *);
 static ssize_t
-poums_write(struct file *, const char __user *, size_t, loff_t *);
+poums_splice_read(struct file *, loff_t *, struct pipe_inode_info *, size_t,
+		unsigned int);
 static loff_t
 poums_llseek(struct file *, loff_t, int);
+static int
+poums_mmap(struct file *, struct vm_area_struct *);
+static unsigned int
+poums_poll(struct file *, poll_table *);
+static int
+poums_fasync(int, struct file *, int);
+static int
+poums_fsync(struct file *, loff_t, loff_t, int);
+static long
+poums_ioctl(struct file *, unsigned int, unsigned long);
 
 struct file_operations poums_fops = { .owner = THIS_MODULE, .open = poums_open,
-		.release = poums_close, .read = poums_read, .write = poums_write,
-		.llseek = poums_llseek };
+		.release = poums_close, .read = new_sync_read, .write = new_sync_write,
+		.read_iter = poums_read_iter, .write_iter = poums_write_iter,
+		.splice_read = poums_splice_read,
+		.splice_write = iter_file_splice_write,
+		.llseek = poums_llseek, .mmap = poums_mmap, .poll = poums_poll,
+		.fasync = poums_fasync, .fsync = poums_fsync,
+		.unlocked_ioctl = poums_ioctl };
+
+/* control node fops */
+static long
+poums_ctl_ioctl(struct file *, unsigned int, unsigned long);
+
+struct file_operations poums_ctl_fops = { .owner = THIS_MODULE,
+		.unlocked_ioctl = poums_ctl_ioctl };
+
+/* splice ops */
+static void
+poums_spd_release(struct splice_pipe_desc *, unsigned int);
+static int
+poums_pipe_buf_steal(struct pipe_inode_info *, struct pipe_buffer *);
+
+static const struct pipe_buf_operations poums_pipe_buf_ops = {
+		.can_merge = 0, .confirm = generic_pipe_buf_confirm,
+		.release = generic_pipe_buf_release, .steal = poums_pipe_buf_steal,
+		.get = generic_pipe_buf_get };
+
+/* vm ops */
+static void
+poums_vm_open(struct vm_area_struct *);
+static void
+poums_vm_close(struct vm_area_struct *);
+static int
+poums_vm_fault(struct vm_area_struct *, struct vm_fault *);
+static int
+poums_vm_page_mkwrite(struct vm_area_struct *, struct vm_fault *);
+
+static const struct vm_operations_struct poums_vm_ops = {
+		.open = poums_vm_open, .close = poums_vm_close,
+		.fault = poums_vm_fault, .page_mkwrite = poums_vm_page_mkwrite };
 
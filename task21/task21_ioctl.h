@@ -0,0 +1,75 @@
+/*
+ * task21_ioctl.h
+ *
+ *      Author: Maxim Kouprianov
+ */
+
+#ifndef _TASK21_IOCTL_H
+#define _TASK21_IOCTL_H
+
+#include <linux/ioctl.h>
+
+#define POUMS_IOC_MAGIC ('p')
+
+/*
+ * arg != 0: switch the open file to stream mode, where reads at the end
+ * of data block (or fail with EAGAIN) until more data is written.
+ * arg == 0: back to regular file semantics.
+ */
+#define IOCTL_SET_STREAM _IO(POUMS_IOC_MAGIC, 0x01)
+
+/* one access of a batch */
+struct poums_io {
+	unsigned int op; /* POUMS_IO_READ or POUMS_IO_WRITE */
+	unsigned int flags; /* must be 0 */
+	unsigned long long offset;
+	unsigned long long length;
+	unsigned long long buf; /* user buffer */
+	long long result; /* out: bytes transferred or -errno */
+};
+
+#define POUMS_IO_READ 0 /* like pread, but never blocks in stream mode */
+#define POUMS_IO_WRITE 1 /* like pwrite */
+#define POUMS_IO_BATCH_MAX 1024 /* entries per call */
+
+struct poums_io_batch {
+	unsigned int count; /* entries in ios */
+	unsigned int flags; /* must be 0 */
+	unsigned long long ios; /* user array of struct poums_io */
+};
+
+/*
+ * Runs a batch of reads and writes in order under a single lock
+ * acquisition, exclusive if the batch has writes. Each entry gets its
+ * own result, a failed one doesn't stop the batch. Returns count, or
+ * -errno if the array itself can't be read or written back. The file
+ * position is neither used nor changed.
+ */
+#define IOCTL_IO_BATCH _IOWR(POUMS_IOC_MAGIC, 0x02, struct poums_io_batch)
+
+/* control node (/dev/poums-ctl) requests, need CAP_SYS_ADMIN */
+struct poums_ctl_params {
+	unsigned int minor; /* out for create, in for destroy & resize,
+			in (origin) and out (snapshot) for snapshot */
+	unsigned long long capacity; /* bytes, 0 means module's buffsize on
+			create, invalid for resize */
+};
+
+/* creates /dev/poumsN with the lowest free N, returned in minor */
+#define IOCTL_CREATE_DEVICE _IOWR(POUMS_IOC_MAGIC, 0x10, struct poums_ctl_params)
+/* unexposes the device, open files and mappings keep working until closed */
+#define IOCTL_DESTROY_DEVICE _IOW(POUMS_IOC_MAGIC, 0x11, struct poums_ctl_params)
+/*
+ * changes capacity, data beyond it is dropped, EINVAL for capacity 0 and
+ * EBUSY for a shrink while the device is mapped
+ */
+#define IOCTL_RESIZE_DEVICE _IOW(POUMS_IOC_MAGIC, 0x12, struct poums_ctl_params)
+/*
+ * creates a read-only copy of device minor as /dev/poums<minor>.snap<new
+ * minor>, returned in minor. Pages are shared until the origin writes
+ * them. Fails with EBUSY while the origin is mapped, and mmap() of the
+ * origin fails with EBUSY while a snapshot shares pages it didn't rewrite.
+ */
+#define IOCTL_SNAPSHOT_DEVICE _IOWR(POUMS_IOC_MAGIC, 0x13, struct poums_ctl_params)
+
+#endif /* _TASK21_IOCTL_H */
@@ -0,0 +1,1533 @@
+/*
+ * task21_main.c
+ *
+ *      Author: Maxim Kouprianov
+ */
+
+#include "task21.h"
+
+#define CREATE_TRACE_POINTS
+#include "task21_trace.h"
+
+/* params */
+static unsigned int num = 1; /* number of devices to create at load */
+static unsigned long buffsize = BUFFSIZE;
+static bool fast_append = false; /* lock-free O_APPEND writers */
+static bool stream = false; /* default mode of new open files */
+static char *alloc = "lazy"; /* storage allocation policy */
+static int numa_node = NUMA_NO_NODE; /* where device state & storage live */
+static unsigned int idle_timeout = 60; /* seconds until zero pages go */
+static char *backing = NULL; /* directory of device images */
+
+module_param(num, uint, S_IRUGO);
+module_param(buffsize, ulong, S_IRUGO);
+module_param(fast_append, bool, S_IRUGO);
+module_param(stream, bool, S_IRUGO);
+module_param(alloc, charp, S_IRUGO);
+module_param(numa_node, int, S_IRUGO);
+module_param(idle_timeout, uint, S_IRUGO | S_IWUSR);
+module_param(backing, charp, S_IRUGO);
+MODULE_PARM_DESC(num, "number of devices to create at load, more can be "
+		"created through /dev/" CTL_NAME " (0-256)(default: 1)");
+MODULE_PARM_DESC(buffsize, "default capacity of device's buffer in bytes, "
+		"see `alloc` for when its pages are allocated (default: 4096)");
+MODULE_PARM_DESC(fast_append, "O_APPEND writers reserve space atomically "
+		"and don't exclude each other (default: 0)");
+MODULE_PARM_DESC(stream, "open files in stream mode, reads block until "
+		"data is written (default: 0)");
+MODULE_PARM_DESC(alloc, "storage allocation policy: lazy - zeroed pages on "
+		"first write, eager - whole capacity at creation in huge chunks, "
+		"nozero - lazy without zeroing fully overwritten pages "
+		"(default: lazy)");
+MODULE_PARM_DESC(numa_node, "NUMA node for the state and storage of new "
+		"devices, per device in sysfs numa_node (default: -1, local to "
+		"the allocating task)");
+MODULE_PARM_DESC(idle_timeout, "seconds without reads or writes after which "
+		"a device's zero pages are freed under memory pressure, pages past "
+		"the data always are unless preallocated by alloc=eager "
+		"(0 - never)(default: 60)");
+MODULE_PARM_DESC(backing, "directory keeping device contents across "
+		"reloads as sparse images " BASENAME "N: restored into the devices "
+		"created at load, saved on fsync and unload, emptied when the "
+		"device is destroyed (default: none)");
+/* end params */
+
+static enum poums_alloc_policy alloc_policy = POUMS_ALLOC_LAZY;
+
+static dev_t first; /* first device number for driver */
+static struct class *poums_class = NULL;/* ptr to device's class object */
+static DEFINE_IDR(poums_idr); /* minor -> device */
+static DEFINE_MUTEX(poums_idr_lock); /* guards poums_idr */
+static DEFINE_MUTEX(poums_backing_lock); /* one image is written at a time */
+static struct cdev ctl_cdev; /* control node */
+static struct shrinker poums_shrinker = {
+	.count_objects = poums_shrink_count,
+	.scan_objects = poums_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/* =============================================== */
+
+static int
+poums_open(struct inode *inode, struct file *fp) {
+	struct poums_device *dev = NULL;
+	struct poums_file *pf = NULL;
+	int ret = 0;
+
+	unsigned int minor = iminor(inode);
+	unsigned int major = imajor(inode);
+
+	/* pin the device, it may be destroyed while open */
+	mutex_lock(&poums_idr_lock);
+	dev = major == MAJOR(first) ? idr_find(&poums_idr, minor) : NULL;
+	if (dev != NULL) {
+		kref_get(&dev->kref);
+	}
+	mutex_unlock(&poums_idr_lock);
+
+	if(dev == NULL) {
+		pr_err(LOG "no such device for major=%d, minor=%d\n", major, minor);
+		return -ENODEV;
+	}
+
+	/* snapshots are read-only */
+	if (dev->origin != NULL && (fp->f_mode & FMODE_WRITE)) {
+		put_poums_device(dev);
+		return -EROFS;
+	}
+
+	pf = (struct poums_file *) kzalloc(sizeof(struct poums_file), GFP_KERNEL);
+	if (pf == NULL) {
+		put_poums_device(dev);
+		return -ENOMEM;
+	}
+
+	pf->dev = dev;
+	pf->stream = stream;
+	fp->private_data = pf;
+
+	/* lock thread */
+	down_write(&dev->sem);
+
+	/* truncate if needed */
+	if (truncate_poums_storage(dev, fp)) {
+		/* drop stale mappings of the old storage */
+		unmap_mapping_range(fp->f_mapping, 0, 0, 1);
+	}
+
+	up_write(&dev->sem);
+	trace_poums_open(minor, fp->f_flags, ret);
+	return ret;
+}
+
+static int
+poums_close(struct inode *inode, struct file *fp) {
+	poums_fasync(-1, fp, 0); /* drop from async notify list */
+	put_poums_device(poums_dev(fp));
+	kfree(fp->private_data);
+	trace_poums_close(iminor(inode));
+	return 0;
+}
+
+static ssize_t
+poums_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	struct file *fp = iocb->ki_filp;
+	unsigned int minor = iminor(fp->f_dentry->d_inode);
+	struct poums_device *dev = poums_dev(fp);
+	size_t len = iov_iter_count(to), count = len;
+	loff_t pos = iocb->ki_pos, off = pos, size;
+	struct poums_range range;
+	ssize_t ret = 0;
+	u64 start = local_clock(), locked;
+
+	/* shared lock, readers don't exclude each other */
+	down_read(&dev->sem);
+	locked = local_clock();
+
+	/* fast appenders may publish concurrently */
+	size = ACCESS_ONCE(dev->size);
+	smp_rmb(); /* pairs with smp_wmb() in append_poums_iter() */
+
+	/* stream mode: wait for writers instead of EOF */
+	while (off >= size && off < dev->capacity && poums_file(fp)->stream
+			&& !ACCESS_ONCE(dev->gone)) {
+		up_read(&dev->sem);
+
+		if (fp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out_unlocked;
+		}
+		/* a resize below off or destroy ends the stream */
+		if (wait_event_interruptible(dev->readq,
+				ACCESS_ONCE(dev->size) > off
+				|| off >= ACCESS_ONCE(dev->capacity)
+				|| ACCESS_ONCE(dev->gone))) {
+			ret = -ERESTARTSYS;
+			goto out_unlocked;
+		}
+
+		down_read(&dev->sem);
+		size = ACCESS_ONCE(dev->size);
+		smp_rmb();
+	}
+
+	/* boundary check #1 */
+	if(off >= size) {
+		goto out;
+	}
+
+	/* count adjustment */
+	if(off + count >= size) {
+		count = size - off; /* partial read */
+	}
+
+	/* only writers to the same bytes are waited for */
+	lock_poums_range(dev, &range, off, off + count, false);
+	locked = local_clock();
+
+	/* copy data to all the user segments page by page */
+	ret = read_poums_iter(dev, off, count, to);
+	unlock_poums_range(dev, &range);
+
+	/* advance marker */
+	if (ret > 0) {
+		iocb->ki_pos = off + ret;
+	}
+
+	out:
+		up_read(&dev->sem);
+	out_unlocked:
+		account_poums_op(dev, false, ret, start, locked);
+		trace_poums_read(minor, pos, len, ret);
+		return ret;
+}
+
+static ssize_t
+poums_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+	struct file *fp = iocb->ki_filp;
+	unsigned int minor = iminor(fp->f_dentry->d_inode);
+	struct poums_device *dev = poums_dev(fp);
+	size_t len = iov_iter_count(from), count = len;
+	struct poums_range range;
+	loff_t pos, off;
+	ssize_t ret = 0;
+	u64 start = local_clock(), locked;
+
+	if((fp->f_flags & O_APPEND) && fast_append) {
+		/* shared lock, appenders only exclude regular writers */
+		down_read(&dev->sem);
+		locked = local_clock();
+
+		ret = append_poums_iter(dev, from, &pos);
+		if (ret > 0) {
+			iocb->ki_pos = pos + ret;
+		}
+
+		up_read(&dev->sem);
+		account_poums_op(dev, true, ret, start, locked);
+		trace_poums_write(minor, pos, len, ret);
+		return ret;
+	}
+
+	/*
+	 * Overwrites within size only lock their byte range, so writers to
+	 * disjoint regions run in parallel. Growing size, truncation and
+	 * shared (copy-on-write) pages still need the exclusive lock below.
+	 */
+	pos = off = iocb->ki_pos;
+	if (!(fp->f_flags & O_APPEND) && count > 0
+			&& off + count <= ACCESS_ONCE(dev->size)) {
+		down_read(&dev->sem);
+		if (off + count <= dev->size
+				&& !radix_tree_tagged(&dev->pages, POUMS_TAG_COW)) {
+			lock_poums_range(dev, &range, off, off + count, true);
+			locked = local_clock();
+
+			ret = write_poums_iter(dev, off, count, from);
+			if (ret > 0) {
+				iocb->ki_pos = off + ret;
+			}
+
+			unlock_poums_range(dev, &range);
+			up_read(&dev->sem);
+			account_poums_op(dev, true, ret, start, locked);
+			trace_poums_write(minor, pos, len, ret);
+			return ret;
+		}
+		up_read(&dev->sem);
+	}
+
+	/* exclusive lock, extending writers exclude everybody */
+	down_write(&dev->sem);
+	locked = local_clock();
+
+	/* truncate if needed */
+	if(fp->f_flags & O_APPEND) {
+		iocb->ki_pos = dev->size;
+	}
+
+	pos = off = iocb->ki_pos;
+	if(off + count > dev->capacity) {
+		count = off < dev->capacity ? dev->capacity - off : 0; /* up to end */
+	}
+
+	/* copy data from all the user segments, allocating on demand */
+	ret = write_poums_iter(dev, off, count, from);
+
+	/* advance marker */
+	if (ret > 0) {
+		iocb->ki_pos = off + ret;
+	}
+
+	sync_poums_tail(dev);
+	up_write(&dev->sem);
+	account_poums_op(dev, true, ret, start, locked);
+	trace_poums_write(minor, pos, len, ret);
+	return ret;
+}
+
+/*
+ * Zero-copy read into a pipe: storage pages are handed to the pipe by
+ * reference, so data written after the splice is visible to the pipe
+ * reader until it consumes the buffer (same as vmsplice).
+ */
+static ssize_t
+poums_splice_read(struct file *fp, loff_t *pos, struct pipe_inode_info *pipe,
+		size_t count, unsigned int flags) {
+	struct poums_device *dev = poums_dev(fp);
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &poums_pipe_buf_ops,
+		.spd_release = poums_spd_release,
+	};
+	struct page *page;
+	size_t chunk, len = count;
+	loff_t off = *pos;
+	ssize_t ret = 0;
+	loff_t size;
+	u64 start = local_clock(), locked;
+
+	down_read(&dev->sem);
+	locked = local_clock();
+
+	size = ACCESS_ONCE(dev->size);
+	smp_rmb(); /* pairs with smp_wmb() in append_poums_iter() */
+
+	if(off >= size) {
+		count = 0;
+	} else if(off + count >= size) {
+		count = size - off; /* partial read */
+	}
+
+	while (count > 0 && spd.nr_pages < spd.nr_pages_max) {
+		chunk = min_t(size_t, count, PAGE_SIZE - (off & ~PAGE_MASK));
+		page = find_poums_page(dev, off >> PAGE_SHIFT);
+		if (page == NULL) {
+			page = ZERO_PAGE(0); /* never written, reads as zeros */
+		}
+
+		get_page(page); /* dropped by the pipe */
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = off & ~PAGE_MASK;
+		partial[spd.nr_pages].len = chunk;
+		++spd.nr_pages;
+
+		off += chunk;
+		count -= chunk;
+	}
+
+	up_read(&dev->sem);
+
+	if (spd.nr_pages > 0) {
+		ret = splice_to_pipe(pipe, &spd);
+	}
+
+	account_poums_op(dev, false, ret, start, locked);
+	trace_poums_read(iminor(fp->f_dentry->d_inode), *pos, len, ret);
+	if (ret > 0) {
+		*pos += ret;
+	}
+
+	return ret;
+}
+
+static void
+poums_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+	put_page(spd->pages[i]);
+}
+
+static int
+poums_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+	return 1; /* pages belong to the device storage */
+}
+
+static loff_t
+poums_llseek(struct file *fp, loff_t off, int whence) {
+	unsigned int minor = iminor(fp->f_dentry->d_inode);
+	struct poums_device *dev = poums_dev(fp);
+	loff_t newpos = 0;
+
+	switch (whence) {
+	case SEEK_SET:
+		newpos = off;
+		break;
+	case SEEK_CUR:
+		newpos = fp->f_pos + off;
+		break;
+	case SEEK_END:
+		newpos = ACCESS_ONCE(dev->capacity) + off;
+		break;
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		newpos = seek_poums_data(dev, off, whence);
+		if (newpos < 0) {
+			goto out;
+		}
+		break;
+	default:
+		newpos = -EINVAL;
+		goto out;
+	}
+
+	if (newpos < 0 || newpos > ACCESS_ONCE(dev->capacity)) {
+		newpos = -EINVAL;
+		goto out;
+	}
+
+	fp->f_pos = newpos;
+
+	out:
+		trace_poums_llseek(minor, off, whence, newpos);
+		return newpos;
+}
+
+static int
+poums_mmap(struct file *fp, struct vm_area_struct *vma) {
+	struct poums_device *dev = poums_dev(fp);
+	int err = 0;
+
+	spin_lock(&dev->lock);
+	if (vma->vm_pgoff + vma_pages(vma) >
+			DIV_ROUND_UP(dev->capacity, PAGE_SIZE)) {
+		/* mapping must fit into the storage, a shrink can't cut it */
+		err = -EINVAL;
+	} else if (dev->snapping || poums_storage_shared(dev)) {
+		/* stores through a mapping would bypass copy-on-write */
+		err = -EBUSY;
+	} else {
+		++dev->maps;
+	}
+	spin_unlock(&dev->lock);
+
+	if (err) {
+		return err;
+	}
+
+	vma->vm_ops = &poums_vm_ops;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = dev;
+	kref_get(&dev->kref); /* vm_open is not called for the initial mapping */
+	return 0;
+}
+
+static unsigned int
+poums_poll(struct file *fp, poll_table *wait) {
+	struct poums_device *dev = poums_dev(fp);
+	unsigned int mask = POLLOUT | POLLWRNORM; /* writers never block */
+	loff_t size;
+
+	poll_wait(fp, &dev->readq, wait);
+
+	size = ACCESS_ONCE(dev->size);
+	if (!poums_file(fp)->stream || fp->f_pos < size
+			|| fp->f_pos >= ACCESS_ONCE(dev->capacity)
+			|| ACCESS_ONCE(dev->gone)) {
+		/* something to read or won't block on EOF */
+		mask |= POLLIN | POLLRDNORM;
+	}
+
+	return mask;
+}
+
+static int
+poums_fasync(int fd, struct file *fp, int on) {
+	return fasync_helper(fd, fp, on, &poums_dev(fp)->fasync);
+}
+
+static int
+poums_fsync(struct file *fp, loff_t start, loff_t end, int datasync) {
+	return save_poums_device(poums_dev(fp));
+}
+
+static long
+poums_ioctl(struct file *fp, unsigned int cmd, unsigned long arg) {
+	switch (cmd) {
+	case IOCTL_SET_STREAM:
+		poums_file(fp)->stream = arg != 0;
+		return 0;
+	case IOCTL_IO_BATCH:
+		return poums_io_batch(fp, (struct poums_io_batch __user *) arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* IOCTL_IO_BATCH: one syscall and one lock acquisition for many accesses */
+static long
+poums_io_batch(struct file *fp, struct poums_io_batch __user *arg) {
+	unsigned int minor = iminor(fp->f_dentry->d_inode);
+	struct poums_device *dev = poums_dev(fp);
+	struct poums_io_batch batch;
+	struct poums_io *ios, *io;
+	bool write, exclusive = false;
+	unsigned int i;
+	size_t len;
+	long ret;
+	u64 start = local_clock(), locked, now;
+
+	if (copy_from_user(&batch, arg, sizeof(batch))) {
+		return -EFAULT;
+	}
+	if (batch.flags != 0 || batch.count > POUMS_IO_BATCH_MAX) {
+		return -EINVAL;
+	}
+	if (batch.count == 0) {
+		return 0;
+	}
+
+	ios = memdup_user((void __user *) (unsigned long) batch.ios,
+			batch.count * sizeof(struct poums_io));
+	if (IS_ERR(ios)) {
+		return PTR_ERR(ios);
+	}
+
+	/* readers share the lock, a single writer makes the batch exclusive */
+	for (i = 0; i < batch.count; ++i) {
+		exclusive |= ios[i].op == POUMS_IO_WRITE;
+	}
+
+	if (exclusive) {
+		down_write(&dev->sem);
+	} else {
+		down_read(&dev->sem);
+	}
+	locked = local_clock();
+
+	for (i = 0; i < batch.count; ++i) {
+		io = &ios[i];
+		write = io->op == POUMS_IO_WRITE;
+		len = min_t(u64, io->length, MAX_RW_COUNT);
+		now = local_clock();
+
+		if (io->flags != 0 || io->op > POUMS_IO_WRITE
+				|| io->offset > LLONG_MAX) {
+			ret = -EINVAL;
+		} else if (!(fp->f_mode & (write ? FMODE_WRITE : FMODE_READ))) {
+			ret = -EBADF;
+		} else {
+			ret = batch_poums_io(dev, write, exclusive, io->offset, len,
+					(void __user *) (unsigned long) io->buf);
+		}
+		io->result = ret;
+
+		/* the lock wait is accounted to the first entry */
+		account_poums_op(dev, write, ret, i ? now : start, i ? now : locked);
+		if (write) {
+			trace_poums_write(minor, io->offset, len, ret);
+		} else {
+			trace_poums_read(minor, io->offset, len, ret);
+		}
+	}
+
+	if (exclusive) {
+		sync_poums_tail(dev);
+		up_write(&dev->sem);
+	} else {
+		up_read(&dev->sem);
+	}
+
+	ret = batch.count;
+	if (copy_to_user((void __user *) (unsigned long) batch.ios, ios,
+			batch.count * sizeof(struct poums_io))) {
+		ret = -EFAULT;
+	}
+
+	kfree(ios);
+	return ret;
+}
+
+static long
+poums_ctl_ioctl(struct file *fp, unsigned int cmd, unsigned long arg) {
+	struct poums_ctl_params params;
+	struct poums_device *dev, *origin;
+	long ret = 0;
+
+	if (_IOC_TYPE(cmd) != POUMS_IOC_MAGIC) {
+		return -ENOTTY;
+	}
+	if (!capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+	if (copy_from_user(&params, (void __user *) arg, sizeof(params))) {
+		return -EFAULT;
+	}
+
+	if (params.capacity > ULONG_MAX) {
+		return -EINVAL;
+	}
+
+	switch (cmd) {
+	case IOCTL_CREATE_DEVICE:
+		if (params.capacity == 0) {
+			params.capacity = buffsize;
+		}
+		dev = create_poums_device(params.capacity, NULL, -1);
+		if (IS_ERR(dev)) {
+			return PTR_ERR(dev);
+		}
+
+		params.minor = MINOR(dev->devt);
+		if (copy_to_user((void __user *) arg, &params, sizeof(params))) {
+			ret = -EFAULT;
+		}
+		break;
+	case IOCTL_DESTROY_DEVICE:
+		mutex_lock(&poums_idr_lock);
+		dev = params.minor < NUM_MAX ? idr_find(&poums_idr, params.minor) : NULL;
+		if (dev != NULL) {
+			kref_get(&dev->kref);
+			destroy_poums_device(dev);
+		}
+		mutex_unlock(&poums_idr_lock);
+
+		if (dev == NULL) {
+			return -ENODEV;
+		}
+
+		/* a later device with this minor must not get its data */
+		drop_poums_image(dev);
+		put_poums_device(dev);
+		break;
+	case IOCTL_SNAPSHOT_DEVICE:
+		mutex_lock(&poums_idr_lock);
+		dev = params.minor < NUM_MAX ? idr_find(&poums_idr, params.minor) : NULL;
+		if (dev != NULL) {
+			kref_get(&dev->kref);
+		}
+		mutex_unlock(&poums_idr_lock);
+
+		if (dev == NULL) {
+			return -ENODEV;
+		}
+
+		origin = dev;
+		dev = create_poums_device(0, origin, -1);
+		put_poums_device(origin);
+		if (IS_ERR(dev)) {
+			return PTR_ERR(dev);
+		}
+
+		params.minor = MINOR(dev->devt);
+		if (copy_to_user((void __user *) arg, &params, sizeof(params))) {
+			ret = -EFAULT;
+		}
+		break;
+	case IOCTL_RESIZE_DEVICE:
+		mutex_lock(&poums_idr_lock);
+		dev = params.minor < NUM_MAX ? idr_find(&poums_idr, params.minor) : NULL;
+		if (dev != NULL) {
+			kref_get(&dev->kref);
+		}
+		mutex_unlock(&poums_idr_lock);
+
+		if (dev == NULL) {
+			return -ENODEV;
+		}
+
+		ret = resize_poums_device(dev, params.capacity);
+		put_poums_device(dev);
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+
+	return ret;
+}
+
+/* =============================================== */
+
+static void
+poums_vm_open(struct vm_area_struct *vma) {
+	struct poums_device *dev = vma->vm_private_data;
+
+	spin_lock(&dev->lock);
+	++dev->maps;
+	spin_unlock(&dev->lock);
+	kref_get(&dev->kref);
+}
+
+static void
+poums_vm_close(struct vm_area_struct *vma) {
+	struct poums_device *dev = vma->vm_private_data;
+
+	spin_lock(&dev->lock);
+	--dev->maps;
+	spin_unlock(&dev->lock);
+	put_poums_device(dev);
+}
+
+static int
+poums_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf) {
+	struct poums_device *dev = vma->vm_private_data;
+	struct page *page;
+
+	if (vmf->pgoff >= DIV_ROUND_UP(ACCESS_ONCE(dev->capacity), PAGE_SIZE)) {
+		return VM_FAULT_SIGBUS;
+	}
+
+	/*
+	 * dev->sem may be held by read()/write() faulting on a mapping
+	 * of this very device, so the page is looked up under the spinlock
+	 */
+	page = get_poums_page(dev, vmf->pgoff, true);
+	if (IS_ERR(page)) {
+		return VM_FAULT_OOM;
+	}
+
+	vmf->page = page; /* reference is dropped on unmap */
+	return 0;
+}
+
+/*
+ * Called on the first write to a mapped page: data written through
+ * the mapping becomes visible to read() up to the end of that page.
+ */
+static int
+poums_vm_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf) {
+	struct poums_device *dev = vma->vm_private_data;
+	loff_t end = (loff_t) (vmf->pgoff + 1) << PAGE_SHIFT;
+	unsigned long capacity = ACCESS_ONCE(dev->capacity);
+
+	if (end > capacity) {
+		end = capacity;
+	}
+
+	if (publish_poums_mapped(dev, end) < 0) {
+		return VM_FAULT_OOM;
+	}
+
+	/* page is not in page cache, so lock it ourselves */
+	lock_page(vmf->page);
+	return VM_FAULT_LOCKED;
+}
+
+/* =============================================== */
+
+/* per-CPU accounting of a finished read or write */
+static void
+account_poums_op(struct poums_device *dev, bool write, ssize_t ret,
+		u64 start, u64 locked) {
+	struct poums_stats *stats;
+	u64 now = local_clock();
+	unsigned int bucket = fls64((now - start) >> POUMS_LAT_SHIFT);
+
+	if (bucket >= POUMS_LAT_BUCKETS) {
+		bucket = POUMS_LAT_BUCKETS - 1;
+	}
+
+	stats = get_cpu_ptr(dev->stats);
+	if (write) {
+		++stats->writes;
+		stats->write_bytes += ret > 0 ? ret : 0;
+	} else {
+		++stats->reads;
+		stats->read_bytes += ret > 0 ? ret : 0;
+	}
+	stats->lock_wait_ns += locked - start;
+	++stats->latency[bucket];
+	put_cpu_ptr(dev->stats);
+
+	/* shared cacheline, only dirtied once a tick */
+	if (ACCESS_ONCE(dev->atime) != jiffies) {
+		ACCESS_ONCE(dev->atime) = jiffies;
+	}
+}
+
+static void
+sum_poums_stats(struct poums_device *dev, struct poums_stats *sum) {
+	struct poums_stats *stats;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(dev->stats, cpu);
+		sum->reads += stats->reads;
+		sum->writes += stats->writes;
+		sum->read_bytes += stats->read_bytes;
+		sum->write_bytes += stats->write_bytes;
+		sum->lock_wait_ns += stats->lock_wait_ns;
+		for (i = 0; i < POUMS_LAT_BUCKETS; ++i) {
+			sum->latency[i] += stats->latency[i];
+		}
+	}
+}
+
+/* =============================================== */
+
+#define POUMS_STAT_ATTR(field) \
+static ssize_t \
+field##_show(struct device *d, struct device_attribute *attr, char *buf) { \
+	struct poums_stats sum; \
+	sum_poums_stats(dev_get_drvdata(d), &sum); \
+	return sprintf(buf, "%llu\n", (unsigned long long) sum.field); \
+} \
+static DEVICE_ATTR_RO(field)
+
+POUMS_STAT_ATTR(reads);
+POUMS_STAT_ATTR(writes);
+POUMS_STAT_ATTR(read_bytes);
+POUMS_STAT_ATTR(write_bytes);
+POUMS_STAT_ATTR(lock_wait_ns);
+
+/* one "<lower bound in ns> <ops>" line per latency bucket */
+static ssize_t
+latency_hist_show(struct device *d, struct device_attribute *attr, char *buf) {
+	struct poums_stats sum;
+	ssize_t len = 0;
+	int i;
+
+	sum_poums_stats(dev_get_drvdata(d), &sum);
+	for (i = 0; i < POUMS_LAT_BUCKETS; ++i) {
+		len += sprintf(buf + len, "%llu %llu\n",
+				i ? 1ULL << (POUMS_LAT_SHIFT + i - 1) : 0ULL,
+				(unsigned long long) sum.latency[i]);
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(latency_hist);
+
+static ssize_t
+capacity_show(struct device *d, struct device_attribute *attr, char *buf) {
+	struct poums_device *dev = dev_get_drvdata(d);
+	return sprintf(buf, "%lu\n", ACCESS_ONCE(dev->capacity));
+}
+
+static ssize_t
+capacity_store(struct device *d, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	unsigned long capacity;
+	int err;
+
+	err = kstrtoul(buf, 0, &capacity);
+	if (err) {
+		return err;
+	}
+
+	err = resize_poums_device(dev_get_drvdata(d), capacity);
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(capacity);
+
+static ssize_t
+size_show(struct device *d, struct device_attribute *attr, char *buf) {
+	struct poums_device *dev = dev_get_drvdata(d);
+	return sprintf(buf, "%lld\n", (long long) ACCESS_ONCE(dev->size));
+}
+static DEVICE_ATTR_RO(size);
+
+static ssize_t
+pages_show(struct device *d, struct device_attribute *attr, char *buf) {
+	struct poums_device *dev = dev_get_drvdata(d);
+	return sprintf(buf, "%lu\n", ACCESS_ONCE(dev->nr_pages));
+}
+static DEVICE_ATTR_RO(pages);
+
+static ssize_t
+numa_node_show(struct device *d, struct device_attribute *attr, char *buf) {
+	struct poums_device *dev = dev_get_drvdata(d);
+	return sprintf(buf, "%d\n", ACCESS_ONCE(dev->node));
+}
+
+/* pages allocated from now on come from the new node, the rest stay put */
+static ssize_t
+numa_node_store(struct device *d, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct poums_device *dev = dev_get_drvdata(d);
+	int nid, err;
+
+	err = kstrtoint(buf, 0, &nid);
+	if (err) {
+		return err;
+	}
+	if (!valid_numa_node(nid)) {
+		return -EINVAL;
+	}
+
+	ACCESS_ONCE(dev->node) = nid;
+	return count;
+}
+static DEVICE_ATTR_RW(numa_node);
+
+static struct attribute *poums_attrs[] = {
+	&dev_attr_capacity.attr,
+	&dev_attr_size.attr,
+	&dev_attr_pages.attr,
+	&dev_attr_numa_node.attr,
+	&dev_attr_reads.attr,
+	&dev_attr_writes.attr,
+	&dev_attr_read_bytes.attr,
+	&dev_attr_write_bytes.attr,
+	&dev_attr_lock_wait_ns.attr,
+	&dev_attr_latency_hist.attr,
+	NULL,
+};
+
+ATTRIBUTE_GROUPS(poums);
+
+/* =============================================== */
+
+static bool
+poums_device_idle(struct poums_device *dev) {
+	unsigned int timeout = ACCESS_ONCE(idle_timeout);
+
+	return timeout > 0
+			&& time_after(jiffies, ACCESS_ONCE(dev->atime) + timeout * HZ);
+}
+
+/*
+ * Reclaim may run from an allocation made under poums_idr_lock or
+ * dev->sem, so neither is waited for: busy devices are skipped.
+ */
+static unsigned long
+poums_shrink_count(struct shrinker *shrinker, struct shrink_control *sc) {
+	struct poums_device *dev;
+	unsigned long count = 0;
+	int minor;
+
+	if (!mutex_trylock(&poums_idr_lock)) {
+		return 0;
+	}
+	idr_for_each_entry(&poums_idr, dev, minor) {
+		count += reclaimable_poums_pages(dev, poums_device_idle(dev));
+	}
+	mutex_unlock(&poums_idr_lock);
+	return count;
+}
+
+static unsigned long
+poums_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+	struct poums_device *dev;
+	unsigned long freed = 0;
+	int minor;
+
+	if (!mutex_trylock(&poums_idr_lock)) {
+		return SHRINK_STOP;
+	}
+	idr_for_each_entry(&poums_idr, dev, minor) {
+		if (freed >= sc->nr_to_scan) {
+			break;
+		}
+		if (!down_write_trylock(&dev->sem)) {
+			continue;
+		}
+		freed += reclaim_poums_storage(dev, sc->nr_to_scan - freed,
+				poums_device_idle(dev));
+		up_write(&dev->sem);
+	}
+	mutex_unlock(&poums_idr_lock);
+	return freed;
+}
+
+/* =============================================== */
+
+/* opens the image of a device, or its temporary copy with @suffix ".tmp" */
+static struct file *
+open_poums_backing(struct poums_device *dev, const char *suffix, int flags) {
+	struct file *file;
+	char *path;
+
+	path = kasprintf(GFP_KERNEL, "%s/" BASENAME "%d%s", backing,
+			MINOR(dev->devt), suffix);
+	if (path == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	file = filp_open(path, flags | O_LARGEFILE, S_IRUSR | S_IWUSR);
+	kfree(path);
+	return file;
+}
+
+/*
+ * Renames the written out temporary copy @file over the image of @dev,
+ * so a crash leaves either the old image or the new one.
+ */
+static int
+commit_poums_backing(struct poums_device *dev, struct file *file) {
+	struct dentry *dentry = file->f_path.dentry, *dir, *target;
+	char name[sizeof(BASENAME) + 16];
+	int err;
+
+	snprintf(name, sizeof(name), BASENAME "%d", MINOR(dev->devt));
+	dir = dget_parent(dentry);
+	lock_rename(dir, dir);
+
+	/* somebody moved it meanwhile */
+	if (dentry->d_parent != dir || d_unhashed(dentry)) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	target = lookup_one_len(name, dir, strlen(name));
+	if (IS_ERR(target)) {
+		err = PTR_ERR(target);
+		goto out;
+	}
+
+	err = vfs_rename(dir->d_inode, dentry, dir->d_inode, target, NULL, 0);
+	dput(target);
+
+	out:
+		unlock_rename(dir, dir);
+		dput(dir);
+		return err;
+}
+
+/*
+ * Fills a device created at load from its image, if there is one, before
+ * it is exposed. Snapshots have none, they only live as long as their
+ * origin, and runtime devices start empty even if they reuse the minor of
+ * an old image.
+ */
+static int
+restore_poums_device(struct poums_device *dev) {
+	struct file *file;
+	loff_t size;
+
+	if (backing == NULL || dev->origin != NULL) {
+		return 0;
+	}
+
+	file = open_poums_backing(dev, "", O_RDONLY);
+	if (IS_ERR(file)) {
+		return PTR_ERR(file) == -ENOENT ? 0 : PTR_ERR(file);
+	}
+
+	down_write(&dev->sem);
+	size = load_poums_storage(dev, file);
+	up_write(&dev->sem);
+	filp_close(file, NULL);
+
+	if (size < 0) {
+		pr_err(LOG "unable to restore " BASENAME "%d: %lld\n",
+				MINOR(dev->devt), (long long) size);
+		return size;
+	}
+
+	pr_info(LOG "restored " BASENAME "%d: %lld bytes\n", MINOR(dev->devt),
+			(long long) size);
+	return 0;
+}
+
+/*
+ * Empties the image of a destroyed device, which then restores nothing.
+ * Files still open on it don't save it anymore, see save_poums_device().
+ */
+static void
+drop_poums_image(struct poums_device *dev) {
+	struct file *file;
+
+	if (backing == NULL || dev->origin != NULL) {
+		return;
+	}
+
+	mutex_lock(&poums_backing_lock);
+	file = open_poums_backing(dev, "", O_WRONLY | O_TRUNC);
+	if (!IS_ERR(file)) {
+		filp_close(file, NULL);
+	} else if (PTR_ERR(file) != -ENOENT) {
+		pr_err(LOG "unable to drop " BASENAME "%d: %ld\n",
+				MINOR(dev->devt), PTR_ERR(file));
+	}
+	mutex_unlock(&poums_backing_lock);
+}
+
+/*
+ * Writes the data of a device to a temporary copy of its image, syncs it
+ * to disk and renames it over the image: the only good copy is never
+ * truncated on the way.
+ */
+static int
+save_poums_device(struct poums_device *dev) {
+	struct file *file;
+	int err;
+
+	if (backing == NULL || dev->origin != NULL) {
+		return 0;
+	}
+
+	mutex_lock(&poums_backing_lock);
+	if (ACCESS_ONCE(dev->gone)) {
+		mutex_unlock(&poums_backing_lock);
+		return 0; /* image dropped, see drop_poums_image() */
+	}
+
+	file = open_poums_backing(dev, ".tmp", O_WRONLY | O_CREAT | O_TRUNC);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out;
+	}
+
+	down_read(&dev->sem);
+	err = save_poums_storage(dev, file);
+	up_read(&dev->sem);
+	if (!err) {
+		err = vfs_fsync(file, 0);
+	}
+	if (!err) {
+		err = commit_poums_backing(dev, file);
+	}
+	filp_close(file, NULL);
+
+	out:
+		mutex_unlock(&poums_backing_lock);
+		if (err) {
+			pr_err(LOG "unable to save " BASENAME "%d: %d\n",
+					MINOR(dev->devt), err);
+		}
+		return err;
+}
+
+static void
+save_poums_devices(void) {
+	struct poums_device *dev;
+	int minor;
+
+	mutex_lock(&poums_idr_lock);
+	idr_for_each_entry(&poums_idr, dev, minor) {
+		save_poums_device(dev);
+	}
+	mutex_unlock(&poums_idr_lock);
+}
+
+/* =============================================== */
+
+static int __init task21_init(void) {
+	pr_info(LOG "device init\n");
+	int err = 0;
+	unsigned int created_num;
+	struct poums_device *dev;
+	struct device *ctl;
+
+	/* check parameters */
+	if(num > NUM_MAX) {
+		pr_err(LOG "invalid value of `num` argument: must be 0-%d\n", NUM_MAX);
+		return -EINVAL;
+	}
+
+	if(buffsize < 1 || buffsize > ULONG_MAX) {
+		pr_err(LOG "invalid value of `buffsize` argument: must be 1-%lu\n", ULONG_MAX);
+		return -EINVAL;
+	}
+
+	if (!valid_numa_node(numa_node)) {
+		pr_err(LOG "invalid value of `numa_node` argument: must be -1 or "
+				"an online node\n");
+		return -EINVAL;
+	}
+
+	if (sysfs_streq(alloc, "lazy")) {
+		alloc_policy = POUMS_ALLOC_LAZY;
+	} else if (sysfs_streq(alloc, "eager")) {
+		alloc_policy = POUMS_ALLOC_EAGER;
+	} else if (sysfs_streq(alloc, "nozero")) {
+		alloc_policy = POUMS_ALLOC_NOZERO;
+	} else {
+		pr_err(LOG "invalid value of `alloc` argument: must be "
+				"lazy, eager or nozero\n");
+		return -EINVAL;
+	}
+
+	pr_info(LOG "buffsize: %lu, alloc: %s, numa_node: %d, backing: %s\n",
+			buffsize, alloc, numa_node, backing != NULL ? backing : "none");
+
+	 /* allocate region for all the devices and the control node */
+	err = alloc_chrdev_region(&first/*where to put*/, 0/*baseminor*/,
+			NUM_MAX + 1/*count*/, BASENAME/*name*/);
+	if (err < 0) {
+		pr_err(LOG "unable to allocate %d chrdev regions: %d\n", NUM_MAX + 1,
+				err);
+		return err;
+	}
+
+	/* create class */
+	poums_class = class_create(THIS_MODULE/*owner*/, BASENAME/*name*/);
+	if (IS_ERR(poums_class)) {
+		pr_err(LOG "unable to create sysfs class\n");
+		err = PTR_ERR(poums_class);
+		goto out_reg;
+	}
+
+	/* create @num initial devices (expose to kernel & user) */
+	for (created_num = 0; created_num < num; ++created_num) {
+		dev = create_poums_device(buffsize, NULL, created_num);
+		if (IS_ERR(dev)) {
+			pr_err(LOG "unable to allocate %d devices, failed at %d\n", num,
+					created_num);
+			err = PTR_ERR(dev);
+			goto out_devcreate;
+		}
+	}
+
+	pr_info(LOG "created: %d/%d\n", created_num, num);
+
+	/* control node to create/destroy/resize devices at runtime */
+	cdev_init(&ctl_cdev, &poums_ctl_fops);
+	ctl_cdev.owner = THIS_MODULE;
+	err = cdev_add(&ctl_cdev, MKDEV(MAJOR(first), CTL_MINOR), 1/*count*/);
+	if (err < 0) {
+		pr_err(LOG "unable to add control cdev: %d\n", err);
+		goto out_devcreate;
+	}
+
+	ctl = device_create(poums_class, NULL, MKDEV(MAJOR(first), CTL_MINOR),
+			NULL, CTL_NAME);
+	if (IS_ERR(ctl)) {
+		pr_err(LOG "unable to create control device\n");
+		err = PTR_ERR(ctl);
+		goto out_ctl;
+	}
+
+	err = register_shrinker(&poums_shrinker);
+	if (err < 0) {
+		pr_err(LOG "unable to register shrinker: %d\n", err);
+		goto out_ctldev;
+	}
+
+	pr_info(LOG "driver registered successfully\n");
+	return 0;
+
+	out_ctldev: device_destroy(poums_class, MKDEV(MAJOR(first), CTL_MINOR));
+	out_ctl: cdev_del(&ctl_cdev);
+	out_devcreate: destroy_poums_devices();
+	out_class: class_destroy(poums_class);
+	out_reg: unregister_chrdev_region(first, NUM_MAX + 1);
+
+	return err;
+}
+
+static void __exit task21_exit(void) {
+	pr_info(LOG "driver exit\n");
+	unregister_shrinker(&poums_shrinker);
+	save_poums_devices(); /* nobody has them open anymore */
+	destroy_poums_devices(); /* unexpose & drop all devices */
+	device_destroy(poums_class, MKDEV(MAJOR(first), CTL_MINOR));
+	cdev_del(&ctl_cdev);
+	idr_destroy(&poums_idr);
+	class_destroy(poums_class);
+	unregister_chrdev_region(first, NUM_MAX + 1);
+}
+
+/*
+ * Allocates the lowest free minor, or @minor if it is not -1, and exposes
+ * a new device with the given capacity to the kernel and user, or a
+ * read-only snapshot of @origin if it is set. Devices created at load
+ * pass their minor and are restored from its image first.
+ */
+static struct poums_device *
+create_poums_device(unsigned long capacity, struct poums_device *origin,
+		int minor) {
+	int nid = origin != NULL ? ACCESS_ONCE(origin->node) : numa_node;
+	struct poums_device *dev;
+	struct device *device;
+	int err = 0;
+
+	/* cacheline aligned, on the node its users run on */
+	dev = (struct poums_device *) kzalloc_node(sizeof(struct poums_device),
+			GFP_KERNEL, nid);
+	if (dev == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	init_poums_storage(dev, capacity, alloc_policy);
+	dev->node = nid;
+
+	/* populated before anybody can open it */
+	if (origin != NULL) {
+		err = take_poums_snapshot(dev, origin);
+		if (err < 0) {
+			goto out_free;
+		}
+	} else if (minor >= 0) {
+		dev->devt = MKDEV(MAJOR(first), minor); /* names the image */
+		err = restore_poums_device(dev);
+		if (err < 0) {
+			goto out_free;
+		}
+	}
+
+	/* open() finds the device only after we drop the lock */
+	mutex_lock(&poums_idr_lock);
+	minor = idr_alloc(&poums_idr, dev, max(minor, 0),
+			minor >= 0 ? minor + 1 : NUM_MAX, GFP_KERNEL);
+	if (minor < 0) {
+		err = minor;
+		goto out_unlock;
+	}
+
+	err = init_poums_device(dev, minor);
+	if (err < 0) {
+		goto out_idr;
+	}
+
+	/* pay for the storage now rather than on the first writes */
+	if (dev->policy == POUMS_ALLOC_EAGER && origin == NULL) {
+		err = fill_poums_storage(dev, 0, DIV_ROUND_UP(capacity, PAGE_SIZE));
+		if (err < 0) {
+			goto out_deinit;
+		}
+	}
+
+	if (origin != NULL) {
+		device = device_create_with_groups(poums_class, NULL, dev->devt, dev,
+				poums_groups, "poums%d.snap%d", MINOR(origin->devt), minor);
+	} else {
+		device = device_create_with_groups(poums_class/*class*/,
+				NULL/*parent*/, dev->devt/*devt*/, dev/*data*/,
+				poums_groups/*sysfs attrs*/, "poums%d", minor);
+	}
+	if (IS_ERR(device)) {
+		err = PTR_ERR(device);
+		goto out_deinit;
+	}
+
+	mutex_unlock(&poums_idr_lock);
+	return dev;
+
+	out_deinit:
+		cdev_del(dev->cdev);
+		free_percpu(dev->stats);
+	out_idr: idr_remove(&poums_idr, minor);
+	out_unlock: mutex_unlock(&poums_idr_lock);
+	out_free:
+		free_poums_storage(dev);
+		if (dev->origin != NULL) {
+			put_poums_device(dev->origin);
+		}
+		kfree(dev);
+		return ERR_PTR(err);
+}
+
+/*
+ * Shares the storage of @origin with the new device @snap, which keeps
+ * a reference to it. A mapping of @origin could write to shared pages
+ * behind our back, so mapped devices can't be snapshotted.
+ */
+static int
+take_poums_snapshot(struct poums_device *snap, struct poums_device *origin) {
+	int err = 0;
+
+	if (origin->origin != NULL) {
+		return -EINVAL; /* a snapshot never changes, no need */
+	}
+
+	down_write(&origin->sem);
+	spin_lock(&origin->lock);
+	if (origin->maps > 0) {
+		err = -EBUSY;
+	} else {
+		origin->snapping = true; /* holds off mmap() */
+	}
+	spin_unlock(&origin->lock);
+
+	if (err) {
+		goto out;
+	}
+
+	err = share_poums_storage(snap, origin);
+	if (err == 0) {
+		snap->capacity = origin->capacity;
+		snap->origin = origin;
+		kref_get(&origin->kref);
+	}
+
+	spin_lock(&origin->lock);
+	origin->snapping = false;
+	spin_unlock(&origin->lock);
+
+	out:
+		up_write(&origin->sem);
+		return err;
+}
+
+/*
+ * Unexposes the device, memory is freed when the last open file or
+ * mapping goes away. poums_idr_lock must be held.
+ */
+static void
+destroy_poums_device(struct poums_device *dev) {
+	idr_remove(&poums_idr, MINOR(dev->devt));
+	device_destroy(poums_class, dev->devt);
+	cdev_del(dev->cdev);
+
+	/* stream readers of open files would wait forever */
+	ACCESS_ONCE(dev->gone) = true;
+	notify_poums_readers(dev);
+	put_poums_device(dev);
+}
+
+static void
+destroy_poums_devices(void) {
+	struct poums_device *dev;
+	int minor;
+
+	mutex_lock(&poums_idr_lock);
+	idr_for_each_entry(&poums_idr, dev, minor) {
+		destroy_poums_device(dev);
+	}
+	mutex_unlock(&poums_idr_lock);
+}
+
+static void
+release_poums_device(struct kref *kref) {
+	struct poums_device *dev = container_of(kref, struct poums_device, kref);
+
+	free_poums_storage(dev); /* cleanup allocated storage */
+	free_percpu(dev->stats);
+	if (dev->origin != NULL) {
+		put_poums_device(dev->origin);
+	}
+	kfree(dev);
+}
+
+static void
+put_poums_device(struct poums_device *dev) {
+	kref_put(&dev->kref, release_poums_device);
+}
+
+static int
+init_poums_device(struct poums_device *dev, unsigned int minor) {
+	BUG_ON(dev == NULL);
+	int err = 0;
+
+	dev->devt = MKDEV(MAJOR(first), minor);
+	kref_init(&dev->kref);
+
+	dev->stats = alloc_percpu(struct poums_stats);
+	if (dev->stats == NULL) {
+		pr_warn(LOG "failed to allocate stats for #%d\n", minor);
+		return -ENOMEM;
+	}
+
+	/* separately allocated, open files may outlive the device */
+	dev->cdev = cdev_alloc();
+	if (dev->cdev == NULL) {
+		pr_warn(LOG "failed to allocate cdev #%d\n", minor);
+		free_percpu(dev->stats);
+		return -ENOMEM;
+	}
+
+	dev->cdev->ops = &poums_fops;
+	dev->cdev->owner = THIS_MODULE;
+
+	err = cdev_add(dev->cdev, dev->devt, 1/*count*/);
+	if (err < 0) {
+		pr_warn(LOG "failed to add cdev #%d\n", minor);
+		kobject_put(&dev->cdev->kobj);
+		free_percpu(dev->stats);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Changes capacity in place, data beyond the new capacity is dropped.
+ * Mappings would keep the dropped pages, so a mapped device can't shrink.
+ */
+static int
+resize_poums_device(struct poums_device *dev, unsigned long capacity) {
+	unsigned long prev;
+	struct page *page;
+	pgoff_t old;
+	int err = 0;
+
+	if (capacity < 1) {
+		return -EINVAL;
+	}
+	if (dev->origin != NULL) {
+		return -EROFS;
+	}
+
+	down_write(&dev->sem);
+	prev = dev->capacity;
+	old = DIV_ROUND_UP(prev, PAGE_SIZE);
+
+	if (capacity < dev->capacity) {
+		spin_lock(&dev->lock);
+		if (dev->maps > 0) {
+			err = -EBUSY;
+		} else {
+			dev->capacity = capacity; /* holds off mmap() past it */
+		}
+		spin_unlock(&dev->lock);
+
+		if (err) {
+			up_write(&dev->sem);
+			return err;
+		}
+
+		/* the cut off part of the last page must read as zeros later */
+		page = NULL;
+		if (capacity & ~PAGE_MASK) {
+			page = get_poums_page(dev, capacity >> PAGE_SHIFT, false);
+		}
+		if (page != NULL) {
+			page = unshare_poums_page(dev, page);
+			if (IS_ERR(page)) {
+				spin_lock(&dev->lock);
+				dev->capacity = prev;
+				spin_unlock(&dev->lock);
+				up_write(&dev->sem);
+				return PTR_ERR(page);
+			}
+			zero_user_segment(page, capacity & ~PAGE_MASK, PAGE_SIZE);
+			put_page(page);
+		}
+
+		drop_poums_pages(dev, DIV_ROUND_UP(capacity, PAGE_SIZE));
+
+		spin_lock(&dev->lock);
+		if (dev->size > capacity) {
+			dev->size = capacity;
+		}
+		dev->zeros_scanned = false; /* the last page was cut */
+		spin_unlock(&dev->lock);
+	} else if (dev->policy == POUMS_ALLOC_EAGER) {
+		err = fill_poums_storage(dev, old, DIV_ROUND_UP(capacity, PAGE_SIZE));
+		if (err < 0) {
+			drop_poums_pages(dev, old);
+			up_write(&dev->sem);
+			return err;
+		}
+	}
+
+	dev->capacity = capacity;
+	sync_poums_tail(dev);
+	up_write(&dev->sem);
+	notify_poums_readers(dev); /* some may be past the end now */
+	return 0;
+}
+
+module_init(task21_init);
+module_exit(task21_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Maxim Kouprianov");
+MODULE_DESCRIPTION("Implementation module for the Task 2.1");
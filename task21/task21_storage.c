@@ -0,0 +1,1232 @@
+/*
+ * task21_storage.c
+ *
+ *      Author: Maxim Kouprianov
+ */
+
+#include "task21_storage.h"
+
+/*
+ * Storage of a poums device, the data path shared by all the fops.
+ * Locking is up to the callers, see struct poums_device.
+ */
+
+/* pages come from dev->node if it is set, else from the local node */
+static inline struct page *
+alloc_poums_pages(struct poums_device *dev, gfp_t gfp, unsigned int order) {
+	return alloc_pages_node(ACCESS_ONCE(dev->node), gfp, order);
+}
+
+void
+init_poums_storage(struct poums_device *dev, unsigned long capacity,
+		enum poums_alloc_policy policy) {
+	INIT_RADIX_TREE(&dev->pages, GFP_ATOMIC); /* filled under spinlock */
+	dev->size = 0;
+	dev->capacity = capacity;
+	dev->policy = policy;
+	dev->node = NUMA_NO_NODE;
+	atomic64_set(&dev->tail, 0);
+	atomic64_set(&dev->committed, 0);
+	init_waitqueue_head(&dev->commitq);
+	INIT_LIST_HEAD(&dev->orphans);
+	init_waitqueue_head(&dev->readq);
+	dev->fasync = NULL;
+	dev->gone = false;
+	init_rwsem(&dev->sem);
+	spin_lock_init(&dev->lock);
+	dev->origin = NULL;
+	dev->maps = 0;
+	dev->snapping = false;
+	dev->nr_pages = 0;
+	dev->atime = 0;
+	dev->zeros_scanned = false;
+	spin_lock_init(&dev->range_lock);
+	INIT_LIST_HEAD(&dev->ranges);
+	atomic64_set(&dev->range_users, 0);
+}
+
+/*
+ * Copies @count bytes at @off to @to, holes read as zeros. The caller
+ * holds dev->sem and has clamped @count to size. Returns the number of
+ * bytes copied or -EFAULT if nothing was.
+ */
+ssize_t
+read_poums_iter(struct poums_device *dev, loff_t off, size_t count,
+		struct iov_iter *to) {
+	loff_t start = off;
+	struct page *page;
+	size_t chunk, copied;
+
+	while (count > 0) {
+		chunk = min_t(size_t, count, PAGE_SIZE - (off & ~PAGE_MASK));
+		page = find_poums_page(dev, off >> PAGE_SHIFT);
+		if (page == NULL) {
+			page = ZERO_PAGE(0); /* never written, reads as zeros */
+		}
+
+		copied = copy_page_to_iter(page, off & ~PAGE_MASK, chunk, to);
+		off += copied;
+		count -= copied;
+		if (copied < chunk) {
+			break; /* fault in user buffer */
+		}
+	}
+
+	return off > start ? off - start : count > 0 ? -EFAULT : 0;
+}
+
+/*
+ * Copies @count bytes from @from to the storage at @off, allocating
+ * pages on demand, and grows size. The caller holds dev->sem exclusively
+ * and has clamped @count to capacity, or overwrites data within size
+ * under shared dev->sem and a write range. Returns the number of bytes
+ * stored or -errno if nothing was.
+ */
+ssize_t
+write_poums_iter(struct poums_device *dev, loff_t off, size_t count,
+		struct iov_iter *from) {
+	loff_t start = off;
+	size_t chunk;
+	ssize_t copied, ret = 0;
+
+	while (count > 0) {
+		chunk = min_t(size_t, count, PAGE_SIZE - (off & ~PAGE_MASK));
+		copied = copy_to_poums_page(dev, off, chunk, from);
+		if (copied < 0) {
+			ret = copied;
+			break;
+		}
+
+		off += copied;
+		count -= copied;
+		if (copied < chunk) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+	/* nothing stored, report the error */
+	if (off == start) {
+		return ret;
+	}
+
+	spin_lock(&dev->lock);
+	if(dev->size < off) {
+		dev->size = off;
+	}
+	dev->zeros_scanned = false; /* may have written zeros */
+	spin_unlock(&dev->lock);
+	notify_poums_readers(dev);
+
+	return off - start;
+}
+
+/*
+ * Runs a single entry of a batch, like pread/pwrite on @buf: reads are
+ * clamped to size and never block, writes are clamped to capacity. The
+ * caller holds dev->sem exclusively, or shared for a batch of reads only,
+ * which then lock their ranges here.
+ */
+ssize_t
+batch_poums_io(struct poums_device *dev, bool write, bool exclusive,
+		loff_t off, size_t len, void __user *buf) {
+	struct iovec iov = { buf, len };
+	struct poums_range range;
+	struct iov_iter iter;
+	loff_t end;
+	ssize_t ret;
+
+	if (off < 0) {
+		return -EINVAL;
+	}
+	if (!access_ok(write ? VERIFY_READ : VERIFY_WRITE, buf, len)) {
+		return -EFAULT;
+	}
+
+	/* fast appenders may publish concurrently */
+	end = write ? dev->capacity : ACCESS_ONCE(dev->size);
+	smp_rmb(); /* pairs with smp_wmb() in append_poums_iter() */
+	if (off >= end) {
+		return 0;
+	}
+
+	len = min_t(loff_t, len, end - off);
+	iov_iter_init(&iter, write ? WRITE : READ, &iov, 1, len);
+	if (write) {
+		return write_poums_iter(dev, off, len, &iter);
+	}
+
+	if (!exclusive) {
+		lock_poums_range(dev, &range, off, off + len, false);
+	}
+	ret = read_poums_iter(dev, off, len, &iter);
+	if (!exclusive) {
+		unlock_poums_range(dev, &range);
+	}
+
+	return ret;
+}
+
+/*
+ * Publishes @new at @index unless there is a page already. Returns the
+ * page stored at @index with an extra reference held or ERR_PTR, the
+ * caller owns @new if something else is returned.
+ */
+struct page *
+insert_poums_page(struct poums_device *dev, pgoff_t index, struct page *new) {
+	struct page *page;
+	int err;
+
+	err = radix_tree_preload(GFP_KERNEL);
+	if (err) {
+		return ERR_PTR(err);
+	}
+
+	new->index = index;
+	spin_lock(&dev->lock);
+	page = radix_tree_lookup(&dev->pages, index);
+	if (page == NULL) {
+		/* can't fail after preload */
+		radix_tree_insert(&dev->pages, index, new);
+		++dev->nr_pages;
+		page = new;
+	}
+	get_page(page);
+	spin_unlock(&dev->lock);
+	radix_tree_preload_end();
+
+	return page;
+}
+
+/*
+ * Copies @chunk bytes from @from to the storage at @off, within a single
+ * page, allocating it on demand. Returns the number of bytes copied or
+ * -errno if nothing was.
+ */
+ssize_t
+copy_to_poums_page(struct poums_device *dev, loff_t off, size_t chunk,
+		struct iov_iter *from) {
+	pgoff_t index = off >> PAGE_SHIFT;
+	struct page *page, *new;
+	void *src, *dst;
+	size_t copied;
+
+	if (dev->policy != POUMS_ALLOC_NOZERO || chunk != PAGE_SIZE) {
+		page = get_poums_page(dev, index, true);
+		goto copy;
+	}
+
+	page = get_poums_page(dev, index, false);
+	if (page != NULL) {
+		goto copy;
+	}
+
+	/*
+	 * A page overwritten as a whole needs no zeroing, but it is filled
+	 * before being published: the fault path must never map stale memory.
+	 */
+	new = alloc_poums_pages(dev, GFP_HIGHUSER, 0);
+	if (new == NULL) {
+		return -ENOMEM;
+	}
+
+	copied = copy_page_from_iter(new, 0, chunk, from);
+	if (copied < chunk) {
+		zero_user_segment(new, copied, PAGE_SIZE);
+	}
+
+	page = insert_poums_page(dev, index, new);
+	if (page != new) {
+		/* raced with a fault, move the data over */
+		if (!IS_ERR(page)) {
+			dst = kmap_atomic(page);
+			src = kmap_atomic(new);
+			memcpy(dst, src, copied);
+			kunmap_atomic(src);
+			kunmap_atomic(dst);
+			put_page(page);
+		}
+		__free_page(new);
+		return IS_ERR(page) ? PTR_ERR(page) : copied ? copied : -EFAULT;
+	}
+
+	put_page(page);
+	return copied ? copied : -EFAULT;
+
+	copy:
+		if (!IS_ERR(page)) {
+			page = unshare_poums_page(dev, page);
+		}
+		if (IS_ERR(page)) {
+			return PTR_ERR(page);
+		}
+
+		copied = copy_page_from_iter(page, off & ~PAGE_MASK, chunk, from);
+		put_page(page);
+		return copied ? copied : -EFAULT;
+}
+
+/*
+ * Returns the page at @page->index that @dev may write to: a page shared
+ * with a snapshot is replaced by its copy first. Takes over the caller's
+ * reference to @page, returns one to the result or ERR_PTR. Shared pages
+ * only ever lie below size as of the snapshot, which fast appenders don't
+ * touch, so dev->sem is held exclusively and no reader uses the old page.
+ */
+struct page *
+unshare_poums_page(struct poums_device *dev, struct page *page) {
+	pgoff_t index = page->index;
+	struct page *new;
+	bool shared;
+
+	if (!radix_tree_tagged(&dev->pages, POUMS_TAG_COW)) {
+		return page; /* nothing shared, the usual case */
+	}
+
+	spin_lock(&dev->lock);
+	shared = radix_tree_tag_get(&dev->pages, index, POUMS_TAG_COW);
+	if (shared && page_count(page) == 2) {
+		/* only the tree and we hold it, snapshots are gone */
+		radix_tree_tag_clear(&dev->pages, index, POUMS_TAG_COW);
+		shared = false;
+	}
+	spin_unlock(&dev->lock);
+
+	if (!shared) {
+		return page;
+	}
+
+	new = alloc_poums_pages(dev, GFP_HIGHUSER, 0);
+	if (new == NULL) {
+		put_page(page);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	copy_highpage(new, page);
+	new->index = index;
+	get_page(new); /* for the caller, the tree owns the first one */
+
+	spin_lock(&dev->lock);
+	radix_tree_replace_slot(radix_tree_lookup_slot(&dev->pages, index), new);
+	radix_tree_tag_clear(&dev->pages, index, POUMS_TAG_COW);
+	spin_unlock(&dev->lock);
+
+	/* ours and the tree's, snapshots hold their own */
+	put_page(page);
+	put_page(page);
+	return new;
+}
+
+/*
+ * Fills the empty @snap with the data of @dev in O(pages): full pages
+ * below size are referenced by both trees and tagged in @dev, so that
+ * its writers copy them first. The last partial page is copied right away,
+ * fast appenders write there without exclusive dev->sem. The caller holds
+ * dev->sem exclusively and makes sure @dev has no mappings, which would
+ * write to shared pages behind our back.
+ */
+int
+share_poums_storage(struct poums_device *snap, struct poums_device *dev) {
+	pgoff_t index = 0, full = dev->size >> PAGE_SHIFT;
+	struct page *pages[16], *page, *new;
+	unsigned int i, j, found;
+
+	do {
+		spin_lock(&dev->lock);
+		found = radix_tree_gang_lookup(&dev->pages, (void **) pages, index,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < found && pages[i]->index < full; ++i) {
+			radix_tree_tag_set(&dev->pages, pages[i]->index, POUMS_TAG_COW);
+			get_page(pages[i]); /* for the snapshot tree */
+		}
+		spin_unlock(&dev->lock);
+
+		for (j = 0; j < i; ++j) {
+			page = insert_poums_page(snap, pages[j]->index, pages[j]);
+			if (IS_ERR(page)) {
+				for (; j < i; ++j) {
+					put_page(pages[j]);
+				}
+				return PTR_ERR(page);
+			}
+			put_page(page);
+		}
+
+		if (i > 0) {
+			index = pages[i - 1]->index + 1;
+		}
+		cond_resched();
+	} while (i == ARRAY_SIZE(pages));
+
+	page = dev->size & ~PAGE_MASK ? find_poums_page(dev, full) : NULL;
+	if (page != NULL) {
+		new = alloc_poums_pages(dev, GFP_HIGHUSER, 0);
+		if (new == NULL) {
+			return -ENOMEM;
+		}
+
+		copy_highpage(new, page);
+		zero_user_segment(new, dev->size & ~PAGE_MASK, PAGE_SIZE);
+		page = insert_poums_page(snap, full, new);
+		if (IS_ERR(page)) {
+			__free_page(new);
+			return PTR_ERR(page);
+		}
+		put_page(page);
+	}
+
+	snap->size = dev->size;
+	return 0;
+}
+
+/*
+ * Drops the tags of shared pages no snapshot holds anymore and tells
+ * whether any are still shared. Called under dev->lock.
+ */
+bool
+poums_storage_shared(struct poums_device *dev) {
+	struct page *pages[16];
+	unsigned int i, found;
+	pgoff_t index = 0;
+
+	if (!radix_tree_tagged(&dev->pages, POUMS_TAG_COW)) {
+		return false;
+	}
+
+	do {
+		found = radix_tree_gang_lookup_tag(&dev->pages, (void **) pages,
+				index, ARRAY_SIZE(pages), POUMS_TAG_COW);
+		for (i = 0; i < found; ++i) {
+			if (page_count(pages[i]) > 1) {
+				return true;
+			}
+			radix_tree_tag_clear(&dev->pages, pages[i]->index, POUMS_TAG_COW);
+		}
+
+		index = found ? pages[found - 1]->index + 1 : 0;
+	} while (found == ARRAY_SIZE(pages));
+
+	return false;
+}
+
+/*
+ * Preallocates zeroed pages in [@start, @end), in chunks of up to
+ * POUMS_CHUNK_ORDER falling back to smaller ones when memory is
+ * fragmented. Chunks are split so every page is freed on its own.
+ */
+int
+fill_poums_storage(struct poums_device *dev, pgoff_t start, pgoff_t end) {
+	unsigned int order = POUMS_CHUNK_ORDER, i;
+	struct page *chunk, *page;
+	pgoff_t index = start;
+	gfp_t gfp;
+
+	while (index < end) {
+		while (order > 0 && (1UL << order) > end - index) {
+			--order;
+		}
+
+		gfp = GFP_HIGHUSER | __GFP_ZERO;
+		if (order > 0) {
+			gfp |= __GFP_NORETRY | __GFP_NOWARN;
+		}
+
+		chunk = alloc_poums_pages(dev, gfp, order);
+		if (chunk == NULL) {
+			if (order == 0) {
+				return -ENOMEM;
+			}
+			--order; /* don't retry the larger size */
+			continue;
+		}
+
+		split_page(chunk, order);
+		for (i = 0; i < (1U << order); ++i) {
+			page = insert_poums_page(dev, index + i, chunk + i);
+			if (IS_ERR(page)) {
+				for (; i < (1U << order); ++i) {
+					__free_page(chunk + i);
+				}
+				return PTR_ERR(page);
+			}
+
+			put_page(page);
+			if (page != chunk + i) {
+				__free_page(chunk + i); /* already there */
+			}
+		}
+
+		index += 1UL << order;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Zeroes the data in place, dev->sem must be held exclusively. Pages
+ * shared with a snapshot are left to it and allocated again on demand.
+ */
+void
+clear_poums_storage(struct poums_device *dev) {
+	pgoff_t index, end = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	struct page *page;
+	bool shared;
+
+	for (index = 0; index < end; ++index) {
+		spin_lock(&dev->lock);
+		page = radix_tree_lookup(&dev->pages, index);
+		shared = page != NULL
+				&& radix_tree_tag_get(&dev->pages, index, POUMS_TAG_COW);
+		if (shared) {
+			radix_tree_delete(&dev->pages, index);
+			--dev->nr_pages;
+		}
+		spin_unlock(&dev->lock);
+
+		if (shared) {
+			put_page(page);
+		} else if (page != NULL) {
+			clear_highpage(page);
+		}
+		cond_resched();
+	}
+
+	spin_lock(&dev->lock);
+	dev->size = 0;
+	spin_unlock(&dev->lock);
+}
+
+/*
+ * O_TRUNC of open(2), eager storage is kept, only its contents are
+ * dropped. Only files open for writing truncate, and never a snapshot:
+ * its tree has no POUMS_TAG_COW, so clearing would zero the pages it
+ * shares with the origin. dev->sem must be held exclusively. Returns
+ * whether the data was dropped.
+ */
+bool
+truncate_poums_storage(struct poums_device *dev, struct file *fp) {
+	if (!(fp->f_flags & O_TRUNC) || !(fp->f_mode & FMODE_WRITE)
+			|| dev->origin != NULL) {
+		return false;
+	}
+
+	if (dev->policy == POUMS_ALLOC_EAGER) {
+		clear_poums_storage(dev);
+	} else {
+		free_poums_storage(dev);
+	}
+	sync_poums_tail(dev);
+	return true;
+}
+
+/*
+ * Lockless lookup of the storage page at @index. The caller must hold
+ * dev->sem, which keeps the page from being freed under it.
+ */
+struct page *
+find_poums_page(struct poums_device *dev, pgoff_t index) {
+	struct page *page;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&dev->pages, index);
+	rcu_read_unlock();
+	return page;
+}
+
+/*
+ * Looks up the storage page at @index, allocating a zeroed one if @alloc
+ * is set. Returns the page with an extra reference held, NULL for a hole
+ * or ERR_PTR on failure.
+ */
+struct page *
+get_poums_page(struct poums_device *dev, pgoff_t index, bool alloc) {
+	struct page *page, *new;
+
+	spin_lock(&dev->lock);
+	page = radix_tree_lookup(&dev->pages, index);
+	if (page != NULL) {
+		get_page(page);
+	}
+	spin_unlock(&dev->lock);
+
+	if (page != NULL || !alloc) {
+		return page;
+	}
+
+	new = alloc_poums_pages(dev, GFP_HIGHUSER | __GFP_ZERO, 0);
+	if (new == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	page = insert_poums_page(dev, index, new);
+	if (page != new) {
+		__free_page(new); /* somebody was faster or no memory */
+	}
+
+	return page;
+}
+
+/* page granular SEEK_DATA/SEEK_HOLE over the allocated pages */
+loff_t
+seek_poums_data(struct poums_device *dev, loff_t off, int whence) {
+	struct radix_tree_iter iter;
+	struct page *page;
+	void **slot;
+	pgoff_t index = off >> PAGE_SHIFT;
+	loff_t newpos = -ENXIO;
+
+	spin_lock(&dev->lock);
+	if (off < 0 || off >= dev->size) {
+		goto out;
+	}
+
+	if (whence == SEEK_DATA) {
+		if (radix_tree_gang_lookup(&dev->pages, (void **) &page, index, 1)) {
+			newpos = max_t(loff_t, off, (loff_t) page->index << PAGE_SHIFT);
+		}
+		if (newpos >= dev->size) {
+			newpos = -ENXIO;
+		}
+	} else {
+		radix_tree_for_each_slot(slot, &dev->pages, &iter, index) {
+			if (iter.index != index) {
+				break; /* gap before this page */
+			}
+			++index;
+		}
+		/* there is always an implicit hole at the end */
+		newpos = max_t(loff_t, off, (loff_t) index << PAGE_SHIFT);
+		newpos = min_t(loff_t, newpos, dev->size);
+	}
+
+	out:
+		spin_unlock(&dev->lock);
+		return newpos;
+}
+
+/*
+ * Reservation of an appender killed while waiting for the earlier ones,
+ * published by whoever publishes the reservation before it.
+ */
+struct poums_orphan {
+	struct list_head list; /* in dev->orphans */
+	loff_t start, end;
+};
+
+/*
+ * Makes [committed, @end) part of size along with the orphans that follow
+ * it, dev->lock held and the reservation must be the next one to publish.
+ */
+static void
+chain_poums_tail(struct poums_device *dev, loff_t end) {
+	struct poums_orphan *orphan, *next;
+	bool found;
+
+	do {
+		if(dev->size < end) {
+			dev->size = end;
+		}
+		dev->zeros_scanned = false;
+		atomic64_set(&dev->committed, end);
+
+		found = false;
+		list_for_each_entry_safe(orphan, next, &dev->orphans, list) {
+			if (orphan->start == end) {
+				end = orphan->end;
+				list_del(&orphan->list);
+				kfree(orphan);
+				found = true;
+				break;
+			}
+		}
+	} while (found);
+}
+
+/* publishes the caller's reservation, the next one to publish */
+static void
+publish_poums_tail(struct poums_device *dev, loff_t end) {
+	smp_wmb(); /* record contents before the new size */
+	spin_lock(&dev->lock);
+	chain_poums_tail(dev, end);
+	spin_unlock(&dev->lock);
+
+	wake_up_all(&dev->commitq);
+	notify_poums_readers(dev);
+}
+
+/*
+ * Makes a page written through a mapping part of size up to @end without
+ * dev->sem, which the fault path can't take. Space past the tail is
+ * reserved the way an append does it, so appenders don't write over it,
+ * and published only after the appends in flight before it.
+ */
+int
+publish_poums_mapped(struct poums_device *dev, loff_t end) {
+	struct poums_orphan *orphan = NULL;
+	loff_t tail;
+
+	for (;;) {
+		spin_lock(&dev->lock);
+		tail = atomic64_read(&dev->tail);
+		if (tail >= end) {
+			break; /* within size or published by an append */
+		}
+
+		/* committed only moves under dev->lock, the tail doesn't */
+		if (atomic64_read(&dev->committed) == tail || orphan != NULL) {
+			if (atomic64_cmpxchg(&dev->tail, tail, end) == tail) {
+				break;
+			}
+			spin_unlock(&dev->lock);
+			continue;
+		}
+
+		spin_unlock(&dev->lock);
+		orphan = kmalloc(sizeof(*orphan), GFP_KERNEL);
+		if (orphan == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	dev->zeros_scanned = false;
+	if (tail >= end) {
+		spin_unlock(&dev->lock);
+		kfree(orphan);
+		return 0;
+	}
+
+	if (atomic64_read(&dev->committed) != tail) {
+		orphan->start = tail;
+		orphan->end = end;
+		list_add_tail(&orphan->list, &dev->orphans);
+		spin_unlock(&dev->lock);
+		return 0; /* published with the appends before it */
+	}
+
+	chain_poums_tail(dev, end);
+	spin_unlock(&dev->lock);
+	kfree(orphan);
+
+	wake_up_all(&dev->commitq);
+	notify_poums_readers(dev);
+	return 0;
+}
+
+/*
+ * Lock-free O_APPEND, the caller holds dev->sem shared. Space is claimed
+ * with an atomic add on the tail and filled without excluding other
+ * appenders. A reservation is published (becomes part of size) only after
+ * all earlier ones are, so readers never see a half-written record.
+ * Anything that could not be copied in stays published as zeros, and the
+ * reservation of an appender killed while waiting is left to the one
+ * before it. Like a regular write, nothing is stored at capacity.
+ */
+ssize_t
+append_poums_iter(struct poums_device *dev, struct iov_iter *from,
+		loff_t *pos) {
+	size_t count = iov_iter_count(from);
+	struct poums_orphan *orphan = NULL;
+	size_t chunk;
+	ssize_t copied;
+	loff_t off, end;
+	ssize_t ret = 0;
+
+	*pos = off = atomic64_add_return(count, &dev->tail) - count;
+	if (count == 0 || off >= dev->capacity) {
+		return 0; /* nothing to publish */
+	}
+
+	end = min_t(loff_t, off + count, dev->capacity);
+	while (off < end) {
+		chunk = min_t(size_t, end - off, PAGE_SIZE - (off & ~PAGE_MASK));
+		copied = copy_to_poums_page(dev, off, chunk, from);
+		if (copied < 0) {
+			ret = copied;
+			break;
+		}
+
+		off += copied;
+		if (copied < chunk) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	ret = off > *pos ? off - *pos : ret;
+
+	/* wait for the earlier reservations to be published */
+	if (atomic64_read(&dev->committed) != *pos) {
+		orphan = kmalloc(sizeof(*orphan), GFP_KERNEL);
+	}
+	if (orphan == NULL) {
+		/* no memory to hand the reservation over, can't give up */
+		wait_event(dev->commitq, atomic64_read(&dev->committed) == *pos);
+	} else if (wait_event_killable(dev->commitq,
+			atomic64_read(&dev->committed) == *pos)) {
+		orphan->start = *pos;
+		orphan->end = end;
+		spin_lock(&dev->lock);
+		if (atomic64_read(&dev->committed) != *pos) {
+			list_add_tail(&orphan->list, &dev->orphans);
+			orphan = NULL;
+		}
+		spin_unlock(&dev->lock);
+
+		if (orphan == NULL) {
+			return ret; /* stored, published later */
+		}
+	}
+	kfree(orphan);
+
+	publish_poums_tail(dev, end);
+	return ret;
+}
+
+/*
+ * Whether an earlier range in the queue conflicts with @range, a writer
+ * also waits for the bare readers, which may overlap it anywhere.
+ */
+static bool
+poums_range_blocked(struct poums_device *dev, struct poums_range *range) {
+	struct poums_range *r;
+	bool blocked = false;
+
+	if (range->write
+			&& (atomic64_read(&dev->range_users) & POUMS_RANGE_READERS)) {
+		return true;
+	}
+
+	spin_lock(&dev->range_lock);
+	list_for_each_entry(r, &dev->ranges, list) {
+		if (r == range) {
+			break;
+		}
+		if ((r->write || range->write)
+				&& r->start < range->end && range->start < r->end) {
+			blocked = true;
+			break;
+		}
+	}
+	spin_unlock(&dev->range_lock);
+
+	return blocked;
+}
+
+/*
+ * Wakes up the ranges queued after @range that wait for it, or with
+ * @range == NULL the writers waiting for bare readers to go. Called under
+ * dev->range_lock, the woken ranges stay queued until they are unlocked.
+ */
+static void
+wake_poums_ranges(struct poums_device *dev, struct poums_range *range) {
+	struct poums_range *r;
+	bool after = range == NULL;
+
+	list_for_each_entry(r, &dev->ranges, list) {
+		if (r == range) {
+			after = true;
+			continue;
+		}
+		if (!after || !waitqueue_active(&r->wait)) {
+			continue;
+		}
+		if (range == NULL) {
+			if (r->write) {
+				wake_up(&r->wait); /* waits for bare readers */
+			}
+		} else if ((r->write || range->write)
+				&& r->start < range->end && range->start < r->end) {
+			wake_up(&r->wait);
+		}
+	}
+}
+
+/* drops a bare reader, the last one lets the waiting writers in */
+static void
+put_poums_bare_reader(struct poums_device *dev) {
+	s64 users = atomic64_dec_return(&dev->range_users);
+
+	if (!(users & POUMS_RANGE_READERS) && users >= POUMS_RANGE_WRITER) {
+		spin_lock(&dev->range_lock);
+		wake_poums_ranges(dev, NULL);
+		spin_unlock(&dev->range_lock);
+	}
+}
+
+/*
+ * Queues @range and waits until it doesn't conflict with earlier ones.
+ * Lets readers and writers of disjoint regions run concurrently under
+ * shared dev->sem; holders of exclusive dev->sem need no ranges. A reader
+ * only queues while there are in-place writers, otherwise it takes a
+ * bare range: a count the writers wait to drain.
+ */
+void
+lock_poums_range(struct poums_device *dev, struct poums_range *range,
+		loff_t start, loff_t end, bool write) {
+	range->start = start;
+	range->end = end;
+	range->write = write;
+	range->bare = false;
+
+	if (!write) {
+		/* value returning atomics imply a full barrier */
+		if (atomic64_inc_return(&dev->range_users) < POUMS_RANGE_WRITER) {
+			range->bare = true;
+			return;
+		}
+		put_poums_bare_reader(dev); /* a writer is around, queue */
+	} else {
+		atomic64_add_return(POUMS_RANGE_WRITER, &dev->range_users);
+	}
+
+	init_waitqueue_head(&range->wait);
+	spin_lock(&dev->range_lock);
+	list_add_tail(&range->list, &dev->ranges);
+	spin_unlock(&dev->range_lock);
+
+	wait_event(range->wait, !poums_range_blocked(dev, range));
+	smp_mb(); /* bare readers are done before a writer's stores */
+}
+
+void
+unlock_poums_range(struct poums_device *dev, struct poums_range *range) {
+	if (range->bare) {
+		put_poums_bare_reader(dev);
+		return;
+	}
+
+	/* only the overlapping ranges queued after this one can wait for it */
+	spin_lock(&dev->range_lock);
+	wake_poums_ranges(dev, range);
+	list_del(&range->list);
+	spin_unlock(&dev->range_lock);
+
+	if (range->write) {
+		atomic64_sub_return(POUMS_RANGE_WRITER, &dev->range_users);
+	}
+}
+
+/*
+ * Wakes up stream mode readers after size has grown, or capacity shrunk
+ * or the device went away, which make them return EOF.
+ */
+void
+notify_poums_readers(struct poums_device *dev) {
+	smp_mb(); /* size update before waitqueue_active() */
+	if (waitqueue_active(&dev->readq)) {
+		wake_up_interruptible(&dev->readq);
+	}
+	kill_fasync(&dev->fasync, SIGIO, POLL_IN);
+}
+
+/*
+ * Realigns append tail with size, dev->sem must be held exclusively: no
+ * appender is in flight, so neither is any orphan nor mapped reservation.
+ */
+void
+sync_poums_tail(struct poums_device *dev) {
+	spin_lock(&dev->lock); /* against publish_poums_mapped() */
+	atomic64_set(&dev->tail, dev->size);
+	atomic64_set(&dev->committed, dev->size);
+	spin_unlock(&dev->lock);
+}
+
+/* drops all the storage pages starting at @start */
+void
+drop_poums_pages(struct poums_device *dev, pgoff_t start) {
+	struct page *pages[16];
+	unsigned int i, found;
+
+	do {
+		spin_lock(&dev->lock);
+		found = radix_tree_gang_lookup(&dev->pages, (void **) pages, start,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < found; ++i) {
+			radix_tree_delete(&dev->pages, pages[i]->index);
+		}
+		dev->nr_pages -= found;
+		spin_unlock(&dev->lock);
+
+		/* pages still mapped somewhere are freed on their last unmap */
+		for (i = 0; i < found; ++i) {
+			put_page(pages[i]);
+		}
+	} while (found);
+}
+
+/* copies [@off, @off + @len) of data out, holes read as zeros */
+static void
+copy_from_poums(struct poums_device *dev, loff_t off, void *buf, size_t len) {
+	size_t offset, chunk;
+	struct page *page;
+	void *src;
+
+	while (len > 0) {
+		offset = off & ~PAGE_MASK;
+		chunk = min_t(size_t, len, PAGE_SIZE - offset);
+
+		page = find_poums_page(dev, off >> PAGE_SHIFT);
+		if (page != NULL) {
+			src = kmap_atomic(page);
+			memcpy(buf, src + offset, chunk);
+			kunmap_atomic(src);
+		} else {
+			memset(buf, 0, chunk);
+		}
+
+		off += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+/* copies @buf in at @off, zero pages are left as holes */
+static int
+copy_to_poums(struct poums_device *dev, loff_t off, const void *buf,
+		size_t len) {
+	size_t offset, chunk;
+	struct page *page;
+	void *dst;
+
+	while (len > 0) {
+		offset = off & ~PAGE_MASK;
+		chunk = min_t(size_t, len, PAGE_SIZE - offset);
+
+		if (memchr_inv(buf, 0, chunk) != NULL) {
+			page = get_poums_page(dev, off >> PAGE_SHIFT, true);
+			if (IS_ERR(page)) {
+				return PTR_ERR(page);
+			}
+
+			dst = kmap_atomic(page);
+			memcpy(dst + offset, buf, chunk);
+			kunmap_atomic(dst);
+			put_page(page);
+		}
+
+		off += chunk;
+		buf += chunk;
+		len -= chunk;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Streams the data into @file at the same offsets through a bounce buffer
+ * of POUMS_IO_CHUNK, so an empty @file ends up as a sparse image of the
+ * device. dev->sem must be held, writers in place are waited for chunk
+ * by chunk.
+ */
+int
+save_poums_storage(struct poums_device *dev, struct file *file) {
+	loff_t size = ACCESS_ONCE(dev->size), off = 0, end;
+	struct poums_range range;
+	ssize_t written;
+	size_t len, done;
+	int err = 0;
+	char *buf;
+
+	smp_rmb(); /* pairs with smp_wmb() in append_poums_iter() */
+
+	buf = vmalloc(POUMS_IO_CHUNK);
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+
+	while (off < size && !err) {
+		off = seek_poums_data(dev, off, SEEK_DATA);
+		if (off < 0 || off >= size) {
+			break;
+		}
+		end = min_t(loff_t, seek_poums_data(dev, off, SEEK_HOLE), size);
+
+		for (; off < end && !err; off += len) {
+			len = min_t(loff_t, end - off, POUMS_IO_CHUNK);
+
+			lock_poums_range(dev, &range, off, off + len, false);
+			copy_from_poums(dev, off, buf, len);
+			unlock_poums_range(dev, &range);
+
+			for (done = 0; done < len; done += written) {
+				written = kernel_write(file, buf + done, len - done,
+						off + done);
+				if (written <= 0) {
+					err = written < 0 ? written : -EIO;
+					break;
+				}
+			}
+		}
+	}
+
+	/* the image ends in a hole, a zero byte sets its size */
+	if (!err && size > 0 && find_poums_page(dev, (size - 1) >> PAGE_SHIFT)
+			== NULL) {
+		written = kernel_write(file, "", 1, size - 1);
+		if (written != 1) {
+			err = written < 0 ? written : -EIO;
+		}
+	}
+
+	vfree(buf);
+	return err;
+}
+
+/*
+ * Fills empty storage from the image in @file, up to the capacity, in
+ * chunks of POUMS_IO_CHUNK. Holes of the image and zero pages stay holes.
+ * dev->sem must be held exclusively. Returns the size of restored data.
+ */
+loff_t
+load_poums_storage(struct poums_device *dev, struct file *file) {
+	loff_t size = vfs_llseek(file, 0, SEEK_END), off = 0, end;
+	ssize_t ret;
+	size_t len;
+	int err = 0;
+	char *buf;
+
+	if (size < 0) {
+		return size;
+	}
+	size = min_t(loff_t, size, dev->capacity);
+
+	buf = vmalloc(POUMS_IO_CHUNK);
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+
+	while (off < size && !err) {
+		off = vfs_llseek(file, off, SEEK_DATA);
+		if (off == -ENXIO || off >= size) {
+			break; /* trailing hole */
+		}
+		end = off < 0 ? off : vfs_llseek(file, off, SEEK_HOLE);
+		if (end < 0) {
+			err = end;
+			break;
+		}
+		end = min(end, size);
+
+		for (; off < end && !err; off += ret) {
+			len = min_t(loff_t, end - off, POUMS_IO_CHUNK);
+			ret = kernel_read(file, off, buf, len);
+			if (ret <= 0) {
+				err = ret < 0 ? ret : -EIO;
+				break;
+			}
+			err = copy_to_poums(dev, off, buf, ret);
+		}
+	}
+
+	vfree(buf);
+	if (err) {
+		return err;
+	}
+
+	spin_lock(&dev->lock);
+	dev->size = size;
+	dev->zeros_scanned = false;
+	spin_unlock(&dev->lock);
+	sync_poums_tail(dev);
+	return size;
+}
+
+/*
+ * Pages reclaim_poums_storage() would free: those past size, which an
+ * eager device only gives up when @idle, and for an @idle device the
+ * zero pages within size until a scan has found there are none left.
+ */
+unsigned long
+reclaimable_poums_pages(struct poums_device *dev, bool idle) {
+	unsigned long pages = ACCESS_ONCE(dev->nr_pages);
+	unsigned long data = DIV_ROUND_UP(ACCESS_ONCE(dev->size), PAGE_SIZE);
+
+	if (idle && !ACCESS_ONCE(dev->zeros_scanned)) {
+		return pages;
+	}
+	if (!idle && dev->policy == POUMS_ALLOC_EAGER) {
+		return 0; /* preallocated to be written soon */
+	}
+	return pages > data ? pages - data : 0;
+}
+
+/*
+ * Frees up to @nr pages under memory pressure without changing what the
+ * device reads: pages past size (preallocation of an idle eager device,
+ * stale after a truncation) and, for an @idle device, zero pages within
+ * size, which read the same as holes. Pages referenced elsewhere, i.e.
+ * mapped, in a pipe or shared with a snapshot, are kept. dev->sem must
+ * be held exclusively. Returns the number of pages freed.
+ */
+unsigned long
+reclaim_poums_storage(struct poums_device *dev, unsigned long nr, bool idle) {
+	pgoff_t data = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	bool zeros = idle && !dev->zeros_scanned;
+	pgoff_t end = idle || dev->policy != POUMS_ALLOC_EAGER ? ULONG_MAX : data;
+	pgoff_t index = zeros ? 0 : data;
+	struct page *pages[16];
+	unsigned int i, found, dropped;
+	unsigned long freed = 0;
+	void *addr;
+	bool zero;
+
+	while (index < end && freed < nr) {
+		dropped = 0;
+		spin_lock(&dev->lock);
+		found = radix_tree_gang_lookup(&dev->pages, (void **) pages, index,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < found && freed + dropped < nr; ++i) {
+			if (pages[i]->index >= end) {
+				found = i; /* the rest is out of reach */
+				break;
+			}
+
+			index = pages[i]->index + 1;
+			if (page_count(pages[i]) != 1) {
+				continue;
+			}
+
+			if (pages[i]->index < data) {
+				addr = kmap_atomic(pages[i]);
+				zero = memchr_inv(addr, 0, PAGE_SIZE) == NULL;
+				kunmap_atomic(addr);
+				if (!zero) {
+					continue;
+				}
+			}
+
+			radix_tree_delete(&dev->pages, pages[i]->index);
+			pages[dropped++] = pages[i];
+		}
+		dev->nr_pages -= dropped;
+
+		/* scanned to the end, zero pages can't come back without writes */
+		if (i == found && found < ARRAY_SIZE(pages) && zeros) {
+			dev->zeros_scanned = true;
+		}
+		spin_unlock(&dev->lock);
+
+		for (i = 0; i < dropped; ++i) {
+			put_page(pages[i]);
+		}
+		freed += dropped;
+		cond_resched();
+
+		if (found < ARRAY_SIZE(pages)) {
+			break;
+		}
+	}
+
+	return freed;
+}
+
+void
+free_poums_storage(struct poums_device *dev) {
+	drop_poums_pages(dev, 0);
+
+	spin_lock(&dev->lock);
+	dev->size = 0;
+	spin_unlock(&dev->lock);
+}
+
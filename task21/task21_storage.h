@@ -0,0 +1,174 @@
+/*
+ * task21_storage.h
+ *
+ *      Author: Maxim Kouprianov
+ */
+
+#ifndef _TASK21_STORAGE_H
+#define _TASK21_STORAGE_H
+
+/* only what the shim in ../shim provides, so this builds in userspace */
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/huge_mm.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/uio.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/numa.h>
+#include <linux/list.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+#define POUMS_CHUNK_ORDER HPAGE_PMD_ORDER /* eager allocation unit */
+#else
+#define POUMS_CHUNK_ORDER PAGE_ALLOC_COSTLY_ORDER
+#endif
+
+#define POUMS_IO_CHUNK (1 << 20) /* backing file I/O unit */
+
+#define POUMS_TAG_COW 0 /* pages tree tag: page is shared with a snapshot */
+
+#define POUMS_RANGE_WRITER (1LL << 32) /* range_users of an in-place writer */
+#define POUMS_RANGE_READERS (POUMS_RANGE_WRITER - 1) /* bare reader mask */
+
+/* when storage pages are allocated */
+enum poums_alloc_policy {
+	POUMS_ALLOC_LAZY, /* zeroed page on first write or fault */
+	POUMS_ALLOC_EAGER, /* whole capacity at creation, in large chunks */
+	POUMS_ALLOC_NOZERO, /* lazy, but fully overwritten pages aren't zeroed */
+};
+
+struct poums_stats;
+struct cdev;
+
+/*
+ * Byte range [start, end) held by a reader or an in-place writer under
+ * shared dev->sem. Ranges are granted in FIFO order: a range waits for
+ * the earlier overlapping ones when either side writes. While there are
+ * no in-place writers, readers hold bare ranges, which aren't queued.
+ */
+struct poums_range {
+	struct list_head list; /* in dev->ranges, unless bare */
+	loff_t start, end;
+	bool write;
+	bool bare; /* only counted in dev->range_users */
+	wait_queue_head_t wait; /* woken when an overlapping range goes */
+};
+
+/*
+ * device representation, fields are grouped by who writes them so that
+ * readers, writers and fast appenders don't bounce each other's lines
+ */
+struct poums_device {
+	/* read-mostly */
+	struct radix_tree_root pages; /* sparse page-backed storage */
+	unsigned long capacity; /* max size, changed under exclusive sem */
+	enum poums_alloc_policy policy;
+	int node; /* NUMA node of the storage, NUMA_NO_NODE for local */
+	dev_t devt; /* numbers for debug purposes */
+	struct poums_stats __percpu *stats;
+	struct cdev *cdev;
+	struct poums_device *origin; /* read-only snapshot of this device */
+
+	/* taken by every read and write */
+	struct rw_semaphore sem ____cacheline_aligned_in_smp; /* excl. writers */
+	spinlock_t lock; /* guards pages tree & size against the fault path */
+	ssize_t size; /* amount of data stored in buf */
+	unsigned int maps; /* mappings, under lock, see share_poums_storage() */
+	bool snapping; /* snapshot is being taken, under lock */
+	unsigned long nr_pages; /* in the pages tree, under lock */
+	unsigned long atime; /* jiffies of the last read or write */
+	bool zeros_scanned; /* no zero pages within size, under lock */
+	spinlock_t range_lock; /* guards ranges */
+	struct list_head ranges; /* held and waiting byte ranges, FIFO */
+	atomic64_t range_users; /* bare readers + POUMS_RANGE_WRITER each
+			in-place writer, held or waiting */
+
+	/* fast appenders */
+	atomic64_t tail ____cacheline_aligned_in_smp; /* end of reserved space */
+	atomic64_t committed; /* end of published space */
+	wait_queue_head_t commitq; /* fast appenders waiting to publish */
+	struct list_head orphans; /* killed appenders' reservations, under lock */
+
+	/* rarely touched */
+	wait_queue_head_t readq ____cacheline_aligned_in_smp; /* stream mode */
+	struct fasync_struct *fasync; /* SIGIO subscribers */
+	bool gone; /* destroyed, stream readers get EOF */
+	struct kref kref; /* idr, open files, mappings and snapshots */
+};
+
+void
+init_poums_storage(struct poums_device *dev, unsigned long capacity,
+		enum poums_alloc_policy policy);
+ssize_t
+read_poums_iter(struct poums_device *dev, loff_t off, size_t count,
+		struct iov_iter *to);
+ssize_t
+write_poums_iter(struct poums_device *dev, loff_t off, size_t count,
+		struct iov_iter *from);
+ssize_t
+batch_poums_io(struct poums_device *dev, bool write, bool exclusive,
+		loff_t off, size_t len, void __user *buf);
+ssize_t
+append_poums_iter(struct poums_device *dev, struct iov_iter *from,
+		loff_t *pos);
+struct page *
+find_poums_page(struct poums_device *dev, pgoff_t index);
+struct page *
+get_poums_page(struct poums_device *dev, pgoff_t index, bool alloc);
+struct page *
+insert_poums_page(struct poums_device *dev, pgoff_t index, struct page *new);
+ssize_t
+copy_to_poums_page(struct poums_device *dev, loff_t off, size_t chunk,
+		struct iov_iter *from);
+struct page *
+unshare_poums_page(struct poums_device *dev, struct page *page);
+int
+share_poums_storage(struct poums_device *snap, struct poums_device *dev);
+bool
+poums_storage_shared(struct poums_device *dev);
+int
+fill_poums_storage(struct poums_device *dev, pgoff_t start, pgoff_t end);
+void
+clear_poums_storage(struct poums_device *dev);
+bool
+truncate_poums_storage(struct poums_device *dev, struct file *fp);
+void
+drop_poums_pages(struct poums_device *dev, pgoff_t start);
+int
+save_poums_storage(struct poums_device *dev, struct file *file);
+loff_t
+load_poums_storage(struct poums_device *dev, struct file *file);
+unsigned long
+reclaimable_poums_pages(struct poums_device *dev, bool idle);
+unsigned long
+reclaim_poums_storage(struct poums_device *dev, unsigned long nr, bool idle);
+void
+free_poums_storage(struct poums_device *dev);
+loff_t
+seek_poums_data(struct poums_device *dev, loff_t off, int whence);
+void
+lock_poums_range(struct poums_device *dev, struct poums_range *range,
+		loff_t start, loff_t end, bool write);
+void
+unlock_poums_range(struct poums_device *dev, struct poums_range *range);
+void
+notify_poums_readers(struct poums_device *dev);
+void
+sync_poums_tail(struct poums_device *dev);
+int
+publish_poums_mapped(struct poums_device *dev, loff_t end);
+
+#endif /* _TASK21_STORAGE_H */
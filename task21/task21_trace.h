@@ -0,0 +1,111 @@
+/*
+ * task21_trace.h
+ *
+ *      Author: Maxim Kouprianov
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM poums
+
+#if !defined(_TASK21_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TASK21_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(poums_open,
+	TP_PROTO(unsigned int minor, unsigned int flags, int ret),
+	TP_ARGS(minor, flags, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, flags)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->flags = flags;
+		__entry->ret = ret;
+	),
+
+	TP_printk("poums%u flags=0x%x ret=%d", __entry->minor, __entry->flags,
+			__entry->ret)
+);
+
+TRACE_EVENT(poums_close,
+	TP_PROTO(unsigned int minor),
+	TP_ARGS(minor),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+	),
+
+	TP_printk("poums%u", __entry->minor)
+);
+
+DECLARE_EVENT_CLASS(poums_rw,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(minor, pos, count, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("poums%u pos=%lld count=%zu ret=%zd", __entry->minor,
+			__entry->pos, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(poums_rw, poums_read,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(minor, pos, count, ret)
+);
+
+DEFINE_EVENT(poums_rw, poums_write,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(minor, pos, count, ret)
+);
+
+TRACE_EVENT(poums_llseek,
+	TP_PROTO(unsigned int minor, loff_t off, int whence, loff_t ret),
+	TP_ARGS(minor, off, whence, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, off)
+		__field(int, whence)
+		__field(loff_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->off = off;
+		__entry->whence = whence;
+		__entry->ret = ret;
+	),
+
+	TP_printk("poums%u off=%lld whence=%d ret=%lld", __entry->minor,
+			__entry->off, __entry->whence, __entry->ret)
+);
+
+#endif /* _TASK21_TRACE_H */
+
+/* this part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE task21_trace
+#include <trace/define_trace.h>
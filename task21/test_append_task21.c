@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ *  Task 2.1
+ *  Multi-writer O_APPEND stress test, load the module with
+ *  insmod task21.ko fast_append=1 buffsize=16777216
+ *  Concurrent readers check that no torn record is ever visible.
+ */
+
+#define DEVICE "/dev/poums0"
+#define LOG "test_append_task21: "
+#define RECLEN 64 /* bytes per record */
+#define MAXWRITERS 64
+#define READERS 2
+
+static int writers = 8;
+static int records = 10000; /* per writer */
+static volatile int done = 0;
+static volatile int failed = 0;
+
+/* "W<writer> S<seq> " followed by a filler derived from both */
+static void
+make_record(char *rec, int writer, int seq) {
+	int len = snprintf(rec, RECLEN, "W%03d S%08d ", writer, seq);
+	memset(rec + len, 'a' + (writer + seq) % 26, RECLEN - len - 1);
+	rec[RECLEN - 1] = '\n';
+}
+
+static int
+check_record(const char *rec, int *writer, int *seq) {
+	char expected[RECLEN];
+
+	if (sscanf(rec, "W%03d S%08d ", writer, seq) != 2 || *writer < 0
+			|| *writer >= MAXWRITERS) {
+		return -1;
+	}
+
+	make_record(expected, *writer, *seq);
+	return memcmp(rec, expected, RECLEN) ? -1 : 0;
+}
+
+static void *
+writer_loop(void *arg) {
+	int id = (int) (long) arg, seq, fd;
+	char rec[RECLEN];
+
+	if ((fd = open(DEVICE, O_WRONLY | O_APPEND)) < 0) {
+		failed = 1;
+		return NULL;
+	}
+
+	for (seq = 0; seq < records && !failed; ++seq) {
+		make_record(rec, id, seq);
+		if (write(fd, rec, RECLEN) != RECLEN) {
+			printf(LOG "writer #%d: short write at seq %d\n", id, seq);
+			failed = 1;
+			break;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/* everything below the visible size must consist of whole records */
+static int
+verify(int fd, int *last, int final) {
+	char rec[RECLEN];
+	int writer, seq, count = 0;
+	ssize_t len;
+
+	for (;;) {
+		len = pread(fd, rec, RECLEN, (off_t) count * RECLEN);
+		if (len == 0) {
+			break;
+		}
+		if (len != RECLEN || check_record(rec, &writer, &seq) < 0) {
+			printf(LOG "torn record #%d\n", count);
+			return -1;
+		}
+		if (final && seq != last[writer] + 1) {
+			printf(LOG "writer #%d: seq %d after %d\n", writer, seq,
+					last[writer]);
+			return -1;
+		}
+		last[writer] = seq;
+		++count;
+	}
+
+	return count;
+}
+
+static void *
+reader_loop(void *arg) {
+	int last[MAXWRITERS], fd;
+
+	if ((fd = open(DEVICE, O_RDONLY)) < 0) {
+		failed = 1;
+		return NULL;
+	}
+
+	while (!done && !failed) {
+		if (verify(fd, last, 0) < 0) {
+			failed = 1;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	pthread_t wthreads[MAXWRITERS], rthreads[READERS];
+	int last[MAXWRITERS], fd, i, count;
+
+	if (argc > 1) {
+		writers = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		records = atoi(argv[2]);
+	}
+	if (writers < 1 || writers > MAXWRITERS || records < 1) {
+		printf("usage:\n"
+				"./test_append_task21 [writers (1-%d)] [records per writer]\n",
+				MAXWRITERS);
+		return -1;
+	}
+
+	/* start from scratch */
+	if ((fd = open(DEVICE, O_RDONLY | O_TRUNC)) < 0) {
+		printf(LOG "unable to open device %s\n", DEVICE);
+		return -1;
+	}
+
+	for (i = 0; i < READERS; ++i) {
+		pthread_create(&rthreads[i], NULL, reader_loop, NULL);
+	}
+	for (i = 0; i < writers; ++i) {
+		pthread_create(&wthreads[i], NULL, writer_loop, (void *) (long) i);
+	}
+	for (i = 0; i < writers; ++i) {
+		pthread_join(wthreads[i], NULL);
+	}
+
+	done = 1;
+	for (i = 0; i < READERS; ++i) {
+		pthread_join(rthreads[i], NULL);
+	}
+
+	if (failed) {
+		printf(LOG "FAILED\n");
+		close(fd);
+		return -1;
+	}
+
+	/* every record exactly once, in per-writer order */
+	memset(last, 0xff, sizeof(last));
+	count = verify(fd, last, 1);
+	close(fd);
+
+	if (count != writers * records) {
+		printf(LOG "FAILED: %d records, expected %d\n", count,
+				writers * records);
+		return -1;
+	}
+
+	printf(LOG "OK: %d writers x %d records\n", writers, records);
+	return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "task21_ioctl.h"
+
+/*
+ *  Task 2.1
+ *  Batched I/O test: scattered writes and reads in a single ioctl,
+ *  per-entry results included
+ */
+
+#define DEVICE "/dev/poums0"
+#define LOG "test_batch_task21: "
+#define ENTRIES 64
+#define SLOT 16
+
+int main(void) {
+	struct poums_io ios[ENTRIES + 1];
+	struct poums_io_batch batch = { .ios = (unsigned long) ios };
+	char in[ENTRIES][SLOT], out[ENTRIES][SLOT];
+	int fd, i;
+
+	if ((fd = open(DEVICE, O_RDWR | O_TRUNC)) < 0) {
+		printf(LOG "unable to open device %s\n", DEVICE);
+		return -1;
+	}
+
+	/* every other slot, backwards */
+	memset(ios, 0, sizeof(ios));
+	for (i = 0; i < ENTRIES; ++i) {
+		snprintf(in[i], SLOT, "entry #%d", i);
+		ios[i].op = POUMS_IO_WRITE;
+		ios[i].offset = (ENTRIES - i) * 2 * SLOT;
+		ios[i].length = SLOT;
+		ios[i].buf = (unsigned long) in[i];
+	}
+
+	/* a bad entry doesn't stop the others */
+	ios[ENTRIES].op = 42;
+	batch.count = ENTRIES + 1;
+	if (ioctl(fd, IOCTL_IO_BATCH, &batch) != ENTRIES + 1
+			|| ios[ENTRIES].result != -EINVAL) {
+		printf(LOG "write batch failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < ENTRIES; ++i) {
+		if (ios[i].result != SLOT) {
+			printf(LOG "write #%d: %lld\n", i, ios[i].result);
+			return -1;
+		}
+		ios[i].op = POUMS_IO_READ;
+		ios[i].buf = (unsigned long) out[i];
+	}
+
+	batch.count = ENTRIES;
+	if (ioctl(fd, IOCTL_IO_BATCH, &batch) != ENTRIES) {
+		printf(LOG "read batch failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < ENTRIES; ++i) {
+		if (ios[i].result != SLOT || memcmp(in[i], out[i], SLOT)) {
+			printf(LOG "read #%d: %lld\n", i, ios[i].result);
+			return -1;
+		}
+	}
+
+	close(fd);
+
+	/* writes need a writable file */
+	if ((fd = open(DEVICE, O_RDONLY)) < 0) {
+		printf(LOG "unable to open device %s\n", DEVICE);
+		return -1;
+	}
+
+	ios[0].op = POUMS_IO_WRITE;
+	ios[0].buf = (unsigned long) in[0];
+	batch.count = 1;
+	if (ioctl(fd, IOCTL_IO_BATCH, &batch) != 1 || ios[0].result != -EBADF) {
+		printf(LOG "write through a read-only file\n");
+		return -1;
+	}
+
+	close(fd);
+	printf(LOG "OK: %d entries written and read back\n", ENTRIES);
+	return 0;
+}
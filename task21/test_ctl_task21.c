@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "task21_ioctl.h"
+
+/*
+ *  Task 2.1
+ *  Control node test: create a device, resize it, snapshot it and
+ *  destroy it while a file is still open on it (run as root)
+ */
+
+#define CTL_DEVICE "/dev/poums-ctl"
+#define LOG "test_ctl_task21: "
+#define CAPACITY 8192
+
+int main(void) {
+	struct poums_ctl_params params, snap;
+	char path[64], buf[CAPACITY], *map;
+	int ctl, fd, sfd;
+	ssize_t len;
+
+	if ((ctl = open(CTL_DEVICE, O_RDWR)) < 0) {
+		printf(LOG "unable to open %s\n", CTL_DEVICE);
+		return -1;
+	}
+
+	memset(&params, 0, sizeof(params));
+	params.capacity = CAPACITY;
+	if (ioctl(ctl, IOCTL_CREATE_DEVICE, &params) < 0) {
+		printf(LOG "create failed\n");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/dev/poums%u", params.minor);
+	usleep(100000); /* let udev create the node */
+	if ((fd = open(path, O_RDWR)) < 0) {
+		printf(LOG "unable to open %s\n", path);
+		return -1;
+	}
+
+	/* the whole capacity is writable, nothing more */
+	memset(buf, '*', CAPACITY);
+	if (write(fd, buf, CAPACITY) != CAPACITY || write(fd, buf, 1) > 0) {
+		printf(LOG "capacity is not honored\n");
+		return -1;
+	}
+
+	/* zero is no capacity at all, not the default one */
+	params.capacity = 0;
+	if (ioctl(ctl, IOCTL_RESIZE_DEVICE, &params) != -1 || errno != EINVAL) {
+		printf(LOG "resize to 0 not rejected\n");
+		return -1;
+	}
+
+	/* a mapping would keep the cut off pages, so no shrink under it */
+	map = mmap(NULL, CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		printf(LOG "mmap failed\n");
+		return -1;
+	}
+	params.capacity = 100;
+	if (ioctl(ctl, IOCTL_RESIZE_DEVICE, &params) != -1 || errno != EBUSY
+			|| map[CAPACITY - 1] != '*') {
+		printf(LOG "shrink of a mapped device not rejected\n");
+		return -1;
+	}
+	munmap(map, CAPACITY);
+
+	/* shrink keeps the head of the data */
+	if (ioctl(ctl, IOCTL_RESIZE_DEVICE, &params) < 0) {
+		printf(LOG "resize failed\n");
+		return -1;
+	}
+
+	len = pread(fd, buf, CAPACITY, 0);
+	if (len != 100 || buf[0] != '*' || buf[99] != '*') {
+		printf(LOG "shrink: read %zd bytes, expected 100\n", len);
+		return -1;
+	}
+
+	/* grow exposes zeros where the data was cut off */
+	params.capacity = CAPACITY;
+	if (ioctl(ctl, IOCTL_RESIZE_DEVICE, &params) < 0
+			|| pwrite(fd, "#", 1, 200) != 1
+			|| pread(fd, buf, CAPACITY, 0) != 201 || buf[150] != 0) {
+		printf(LOG "grow failed\n");
+		return -1;
+	}
+
+	/* snapshot keeps the data as of now and can't be written */
+	snap = params;
+	if (ioctl(ctl, IOCTL_SNAPSHOT_DEVICE, &snap) < 0) {
+		printf(LOG "snapshot failed\n");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/dev/poums%u.snap%u", params.minor,
+			snap.minor);
+	usleep(100000);
+	if (open(path, O_RDWR) >= 0 || (sfd = open(path, O_RDONLY)) < 0) {
+		printf(LOG "unable to open %s read-only\n", path);
+		return -1;
+	}
+
+	if (pwrite(fd, "@", 1, 200) != 1 || pread(sfd, buf, CAPACITY, 0) != 201
+			|| buf[0] != '*' || buf[200] != '#') {
+		printf(LOG "snapshot sees writes to the origin\n");
+		return -1;
+	}
+
+	close(sfd);
+	if (ioctl(ctl, IOCTL_DESTROY_DEVICE, &snap) < 0) {
+		printf(LOG "snapshot destroy failed\n");
+		return -1;
+	}
+
+	/* a stream reader at the end waits for data until the device goes */
+	if (ioctl(fd, IOCTL_SET_STREAM, 1) < 0
+			|| fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+			|| lseek(fd, 201, SEEK_SET) != 201
+			|| read(fd, buf, 1) != -1 || errno != EAGAIN) {
+		printf(LOG "stream read didn't block at the end\n");
+		return -1;
+	}
+
+	/* the open file outlives the device */
+	if (ioctl(ctl, IOCTL_DESTROY_DEVICE, &params) < 0) {
+		printf(LOG "destroy failed\n");
+		return -1;
+	}
+	if (read(fd, buf, 1) != 0) {
+		printf(LOG "stream read didn't end with the device\n");
+		return -1;
+	}
+	if (pread(fd, buf, 1, 200) != 1 || buf[0] != '@') {
+		printf(LOG "open file broken after destroy\n");
+		return -1;
+	}
+
+	close(fd);
+	close(ctl);
+	printf(LOG "OK: poums%u created, resized, snapshotted and destroyed\n",
+			params.minor);
+	return 0;
+}
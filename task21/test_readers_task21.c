@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ *  Task 2.1
+ *  Concurrent readers test: read throughput
+ *  should grow with the number of threads
+ */
+
+#define DEVICE "/dev/poums0"
+#define LOG "test_readers_task21: "
+#define BLOCK 4096
+#define MAXTHREADS 256
+
+static volatile int stop = 0;
+
+struct reader {
+	pthread_t thread;
+	unsigned long ops;
+	int err;
+};
+
+static void *
+reader_loop(void *arg) {
+	struct reader *r = arg;
+	char buf[BLOCK];
+	int fd;
+
+	if ((fd = open(DEVICE, O_RDONLY)) < 0) {
+		r->err = -1;
+		return NULL;
+	}
+
+	while (!stop) {
+		if (pread(fd, buf, BLOCK, 0) < 0) {
+			r->err = -1;
+			break;
+		}
+		++r->ops;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static double
+run_readers(int threads, int seconds) {
+	struct reader readers[MAXTHREADS];
+	struct timespec start, end;
+	unsigned long total = 0;
+	double elapsed;
+	int i;
+
+	memset(readers, 0, sizeof(readers));
+	stop = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&readers[i].thread, NULL, reader_loop, &readers[i]);
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < threads; ++i) {
+		pthread_join(readers[i].thread, NULL);
+		if (readers[i].err) {
+			printf(LOG "reader #%d failed\n", i);
+			return -1;
+		}
+		total += readers[i].ops;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return total / elapsed;
+}
+
+int main(int argc, char **argv) {
+	int fd, threads, maxthreads = 8, seconds = 2;
+	double ops, base = 0;
+	char buf[BLOCK];
+
+	if (argc > 1) {
+		maxthreads = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		seconds = atoi(argv[2]);
+	}
+	if (maxthreads < 1 || maxthreads > MAXTHREADS || seconds < 1) {
+		printf("usage:\n"
+				"./test_readers_task21 [max_threads (1-%d)] [seconds]\n",
+				MAXTHREADS);
+		return -1;
+	}
+
+	/* fill the device so there is something to read */
+	if ((fd = open(DEVICE, O_WRONLY | O_TRUNC)) < 0) {
+		printf(LOG "unable to open device %s\n", DEVICE);
+		return -1;
+	}
+
+	memset(buf, '*', BLOCK);
+	if (write(fd, buf, BLOCK) < 0) {
+		printf(LOG "unable to fill device %s\n", DEVICE);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	for (threads = 1; threads <= maxthreads; threads *= 2) {
+		ops = run_readers(threads, seconds);
+		if (ops < 0) {
+			return -1;
+		}
+		if (base == 0) {
+			base = ops;
+		}
+		printf(LOG "threads=%d reads/s=%.0f MB/s=%.1f speedup=%.2f\n",
+				threads, ops, ops * BLOCK / (1024 * 1024), ops / base);
+	}
+
+	return 0;
+}
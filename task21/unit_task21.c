@@ -0,0 +1,880 @@
+/*
+ *  Task 2.1
+ *  Unit tests and microbenchmarks of the storage data path, built in
+ *  userspace against ../shim (make unit), no module loading involved
+ */
+
+#include <linux/kernel.h>
+
+#include "task21_storage.h"
+
+#define LOG "unit_task21: "
+#define CAPACITY (1024 * 1024)
+#define RECLEN 64
+#define APPENDERS 4
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf(LOG "FAIL %s:%d: %s\n", __func__, __LINE__, #cond); \
+		++failed; \
+	} \
+} while (0)
+
+static ssize_t
+dev_write(struct poums_device *dev, loff_t off, const void *buf, size_t len) {
+	struct iovec iov = { (void *) buf, len };
+	struct iov_iter iter;
+	ssize_t ret;
+
+	iov_iter_init(&iter, WRITE, &iov, 1, len);
+	down_write(&dev->sem);
+	ret = write_poums_iter(dev, off, len, &iter);
+	sync_poums_tail(dev);
+	up_write(&dev->sem);
+	return ret;
+}
+
+static ssize_t
+dev_read(struct poums_device *dev, loff_t off, void *buf, size_t len) {
+	struct iovec iov = { buf, len };
+	struct poums_range range;
+	struct iov_iter iter;
+	ssize_t ret = 0;
+
+	iov_iter_init(&iter, READ, &iov, 1, len);
+	down_read(&dev->sem);
+	if (off < dev->size) {
+		len = min_t(size_t, len, dev->size - off);
+		lock_poums_range(dev, &range, off, off + len, false);
+		ret = read_poums_iter(dev, off, len, &iter);
+		unlock_poums_range(dev, &range);
+	}
+	up_read(&dev->sem);
+	return ret;
+}
+
+/* overwrite within size the way poums_write_iter() does it */
+static ssize_t
+dev_overwrite(struct poums_device *dev, loff_t off, const void *buf,
+		size_t len) {
+	struct iovec iov = { (void *) buf, len };
+	struct poums_range range;
+	struct iov_iter iter;
+	ssize_t ret;
+
+	iov_iter_init(&iter, WRITE, &iov, 1, len);
+	down_read(&dev->sem);
+	lock_poums_range(dev, &range, off, off + len, true);
+	ret = write_poums_iter(dev, off, len, &iter);
+	unlock_poums_range(dev, &range);
+	up_read(&dev->sem);
+	return ret;
+}
+
+static unsigned long
+count_pages(struct poums_device *dev) {
+	struct radix_tree_iter iter;
+	unsigned long count = 0;
+	void **slot;
+
+	radix_tree_for_each_slot(slot, &dev->pages, &iter, 0) {
+		++count;
+	}
+	return count;
+}
+
+/* =============================================== */
+
+static void
+test_roundtrip(enum poums_alloc_policy policy) {
+	struct poums_device dev;
+	char in[3 * PAGE_SIZE], out[4 * PAGE_SIZE];
+	struct iovec iov[3];
+	struct iov_iter iter;
+	size_t i;
+
+	init_poums_storage(&dev, CAPACITY, policy);
+	for (i = 0; i < sizeof(in); ++i) {
+		in[i] = 'a' + i % 26;
+	}
+
+	/* unaligned, crossing pages */
+	CHECK(dev_write(&dev, 100, in, sizeof(in)) == sizeof(in));
+	CHECK(dev.size == 100 + sizeof(in));
+	CHECK(dev_read(&dev, 0, out, sizeof(out)) == 100 + sizeof(in));
+	for (i = 0; i < 100; ++i) {
+		CHECK(out[i] == 0);
+	}
+	CHECK(!memcmp(out + 100, in, sizeof(in)));
+
+	/* scattered user segments */
+	iov[0] = (struct iovec) { in, 10 };
+	iov[1] = (struct iovec) { in + 10, PAGE_SIZE };
+	iov[2] = (struct iovec) { in + 10 + PAGE_SIZE, 5 };
+	iov_iter_init(&iter, WRITE, iov, 3, PAGE_SIZE + 15);
+	down_write(&dev.sem);
+	CHECK(write_poums_iter(&dev, 5 * PAGE_SIZE, PAGE_SIZE + 15, &iter)
+			== PAGE_SIZE + 15);
+	up_write(&dev.sem);
+	CHECK(dev_read(&dev, 5 * PAGE_SIZE, out, sizeof(out)) == PAGE_SIZE + 15);
+	CHECK(!memcmp(out, in, PAGE_SIZE + 15));
+
+	/* the hole in between reads as zeros and has no pages */
+	CHECK(dev_read(&dev, 4 * PAGE_SIZE, out, PAGE_SIZE) == PAGE_SIZE);
+	for (i = 0; i < PAGE_SIZE; ++i) {
+		CHECK(out[i] == 0);
+	}
+	if (policy != POUMS_ALLOC_EAGER) {
+		CHECK(find_poums_page(&dev, 4) == NULL);
+	}
+
+	free_poums_storage(&dev);
+	CHECK(dev.size == 0 && count_pages(&dev) == 0);
+}
+
+/* nozero skips zeroing only when nothing of the old content can show */
+static void
+test_nozero(void) {
+	struct poums_device dev;
+	char in[PAGE_SIZE], out[PAGE_SIZE];
+	size_t i;
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_NOZERO);
+	memset(in, '#', sizeof(in));
+
+	CHECK(dev_write(&dev, 0, in, PAGE_SIZE) == PAGE_SIZE);
+	CHECK(dev_write(&dev, PAGE_SIZE, in, 10) == 10);
+	CHECK(dev_write(&dev, 3 * PAGE_SIZE - 1, in, 1) == 1);
+
+	CHECK(dev_read(&dev, 0, out, PAGE_SIZE) == PAGE_SIZE);
+	CHECK(!memcmp(out, in, PAGE_SIZE));
+	CHECK(dev_read(&dev, PAGE_SIZE, out, PAGE_SIZE) == PAGE_SIZE);
+	for (i = 10; i < PAGE_SIZE; ++i) {
+		CHECK(out[i] == 0);
+	}
+	CHECK(dev_read(&dev, 2 * PAGE_SIZE, out, PAGE_SIZE) == PAGE_SIZE);
+	for (i = 0; i < PAGE_SIZE - 1; ++i) {
+		CHECK(out[i] == 0);
+	}
+
+	free_poums_storage(&dev);
+}
+
+static void
+test_eager(void) {
+	unsigned long pages = DIV_ROUND_UP(CAPACITY + 1, PAGE_SIZE);
+	struct poums_device dev;
+	char out[PAGE_SIZE];
+	size_t i;
+
+	init_poums_storage(&dev, CAPACITY + 1, POUMS_ALLOC_EAGER);
+	CHECK(fill_poums_storage(&dev, 0, pages) == 0);
+	CHECK(count_pages(&dev) == pages);
+
+	CHECK(dev_write(&dev, 0, "hello", 5) == 5);
+	CHECK(count_pages(&dev) == pages);
+
+	/* O_TRUNC keeps eager pages, just zeroed */
+	down_write(&dev.sem);
+	clear_poums_storage(&dev);
+	up_write(&dev.sem);
+	CHECK(dev.size == 0 && count_pages(&dev) == pages);
+	CHECK(dev_write(&dev, PAGE_SIZE, "x", 1) == 1);
+	CHECK(dev_read(&dev, 0, out, PAGE_SIZE) == PAGE_SIZE);
+	for (i = 0; i < PAGE_SIZE; ++i) {
+		CHECK(out[i] == 0);
+	}
+
+	drop_poums_pages(&dev, 2);
+	CHECK(count_pages(&dev) == 2);
+	free_poums_storage(&dev);
+	CHECK(count_pages(&dev) == 0);
+}
+
+static void
+test_reclaim(void) {
+	unsigned long pages = CAPACITY / PAGE_SIZE;
+	struct poums_device dev, snap;
+	char in[PAGE_SIZE], out[4 * PAGE_SIZE];
+	size_t i;
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_EAGER);
+	CHECK(fill_poums_storage(&dev, 0, pages) == 0);
+	CHECK(dev.nr_pages == pages);
+	memset(in, 'r', sizeof(in));
+	CHECK(dev_write(&dev, 3 * PAGE_SIZE, in, 10) == 10);
+
+	/* eager storage in use keeps its preallocation */
+	CHECK(reclaimable_poums_pages(&dev, false) == 0);
+	down_write(&dev.sem);
+	CHECK(reclaim_poums_storage(&dev, pages, false) == 0);
+	up_write(&dev.sem);
+	CHECK(dev.nr_pages == pages);
+
+	/*
+	 * idle device: zero pages read back the same as holes, they go with
+	 * the ones past the data, up to the count asked
+	 */
+	CHECK(reclaimable_poums_pages(&dev, true) == pages);
+	down_write(&dev.sem);
+	CHECK(reclaim_poums_storage(&dev, 10, true) == 10);
+	CHECK(reclaim_poums_storage(&dev, pages, true) == pages - 11);
+	up_write(&dev.sem);
+	CHECK(dev.nr_pages == 1 && find_poums_page(&dev, 3) != NULL);
+	CHECK(count_pages(&dev) == 1);
+
+	/* nothing left to free, no rescans until the next write */
+	CHECK(reclaimable_poums_pages(&dev, true) == 0);
+	CHECK(dev_read(&dev, 0, out, sizeof(out)) == 3 * PAGE_SIZE + 10);
+	for (i = 0; i < 3 * PAGE_SIZE; ++i) {
+		CHECK(out[i] == 0);
+	}
+	CHECK(!memcmp(out + 3 * PAGE_SIZE, in, 10));
+
+	/* pages shared with a snapshot stay */
+	CHECK(dev_write(&dev, 0, in, sizeof(in)) == sizeof(in));
+	memset(in, 0, sizeof(in));
+	CHECK(dev_write(&dev, PAGE_SIZE, in, sizeof(in)) == sizeof(in));
+	CHECK(reclaimable_poums_pages(&dev, true) == 3);
+	init_poums_storage(&snap, CAPACITY, POUMS_ALLOC_LAZY);
+	down_write(&dev.sem);
+	CHECK(share_poums_storage(&snap, &dev) == 0);
+	CHECK(reclaim_poums_storage(&dev, pages, true) == 0);
+	up_write(&dev.sem);
+	CHECK(dev.nr_pages == 3 && snap.nr_pages == 3);
+
+	/* the snapshot alone is left with its zero page to give back */
+	free_poums_storage(&dev);
+	down_write(&snap.sem);
+	CHECK(reclaim_poums_storage(&snap, pages, true) == 1);
+	up_write(&snap.sem);
+	CHECK(find_poums_page(&snap, 1) == NULL && snap.nr_pages == 2);
+	CHECK(dev_read(&snap, 0, out, 1) == 1 && out[0] == 'r');
+	free_poums_storage(&snap);
+
+	/* lazy storage in use: a page past the data, e.g. faulted in, goes */
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	CHECK(dev_write(&dev, 0, in, 10) == 10);
+	put_page(get_poums_page(&dev, 5, true));
+	CHECK(reclaimable_poums_pages(&dev, false) == 1);
+	down_write(&dev.sem);
+	CHECK(reclaim_poums_storage(&dev, pages, false) == 1);
+	up_write(&dev.sem);
+	CHECK(dev.nr_pages == 1 && find_poums_page(&dev, 5) == NULL);
+	free_poums_storage(&dev);
+}
+
+static void
+test_backing(void) {
+	char path[] = "/tmp/unit_task21.XXXXXX", in[PAGE_SIZE], zero[10] = { 0 };
+	static char out[3 * POUMS_IO_CHUNK], data[3 * POUMS_IO_CHUNK];
+	struct file file = { .shim_fd = mkstemp(path) };
+	struct poums_device dev, copy;
+	size_t i, size;
+
+	CHECK(file.shim_fd >= 0);
+	unlink(path);
+
+	/* data across chunk boundaries, a hole between and one at the end */
+	init_poums_storage(&dev, sizeof(data), POUMS_ALLOC_LAZY);
+	for (i = 0; i < sizeof(data); ++i) {
+		data[i] = 'a' + i % 23;
+	}
+	CHECK(dev_write(&dev, 0, data, POUMS_IO_CHUNK + 100)
+			== POUMS_IO_CHUNK + 100);
+	memset(in, 'h', sizeof(in));
+	CHECK(dev_write(&dev, 2 * POUMS_IO_CHUNK + 5, in, sizeof(in))
+			== sizeof(in));
+	CHECK(dev_write(&dev, 2 * POUMS_IO_CHUNK + 3 * PAGE_SIZE, zero, 10) == 10);
+	down_write(&dev.sem);
+	CHECK(reclaim_poums_storage(&dev, 1, true) == 1);
+	up_write(&dev.sem);
+	size = dev.size;
+
+	down_read(&dev.sem);
+	CHECK(save_poums_storage(&dev, &file) == 0);
+	up_read(&dev.sem);
+	CHECK(lseek(file.shim_fd, 0, SEEK_END) == size);
+
+	init_poums_storage(&copy, sizeof(data), POUMS_ALLOC_LAZY);
+	down_write(&copy.sem);
+	CHECK(load_poums_storage(&copy, &file) == size);
+	up_write(&copy.sem);
+	CHECK(copy.size == size && count_pages(&copy) == count_pages(&dev));
+	CHECK(dev_read(&dev, 0, data, sizeof(data)) == size);
+	CHECK(dev_read(&copy, 0, out, sizeof(out)) == size);
+	CHECK(!memcmp(data, out, size));
+	CHECK(atomic64_read(&copy.tail) == size);
+	free_poums_storage(&copy);
+
+	/* an image larger than the device is cut to the capacity */
+	init_poums_storage(&copy, PAGE_SIZE + 1, POUMS_ALLOC_EAGER);
+	CHECK(fill_poums_storage(&copy, 0, 2) == 0);
+	down_write(&copy.sem);
+	CHECK(load_poums_storage(&copy, &file) == PAGE_SIZE + 1);
+	up_write(&copy.sem);
+	CHECK(dev_read(&copy, 0, out, sizeof(out)) == PAGE_SIZE + 1);
+	CHECK(!memcmp(data, out, PAGE_SIZE + 1));
+	free_poums_storage(&copy);
+
+	free_poums_storage(&dev);
+	close(file.shim_fd);
+}
+
+static void
+test_seek(void) {
+	struct poums_device dev;
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	CHECK(dev_write(&dev, 2 * PAGE_SIZE, "data", 4) == 4);
+	CHECK(dev_write(&dev, 5 * PAGE_SIZE, "data", 4) == 4);
+
+	CHECK(seek_poums_data(&dev, 0, SEEK_DATA) == 2 * PAGE_SIZE);
+	CHECK(seek_poums_data(&dev, 2 * PAGE_SIZE, SEEK_HOLE) == 3 * PAGE_SIZE);
+	CHECK(seek_poums_data(&dev, 3 * PAGE_SIZE, SEEK_DATA) == 5 * PAGE_SIZE);
+	CHECK(seek_poums_data(&dev, 5 * PAGE_SIZE, SEEK_HOLE) == dev.size);
+	CHECK(seek_poums_data(&dev, dev.size, SEEK_DATA) == -ENXIO);
+
+	free_poums_storage(&dev);
+}
+
+static void
+test_snapshot(void) {
+	struct poums_device dev, snap, snap2;
+	char in[3 * PAGE_SIZE], out[3 * PAGE_SIZE];
+	struct page *shared;
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	memset(in, 'o', sizeof(in));
+	CHECK(dev_write(&dev, 0, in, 2 * PAGE_SIZE + 10) == 2 * PAGE_SIZE + 10);
+
+	/* full pages are shared, the partial last one is copied */
+	init_poums_storage(&snap, CAPACITY, POUMS_ALLOC_LAZY);
+	down_write(&dev.sem);
+	CHECK(share_poums_storage(&snap, &dev) == 0);
+	up_write(&dev.sem);
+	CHECK(snap.size == dev.size && count_pages(&snap) == 3);
+	CHECK(find_poums_page(&snap, 0) == find_poums_page(&dev, 0));
+	CHECK(find_poums_page(&snap, 2) != find_poums_page(&dev, 2));
+	CHECK(radix_tree_tag_get(&dev.pages, 1, POUMS_TAG_COW));
+	CHECK(!radix_tree_tag_get(&dev.pages, 2, POUMS_TAG_COW));
+
+	/* writes to the origin don't show in the snapshot */
+	shared = find_poums_page(&dev, 1);
+	memset(in, 'n', sizeof(in));
+	CHECK(dev_write(&dev, PAGE_SIZE + 1, in, PAGE_SIZE) == PAGE_SIZE);
+	CHECK(find_poums_page(&dev, 1) != shared);
+	CHECK(find_poums_page(&snap, 1) == shared && page_count(shared) == 1);
+	CHECK(find_poums_page(&dev, 0) == find_poums_page(&snap, 0));
+	CHECK(dev_read(&dev, 0, out, sizeof(out)) == 2 * PAGE_SIZE + 10);
+	CHECK(out[PAGE_SIZE] == 'o' && out[PAGE_SIZE + 1] == 'n'
+			&& out[2 * PAGE_SIZE] == 'n' && out[2 * PAGE_SIZE + 1] == 'o');
+	CHECK(dev_read(&snap, 0, out, sizeof(out)) == 2 * PAGE_SIZE + 10);
+	memset(in, 'o', sizeof(in));
+	CHECK(!memcmp(out, in, 2 * PAGE_SIZE + 10));
+
+	/* O_TRUNC of eager storage leaves shared pages to the snapshot */
+	init_poums_storage(&snap2, CAPACITY, POUMS_ALLOC_LAZY);
+	down_write(&dev.sem);
+	CHECK(share_poums_storage(&snap2, &dev) == 0);
+	clear_poums_storage(&dev);
+	up_write(&dev.sem);
+	CHECK(find_poums_page(&dev, 0) == NULL);
+	CHECK(dev_read(&snap2, 0, out, 1) == 1 && out[0] == 'o');
+	free_poums_storage(&snap2);
+
+	/* once the snapshot is gone, nothing is copied anymore */
+	CHECK(dev_write(&dev, 0, in, PAGE_SIZE) == PAGE_SIZE);
+	down_write(&dev.sem);
+	CHECK(share_poums_storage(&snap2, &dev) == 0);
+	up_write(&dev.sem);
+	spin_lock(&dev.lock);
+	CHECK(poums_storage_shared(&dev));
+	spin_unlock(&dev.lock);
+	free_poums_storage(&snap2);
+	spin_lock(&dev.lock);
+	CHECK(!poums_storage_shared(&dev));
+	spin_unlock(&dev.lock);
+	CHECK(!radix_tree_tagged(&dev.pages, POUMS_TAG_COW));
+
+	free_poums_storage(&dev);
+	CHECK(dev_read(&snap, PAGE_SIZE, out, 1) == 1 && out[0] == 'o');
+	free_poums_storage(&snap);
+}
+
+/* hot fields of different users don't share cache lines */
+/* O_TRUNC on open() only for writers, never for a snapshot */
+static void
+test_truncate(void) {
+	struct file rdonly = { .f_flags = O_RDONLY | O_TRUNC,
+			.f_mode = FMODE_READ };
+	struct file wronly = { .f_flags = O_WRONLY | O_TRUNC,
+			.f_mode = FMODE_WRITE };
+	unsigned long pages = DIV_ROUND_UP(CAPACITY, PAGE_SIZE);
+	struct poums_device dev, snap;
+	char in[PAGE_SIZE], out[PAGE_SIZE];
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_EAGER);
+	CHECK(fill_poums_storage(&dev, 0, pages) == 0);
+	memset(in, 'o', sizeof(in));
+	CHECK(dev_write(&dev, 0, in, sizeof(in)) == sizeof(in));
+
+	/* snapshots get the global policy, eager too */
+	init_poums_storage(&snap, CAPACITY, POUMS_ALLOC_EAGER);
+	down_write(&dev.sem);
+	CHECK(share_poums_storage(&snap, &dev) == 0);
+	up_write(&dev.sem);
+	snap.origin = &dev;
+
+	down_write(&snap.sem);
+	CHECK(!truncate_poums_storage(&snap, &rdonly));
+	CHECK(!truncate_poums_storage(&snap, &wronly));
+	up_write(&snap.sem);
+	CHECK(dev_read(&dev, 0, out, sizeof(out)) == sizeof(out));
+	CHECK(!memcmp(out, in, sizeof(in)));
+	CHECK(dev_read(&snap, 0, out, sizeof(out)) == sizeof(out));
+	CHECK(!memcmp(out, in, sizeof(in)));
+
+	down_write(&dev.sem);
+	CHECK(!truncate_poums_storage(&dev, &rdonly) && dev.size == PAGE_SIZE);
+	CHECK(truncate_poums_storage(&dev, &wronly) && dev.size == 0);
+	up_write(&dev.sem);
+	CHECK(dev_read(&snap, 0, out, sizeof(out)) == sizeof(out));
+	CHECK(!memcmp(out, in, sizeof(in)));
+
+	free_poums_storage(&snap);
+	free_poums_storage(&dev);
+}
+
+static void
+test_layout(void) {
+	size_t sem = offsetof(struct poums_device, sem) / SMP_CACHE_BYTES;
+	size_t tail = offsetof(struct poums_device, tail) / SMP_CACHE_BYTES;
+	size_t readq = offsetof(struct poums_device, readq) / SMP_CACHE_BYTES;
+
+	CHECK(offsetof(struct poums_device, capacity) / SMP_CACHE_BYTES < sem);
+	CHECK(offsetof(struct poums_device, size) / SMP_CACHE_BYTES < tail);
+	CHECK(offsetof(struct poums_device, commitq) / SMP_CACHE_BYTES < readq);
+	CHECK(__alignof__(struct poums_device) == SMP_CACHE_BYTES);
+	CHECK(sizeof(struct poums_device) % SMP_CACHE_BYTES == 0);
+}
+
+static void
+test_batch(void) {
+	struct poums_device dev;
+	char out[2 * PAGE_SIZE];
+
+	init_poums_storage(&dev, 3 * PAGE_SIZE, POUMS_ALLOC_LAZY);
+
+	down_write(&dev.sem);
+	CHECK(batch_poums_io(&dev, true, true, 10, 5, "hello") == 5);
+	CHECK(batch_poums_io(&dev, true, true, PAGE_SIZE - 2, 5, "world") == 5);
+	/* clamped to capacity */
+	CHECK(batch_poums_io(&dev, true, true, 3 * PAGE_SIZE - 1, 2, "!!") == 1);
+	CHECK(batch_poums_io(&dev, true, true, 3 * PAGE_SIZE, 2, "!!") == 0);
+	CHECK(batch_poums_io(&dev, true, true, -1, 2, "!!") == -EINVAL);
+	up_write(&dev.sem);
+	CHECK(dev.size == 3 * PAGE_SIZE);
+
+	/* reads under the shared lock, clamped to size */
+	down_read(&dev.sem);
+	CHECK(batch_poums_io(&dev, false, false, 10, 5, out) == 5);
+	CHECK(!memcmp(out, "hello", 5));
+	CHECK(batch_poums_io(&dev, false, false, PAGE_SIZE - 2, 5, out) == 5);
+	CHECK(!memcmp(out, "world", 5));
+	CHECK(batch_poums_io(&dev, false, false, 3 * PAGE_SIZE - 1, 5, out) == 1);
+	CHECK(out[0] == '!');
+	CHECK(batch_poums_io(&dev, false, false, 3 * PAGE_SIZE, 5, out) == 0);
+	up_read(&dev.sem);
+	CHECK(list_empty(&dev.ranges));
+
+	free_poums_storage(&dev);
+}
+
+struct ranger {
+	pthread_t thread;
+	struct poums_device *dev;
+	struct poums_range range;
+	loff_t start, end;
+	bool write;
+	int locked;
+};
+
+static void *
+lock_range(void *arg) {
+	struct ranger *r = arg;
+
+	lock_poums_range(r->dev, &r->range, r->start, r->end, r->write);
+	__atomic_store_n(&r->locked, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void
+test_ranges(void) {
+	struct poums_range a, b, c;
+	struct ranger w = { .start = 300, .end = 400, .write = true };
+	struct ranger r = { .start = 50, .end = 150 };
+	struct poums_device dev;
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	r.dev = w.dev = &dev;
+
+	/* no in-place writers, readers aren't queued */
+	lock_poums_range(&dev, &a, 0, 100, false);
+	CHECK(a.bare && list_empty(&dev.ranges));
+
+	/* a writer waits for bare readers anywhere, readers then queue */
+	pthread_create(&w.thread, NULL, lock_range, &w);
+	msleep(20);
+	CHECK(!__atomic_load_n(&w.locked, __ATOMIC_ACQUIRE));
+	lock_poums_range(&dev, &b, 0, 100, false);
+	CHECK(!b.bare);
+	unlock_poums_range(&dev, &a);
+	pthread_join(w.thread, NULL);
+	CHECK(w.locked);
+	unlock_poums_range(&dev, &b);
+	unlock_poums_range(&dev, &w.range);
+	CHECK(list_empty(&dev.ranges) && atomic64_read(&dev.range_users) == 0);
+
+	/* disjoint writers and overlapping readers don't wait */
+	lock_poums_range(&dev, &a, 0, 100, true);
+	lock_poums_range(&dev, &b, 100, 200, true);
+	lock_poums_range(&dev, &c, 300, 400, false);
+
+	/* a reader of both waits for both writers */
+	pthread_create(&r.thread, NULL, lock_range, &r);
+	msleep(20);
+	CHECK(!__atomic_load_n(&r.locked, __ATOMIC_ACQUIRE));
+	unlock_poums_range(&dev, &a);
+	msleep(20);
+	CHECK(!__atomic_load_n(&r.locked, __ATOMIC_ACQUIRE));
+	unlock_poums_range(&dev, &b);
+	pthread_join(r.thread, NULL);
+	CHECK(r.locked);
+
+	/* readers share */
+	lock_poums_range(&dev, &a, 0, 400, false);
+	unlock_poums_range(&dev, &a);
+	unlock_poums_range(&dev, &r.range);
+	unlock_poums_range(&dev, &c);
+	CHECK(list_empty(&dev.ranges) && atomic64_read(&dev.range_users) == 0);
+}
+
+struct slotter {
+	pthread_t thread;
+	struct poums_device *dev;
+	int id;
+	size_t slot;
+	bool exclusive;
+	bool *stop;
+	unsigned long ops;
+};
+
+/* overwrites its own slot over and over */
+static void *
+slot_loop(void *arg) {
+	struct slotter *w = arg;
+	char buf[64 * 1024];
+	loff_t off = (loff_t) w->id * w->slot;
+
+	while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED)) {
+		memset(buf, 'A' + (w->ops + w->id) % 26, w->slot);
+		if (w->exclusive) {
+			dev_write(w->dev, off, buf, w->slot);
+		} else if (dev_overwrite(w->dev, off, buf, w->slot) != w->slot) {
+			++failed;
+		}
+		++w->ops;
+	}
+
+	return NULL;
+}
+
+/* disjoint slots run concurrently and every slot read stays whole */
+static void
+test_slots(void) {
+	struct slotter workers[APPENDERS];
+	bool stop = false;
+	struct poums_device dev;
+	char buf[3 * PAGE_SIZE / 2];
+	int i, round, j;
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	memset(buf, 'A', sizeof(buf));
+	for (i = 0; i < APPENDERS; ++i) {
+		CHECK(dev_write(&dev, (loff_t) i * sizeof(buf), buf, sizeof(buf))
+				== sizeof(buf));
+	}
+
+	for (i = 0; i < APPENDERS; ++i) {
+		workers[i] = (struct slotter) { .dev = &dev, .id = i,
+				.slot = sizeof(buf), .stop = &stop };
+		pthread_create(&workers[i].thread, NULL, slot_loop, &workers[i]);
+	}
+
+	for (round = 0; round < 2000; ++round) {
+		i = round % APPENDERS;
+		CHECK(dev_read(&dev, (loff_t) i * sizeof(buf), buf, sizeof(buf))
+				== sizeof(buf));
+		for (j = 1; j < sizeof(buf); ++j) {
+			if (buf[j] != buf[0]) {
+				CHECK(!"torn slot");
+				break;
+			}
+		}
+	}
+
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	for (i = 0; i < APPENDERS; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	CHECK(dev.size == APPENDERS * sizeof(buf));
+	free_poums_storage(&dev);
+}
+
+struct appender {
+	pthread_t thread;
+	struct poums_device *dev;
+	int id;
+	int records;
+};
+
+static void *
+append_loop(void *arg) {
+	struct appender *a = arg;
+	char rec[RECLEN];
+	struct iovec iov = { rec, RECLEN };
+	struct iov_iter iter;
+	loff_t pos;
+	int seq;
+
+	for (seq = 0; seq < a->records; ++seq) {
+		memset(rec, 'A' + a->id, RECLEN);
+		iov_iter_init(&iter, WRITE, &iov, 1, RECLEN);
+
+		down_read(&a->dev->sem);
+		if (append_poums_iter(a->dev, &iter, &pos) != RECLEN) {
+			++failed;
+		}
+		up_read(&a->dev->sem);
+	}
+
+	return NULL;
+}
+
+static void
+test_append(void) {
+	struct appender appenders[APPENDERS];
+	int records = CAPACITY / RECLEN / APPENDERS, i, j;
+	struct poums_device dev;
+	char rec[RECLEN];
+	struct iovec iov = { rec, RECLEN };
+	struct iov_iter iter;
+	loff_t pos;
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	for (i = 0; i < APPENDERS; ++i) {
+		appenders[i] = (struct appender) { .dev = &dev, .id = i,
+				.records = records };
+		pthread_create(&appenders[i].thread, NULL, append_loop, &appenders[i]);
+	}
+	for (i = 0; i < APPENDERS; ++i) {
+		pthread_join(appenders[i].thread, NULL);
+	}
+
+	/* the device is full now, every record must be whole */
+	CHECK(dev.size == CAPACITY);
+	for (i = 0; i < CAPACITY / RECLEN; ++i) {
+		CHECK(dev_read(&dev, (loff_t) i * RECLEN, rec, RECLEN) == RECLEN);
+		for (j = 1; j < RECLEN; ++j) {
+			if (rec[j] != rec[0]) {
+				CHECK(!"torn record");
+				break;
+			}
+		}
+	}
+
+	iov_iter_init(&iter, WRITE, &iov, 1, RECLEN);
+	CHECK(append_poums_iter(&dev, &iter, &pos) == 0); /* full, like write */
+	free_poums_storage(&dev);
+
+	/* a killed appender's record is published by the one before it */
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	atomic64_set(&dev.tail, RECLEN); /* [0, RECLEN) is being filled */
+	memset(rec, 'k', RECLEN);
+	iov_iter_init(&iter, WRITE, &iov, 1, RECLEN);
+	current->killed = true;
+	CHECK(append_poums_iter(&dev, &iter, &pos) == RECLEN && pos == RECLEN);
+	current->killed = false;
+	CHECK(dev.size == 0 && !list_empty(&dev.orphans));
+
+	atomic64_set(&dev.tail, 0);
+	memset(rec, 'e', RECLEN);
+	iov_iter_init(&iter, WRITE, &iov, 1, RECLEN);
+	CHECK(append_poums_iter(&dev, &iter, &pos) == RECLEN && pos == 0);
+	CHECK(dev.size == 2 * RECLEN && list_empty(&dev.orphans));
+	CHECK(dev_read(&dev, RECLEN, rec, RECLEN) == RECLEN && rec[0] == 'k');
+	free_poums_storage(&dev);
+
+	/* a page written through a mapping waits for the appends before it */
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	atomic64_set(&dev.tail, RECLEN); /* [0, RECLEN) is being filled */
+	CHECK(publish_poums_mapped(&dev, PAGE_SIZE) == 0);
+	CHECK(dev.size == 0 && atomic64_read(&dev.tail) == PAGE_SIZE);
+
+	memset(rec, 'k', RECLEN);
+	iov_iter_init(&iter, WRITE, &iov, 1, RECLEN);
+	current->killed = true; /* appends past the page, not over it */
+	CHECK(append_poums_iter(&dev, &iter, &pos) == RECLEN && pos == PAGE_SIZE);
+	current->killed = false;
+	CHECK(dev.size == 0);
+
+	atomic64_set(&dev.tail, 0);
+	memset(rec, 'e', RECLEN);
+	iov_iter_init(&iter, WRITE, &iov, 1, RECLEN);
+	CHECK(append_poums_iter(&dev, &iter, &pos) == RECLEN && pos == 0);
+	CHECK(dev.size == PAGE_SIZE + RECLEN && list_empty(&dev.orphans));
+
+	/* with nothing in flight it is published right away */
+	down_write(&dev.sem);
+	sync_poums_tail(&dev);
+	up_write(&dev.sem);
+	CHECK(publish_poums_mapped(&dev, 2 * PAGE_SIZE) == 0);
+	CHECK(dev.size == 2 * PAGE_SIZE
+			&& atomic64_read(&dev.tail) == 2 * PAGE_SIZE);
+	CHECK(publish_poums_mapped(&dev, PAGE_SIZE) == 0
+			&& dev.size == 2 * PAGE_SIZE);
+	free_poums_storage(&dev);
+}
+
+/* =============================================== */
+
+static void
+bench_rw(const char *name, enum poums_alloc_policy policy, size_t block,
+		bool write) {
+	static char buf[64 * 1024];
+	unsigned long ops = 0;
+	struct poums_device dev;
+	u64 start, elapsed;
+	loff_t off = 0;
+
+	init_poums_storage(&dev, CAPACITY, policy);
+	dev_write(&dev, 0, buf, sizeof(buf)); /* something to read */
+	for (off = sizeof(buf); off < CAPACITY; off += sizeof(buf)) {
+		dev_write(&dev, off, buf, sizeof(buf));
+	}
+
+	off = 0;
+	start = local_clock();
+	do {
+		if (write) {
+			dev_write(&dev, off, buf, block);
+		} else {
+			dev_read(&dev, off, buf, block);
+		}
+		off = off + block * 2 > CAPACITY ? 0 : off + block;
+		++ops;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+
+	printf(LOG "bench %s block=%zu ns/op=%.1f MB/s=%.1f\n", name, block,
+			(double) elapsed / ops, ops * block * 1e3 / elapsed);
+	free_poums_storage(&dev);
+}
+
+static void
+bench_fresh_write(const char *name, enum poums_alloc_policy policy) {
+	static char buf[CAPACITY];
+	struct poums_device dev;
+	unsigned long rounds = 0;
+	u64 start = local_clock(), elapsed;
+
+	do {
+		init_poums_storage(&dev, CAPACITY, policy);
+		dev_write(&dev, 0, buf, CAPACITY);
+		free_poums_storage(&dev);
+		++rounds;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+
+	printf(LOG "bench %s block=%d ns/op=%.1f MB/s=%.1f\n", name, CAPACITY,
+			(double) elapsed / rounds, rounds * (double) CAPACITY * 1e3 / elapsed);
+}
+
+/* disjoint slot writers, range locked vs all exclusive */
+static void
+bench_slots(int threads, size_t slot, bool exclusive) {
+	struct slotter workers[APPENDERS];
+	static char buf[APPENDERS * 64 * 1024];
+	bool stop = false;
+	struct poums_device dev;
+	unsigned long ops = 0;
+	int i;
+
+	init_poums_storage(&dev, CAPACITY, POUMS_ALLOC_LAZY);
+	dev_write(&dev, 0, buf, threads * slot);
+
+	for (i = 0; i < threads; ++i) {
+		workers[i] = (struct slotter) { .dev = &dev, .id = i, .slot = slot,
+				.exclusive = exclusive, .stop = &stop };
+		pthread_create(&workers[i].thread, NULL, slot_loop, &workers[i]);
+	}
+
+	msleep(200);
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	for (i = 0; i < threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+	}
+
+	printf(LOG "bench slotwrite_%s threads=%d block=%zu ops/s=%.0f\n",
+			exclusive ? "exclusive" : "ranged", threads, slot, ops / 0.2);
+	free_poums_storage(&dev);
+}
+
+int main(int argc, char **argv) {
+	size_t blocks[] = { 64, 4096, 65536 };
+	unsigned int i;
+
+	shim_loglevel = 3;
+
+	test_roundtrip(POUMS_ALLOC_LAZY);
+	test_roundtrip(POUMS_ALLOC_NOZERO);
+	test_roundtrip(POUMS_ALLOC_EAGER);
+	test_nozero();
+	test_eager();
+	test_reclaim();
+	test_backing();
+	test_seek();
+	test_snapshot();
+	test_truncate();
+	test_layout();
+	test_ranges();
+	test_slots();
+	test_batch();
+	test_append();
+
+	if (failed) {
+		printf(LOG "FAILED: %d checks\n", failed);
+		return -1;
+	}
+	printf(LOG "OK: all tests passed\n");
+
+	if (argc > 1 && !strcmp(argv[1], "--no-bench")) {
+		return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(blocks); ++i) {
+		bench_rw("read", POUMS_ALLOC_LAZY, blocks[i], false);
+		bench_rw("write", POUMS_ALLOC_LAZY, blocks[i], true);
+	}
+	bench_fresh_write("fresh_write_lazy", POUMS_ALLOC_LAZY);
+	bench_fresh_write("fresh_write_nozero", POUMS_ALLOC_NOZERO);
+	for (i = 1; i <= APPENDERS; i *= 2) {
+		bench_slots(i, 4096, true);
+		bench_slots(i, 4096, false);
+	}
+
+	return 0;
+}
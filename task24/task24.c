@@ -16,6 +16,18 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/mutex.h>
+#include <linux/srcu.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/capability.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
 #include <asm/uaccess.h>
 #include <linux/atomic.h>
 #include <linux/delay.h>
@@ -31,26 +43,165 @@ static dev_t first; /* first device number for driver */
 static struct class *poums_class = NULL;/* ptr to device's class object */
 static struct cdev *device = NULL; /* device */
 
-struct string_plugin **plugins = NULL; /* array to store plugins info */
+/* array to store plugins info, lookups under plugins_srcu */
+static struct string_plugin __rcu **plugins = NULL;
+static struct srcu_struct plugins_srcu; /* unregister waits for the calls */
+static DEFINE_MUTEX(plugins_lock); /* serializes register & unregister */
+
+/* params */
+static unsigned int workers = 16; /* async calls running at once */
+
+module_param(workers, uint, S_IRUGO);
+MODULE_PARM_DESC(workers, "maximum number of asynchronous calls running "
+		"at once, the rest wait in the queue (default: 16)");
+/* end params */
+
+static struct workqueue_struct *plugins_wq = NULL; /* async calls */
+
+/* 2 * STRING_MAX: input, then output of the synchronous calls */
+static struct kmem_cache *scratch_cache = NULL;
+static DEFINE_PER_CPU(char *, scratch_spare); /* last one put, per CPU */
+
+/* per open file: asynchronous calls and their completions */
+struct string_plugin_ctx {
+	spinlock_t lock;
+	struct list_head done; /* finished calls, oldest first */
+	unsigned int inflight; /* submitted and not read back yet */
+	unsigned long long ticket; /* last one given out */
+	wait_queue_head_t wait; /* readers & pollers */
+	struct kref kref; /* the file and every call until it's done */
+	struct string_plugin_ring *ring; /* set up once, lives with the file */
+};
+
+/* shared memory rings of a file, see struct string_rings */
+struct string_plugin_ring {
+	struct string_rings *rings; /* vmalloc_user(), mapped by the user */
+	struct string_ring_sqe *sqes;
+	struct string_ring_cqe *cqes;
+	char *arena;
+	unsigned int sq_entries, cq_entries, arena_size;
+	unsigned int sq_head, cq_tail; /* ours, the mapped ones are copies */
+	struct mutex lock; /* consumers of the SQ */
+	char *scratch; /* 2 * STRING_MAX: input, then output */
+	struct string_plugin_ctx *ctx; /* woken up on completions */
+	struct task_struct *poller; /* with STRING_RING_SQPOLL */
+	unsigned long idle; /* jiffies the poller spins before sleeping */
+	wait_queue_head_t wait; /* the poller sleeps here */
+};
+
+struct string_plugin_call {
+	struct work_struct work;
+	struct list_head list; /* in ctx->done */
+	struct string_plugin_ctx *ctx;
+	unsigned long long ticket;
+	unsigned int id;
+	char __user *buffer;
+	unsigned int outsize; /* of out */
+	int status;
+	unsigned int outlen;
+	char *out; /* right after in */
+	char in[];
+};
 
 static int
 poums_open(struct inode* inode, struct file* filp);
 static int
 poums_release(struct inode* inode, struct file* filp);
+static ssize_t
+poums_read(struct file* filp, char __user *buf, size_t count, loff_t *off);
+static unsigned int
+poums_poll(struct file* filp, poll_table *wait);
 static long
 poums_ioctl_func(struct file* filp, unsigned int cmd, unsigned long arg);
+static int
+call_plugin(int id, const char *in, char *out, unsigned int outsize);
+static int
+exec_plugin_long(struct string_plugin_call_params *params);
+static long
+exec_plugin_batch(struct string_plugin_batch __user *arg);
+static long
+exec_plugin_pipeline(struct string_plugin_pipeline __user *arg);
+static long
+exec_plugin_buffer(struct string_plugin_buffer __user *arg);
+static long
+submit_plugin_call(struct string_plugin_ctx *ctx,
+		struct string_plugin_submit __user *arg);
+static void
+run_plugin_call(struct work_struct *work);
+static void
+release_plugin_ctx(struct kref *kref);
+static long
+setup_plugin_ring(struct string_plugin_ctx *ctx,
+		struct string_ring_params __user *arg);
+static long
+enter_plugin_ring(struct string_plugin_ctx *ctx, unsigned long flags);
+static void
+free_plugin_ring(struct string_plugin_ring *ring);
+static int
+poums_mmap(struct file* filp, struct vm_area_struct *vma);
 
 struct file_operations fops = {
+	.owner = THIS_MODULE,
 	.open = poums_open,
+	.read = poums_read,
+	.poll = poums_poll,
+	.mmap = poums_mmap,
 	.unlocked_ioctl = poums_ioctl_func,
 	.release = poums_release
 };
 
 /* =============================================== */
+/*
+ * The spare of this CPU unless it's taken, handlers may sleep so it's
+ * taken for good rather than used under get_cpu().
+ */
+static char *
+get_scratch(void) {
+	char *buf = this_cpu_xchg(scratch_spare, NULL);
+
+	return buf != NULL ? buf : kmem_cache_alloc(scratch_cache, GFP_KERNEL);
+}
+
+static void
+put_scratch(char *buf) {
+	if (this_cpu_cmpxchg(scratch_spare, NULL, buf) != NULL) {
+		kmem_cache_free(scratch_cache, buf);
+	}
+}
+
+/*
+ * Plugins are called under SRCU rather than with their module locked:
+ * their handlers may sleep, and string_op_plugin_unregister() waits for
+ * the calls in flight, so a module can't go away under them.
+ */
 static int
-exec_plugin(struct string_plugin_call_params *params) {
-	int id, err = 0;
+call_plugin(int id, const char *in, char *out, unsigned int outsize) {
 	struct string_plugin *active;
+	int idx, err;
+
+	idx = srcu_read_lock(&plugins_srcu);
+	active = srcu_dereference(plugins[id], &plugins_srcu);
+	if(active == NULL) {
+		srcu_read_unlock(&plugins_srcu, idx);
+		pr_err(LOG "no such plugin to handle feature id=%d\n", id);
+		return -EINVAL;
+	}
+
+	out[0] = '\0';
+	err = active->handler(in, out, outsize);
+	srcu_read_unlock(&plugins_srcu, idx); /* let unregister go on */
+	return err;
+}
+
+/*
+ * Strings that fit go through the scratch of this CPU, longer ones get
+ * copies of their own, see exec_plugin_long().
+ */
+static int
+exec_plugin(struct string_plugin_call_params *params) {
+	char *in, *out;
+	long len;
+	int id, err;
 
 	if (params == NULL ) {
 		pr_err(LOG "params ptr is NULL\n");
@@ -64,50 +215,750 @@ exec_plugin(struct string_plugin_call_params *params) {
 		return -EINVAL;
 	}
 
-	active = plugins[id];
-	if(active == NULL) {
-		pr_err(LOG "no such plugin to handle feature id=%d\n", id);
-		return -EINVAL;
-	}
-
-	/* plugin found, lock it */
-	if(!try_module_get(plugins[id]->owner)) {
-		pr_err(LOG "unable to lock module of %s (id: %d)\n", active->name, id);
-		return -EINVAL;
-	}
-
-	pr_info(LOG "locked %s (id: %d)\n", active->name, id);
-
 	if(params->string == NULL) {
 		pr_err(LOG "no suitable input string provided (NULL)"
 				"for feature id=%d\n", id);
-		err = -EINVAL;
-		goto out;
+		return -EINVAL;
 	}
 
 	if(params->buffer == NULL) {
 		pr_err(LOG "no suitable output buffer provided (NULL)"
 				"for feature id=%d\n", id);
-		err = -EINVAL;
-		goto out;
+		return -EINVAL;
 	}
 
 	if(params->bufsize < 1) {
 		pr_err(LOG "no suitable output buffer provided (illegal size)"
 					"for feature id=%d\n", id);
-		err = -EINVAL;
+		return -EINVAL;
+	}
+
+	/* handlers only ever see kernel copies */
+	in = get_scratch();
+	if (in == NULL) {
+		return -ENOMEM;
+	}
+	out = in + STRING_MAX;
+
+	len = strncpy_from_user(in, (const char __user *) params->string,
+			STRING_MAX);
+	if (len < 0 || len == STRING_MAX) {
+		put_scratch(in);
+		return len < 0 ? len : exec_plugin_long(params);
+	}
+
+	err = call_plugin(id, in, out,
+			min_t(unsigned int, params->bufsize, STRING_MAX));
+	if (err == 0 && copy_to_user((char __user *) params->buffer, out,
+			strlen(out) + 1)) {
+		err = -EFAULT;
+	}
+	put_scratch(in);
+	return err;
+}
+
+/*
+ * The slow side of exec_plugin(), for strings past STRING_MAX. Plugins
+ * write no more than the string with its '\0' or a short message of
+ * their own, so the output is sized from it rather than from bufsize, and
+ * both copies are bounded by STRING_CALL_MAX to keep them off high-order
+ * allocations.
+ */
+static int
+exec_plugin_long(struct string_plugin_call_params *params) {
+	const char __user *string = (const char __user *) params->string;
+	unsigned int outsize;
+	char *in, *out;
+	long len;
+	int err;
+
+	len = strnlen_user(string, STRING_CALL_MAX);
+	if (len == 0) {
+		return -EFAULT;
+	}
+	if (len > STRING_CALL_MAX) {
+		return -E2BIG;
+	}
+
+	in = kmalloc(len, GFP_KERNEL | __GFP_NOWARN);
+	if (in == NULL) {
+		return -ENOMEM;
+	}
+	if (copy_from_user(in, string, len)) {
+		kfree(in);
+		return -EFAULT;
+	}
+	in[len - 1] = '\0'; /* may have changed since it was measured */
+
+	outsize = min_t(unsigned int, params->bufsize, len);
+	out = kmalloc(outsize, GFP_KERNEL | __GFP_NOWARN);
+	if (out == NULL) {
+		kfree(in);
+		return -ENOMEM;
+	}
+
+	err = call_plugin(params->id, in, out, outsize);
+	if (err == 0 && copy_to_user((char __user *) params->buffer, out,
+			strlen(out) + 1)) {
+		err = -EFAULT;
+	}
+	kfree(out);
+	kfree(in);
+	return err;
+}
+
+/* strings go through kernel buffers, see call_plugin() for the locking */
+static long
+exec_plugin_batch(struct string_plugin_batch __user *arg) {
+	struct string_plugin_batch batch;
+	struct string_plugin_batch_item *items, *item;
+	struct string_plugin *active;
+	unsigned int i;
+	char *in, *out;
+	long len, ret;
+	int idx;
+
+	if (copy_from_user(&batch, arg, sizeof(batch))) {
+		return -EFAULT;
+	}
+	if (batch.count > STRING_BATCH_MAX) {
+		return -EINVAL;
+	}
+	if (batch.count == 0) {
+		return 0;
+	}
+
+	items = memdup_user(batch.items,
+			batch.count * sizeof(struct string_plugin_batch_item));
+	if (IS_ERR(items)) {
+		return PTR_ERR(items);
+	}
+
+	in = get_scratch();
+	if (in == NULL) {
+		ret = -ENOMEM;
 		goto out;
 	}
+	out = in + STRING_MAX;
+
+	for (i = 0; i < batch.count; ++i) {
+		item = &items[i];
+		item->outlen = 0;
+
+		if (item->id >= PLUGINS_MAX || item->string == NULL
+				|| item->buffer == NULL || item->bufsize < 1) {
+			item->status = -EINVAL;
+			continue;
+		}
+
+		len = strncpy_from_user(in, item->string, STRING_MAX);
+		if (len < 0 || len == STRING_MAX) {
+			item->status = len < 0 ? len : -E2BIG;
+			continue;
+		}
+
+		/* per item, unregister doesn't wait for the whole batch */
+		idx = srcu_read_lock(&plugins_srcu);
+		active = srcu_dereference(plugins[item->id], &plugins_srcu);
+		if (active != NULL) {
+			out[0] = '\0';
+			item->status = active->handler(in, out,
+					min_t(unsigned int, item->bufsize, STRING_MAX));
+		} else {
+			item->status = -EINVAL;
+		}
+		srcu_read_unlock(&plugins_srcu, idx);
+
+		if (item->status == 0) {
+			item->outlen = strlen(out);
+			if (copy_to_user(item->buffer, out, item->outlen + 1)) {
+				item->status = -EFAULT;
+				item->outlen = 0;
+			}
+		}
+	}
+
+	ret = batch.count;
+	if (copy_to_user(batch.items, items,
+			batch.count * sizeof(struct string_plugin_batch_item))) {
+		ret = -EFAULT;
+	}
+
+	put_scratch(in);
+	out:
+		kfree(items);
+		return ret;
+}
+
+/*
+ * @count byte-wise plugins over @len bytes in a single pass. Long runs
+ * are composed into one table first. If that's the table of one of them
+ * (tolower then tocaps is tocaps), or there's a single one, the plugin
+ * is returned for its handler to run instead: it may well beat a lookup
+ * per byte.
+ */
+static struct string_plugin *
+map_string(struct string_plugin **stages, unsigned int count,
+		const char *in, char *out, size_t len) {
+	unsigned char map[256];
+	const unsigned char *last = stages[count - 1]->map;
+	unsigned int c, j;
+	size_t i;
+
+	if (count == 1) {
+		return stages[0];
+	}
+
+	/* unless that costs more than the string */
+	if (len > sizeof(map)) {
+		for (c = 0; c < 256; ++c) {
+			map[c] = c;
+			for (j = 0; j < count; ++j) {
+				map[c] = stages[j]->map[map[c]];
+			}
+		}
+		for (j = 0; j < count; ++j) {
+			if (!memcmp(map, stages[j]->map, sizeof(map))) {
+				return stages[j];
+			}
+		}
+		last = map;
+		count = 1;
+	}
 
-	err = plugins[id]->handler(params->string,
-			params->buffer, params->bufsize);
+	for (i = 0; i < len; ++i) {
+		c = (unsigned char) in[i];
+		for (j = 0; j < count - 1; ++j) {
+			c = stages[j]->map[c];
+		}
+		out[i] = last[c];
+	}
+	out[len] = '\0';
+	return NULL;
+}
+
+/*
+ * Stages ping-pong between two kernel buffers, see call_plugin() for
+ * the locking. Runs of plugins with a map are fused into one pass.
+ */
+static long
+exec_plugin_pipeline(struct string_plugin_pipeline __user *arg) {
+	struct string_plugin_pipeline pipe;
+	struct string_plugin *stages[STRING_PIPELINE_MAX];
+	struct string_plugin *active;
+	unsigned int i, j, outsize;
+	char *buf, *in, *out;
+	long len, err = 0;
+	int idx;
 
-	out: /* operations complete, unlock plugin */
-		module_put(plugins[id]->owner);
-		pr_info(LOG "unlocked %s (id: %d)\n", active->name, id);
+	if (copy_from_user(&pipe, arg, sizeof(pipe))) {
+		return -EFAULT;
+	}
+	if (pipe.count < 1 || pipe.count > STRING_PIPELINE_MAX
+			|| pipe.string == NULL || pipe.buffer == NULL
+			|| pipe.bufsize < 1) {
+		return -EINVAL;
+	}
+
+	buf = get_scratch();
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+	in = buf;
+	out = buf + STRING_MAX;
+
+	len = strncpy_from_user(in, pipe.string, STRING_MAX);
+	if (len < 0 || len == STRING_MAX) {
+		err = len < 0 ? len : -E2BIG;
+		goto out;
+	}
+	outsize = min_t(unsigned int, pipe.bufsize, STRING_MAX);
+
+	idx = srcu_read_lock(&plugins_srcu);
+	for (i = 0; i < pipe.count; ++i) {
+		stages[i] = pipe.ids[i] < PLUGINS_MAX
+				? srcu_dereference(plugins[pipe.ids[i]], &plugins_srcu) : NULL;
+		if (stages[i] == NULL) {
+			err = -EINVAL;
+			goto out_unlock;
+		}
+	}
+
+	for (i = 0; i < pipe.count; i = j) {
+		j = i + 1;
+		active = stages[i];
+		if (active->map != NULL) {
+			while (j < pipe.count && stages[j]->map != NULL) {
+				++j;
+			}
+			len = min_t(long, len, outsize - 1);
+			active = map_string(stages + i, j - i, in, out, len);
+		}
+		if (active != NULL) {
+			out[0] = '\0';
+			err = active->handler(in, out, outsize);
+			if (err) {
+				goto out_unlock;
+			}
+			len = strlen(out);
+		}
+		swap(in, out);
+	}
+	srcu_read_unlock(&plugins_srcu, idx);
+
+	/* the last output is in */
+	if (copy_to_user(pipe.buffer, in, len + 1)
+			|| put_user(len, &arg->outlen)) {
+		err = -EFAULT;
+	}
+	put_scratch(buf);
+	return err;
+
+	out_unlock:
+		srcu_read_unlock(&plugins_srcu, idx);
+	out:
+		put_scratch(buf);
 		return err;
 }
 
+/*
+ * The output always goes to a STRING_MAX scratch buffer first, so the
+ * size needed is known even when the user's buffer is too small.
+ */
+static long
+exec_plugin_buffer(struct string_plugin_buffer __user *arg) {
+	struct string_plugin_buffer params;
+	struct string_plugin *active;
+	char *in, *out;
+	long ret;
+	int idx;
+
+	if (copy_from_user(&params, arg, sizeof(params))) {
+		return -EFAULT;
+	}
+	if (params.id >= PLUGINS_MAX || (params.in == NULL && params.in_len)
+			|| (params.out == NULL && params.out_size)) {
+		return -EINVAL;
+	}
+	if (params.in_len > STRING_MAX) {
+		return -E2BIG;
+	}
+
+	in = get_scratch();
+	if (in == NULL) {
+		return -ENOMEM;
+	}
+	out = in + STRING_MAX;
+
+	if (copy_from_user(in, params.in, params.in_len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	idx = srcu_read_lock(&plugins_srcu);
+	active = srcu_dereference(plugins[params.id], &plugins_srcu);
+	if (active == NULL) {
+		ret = -EINVAL;
+	} else if (active->handler_v2 != NULL) {
+		ret = active->handler_v2(in, params.in_len, out, STRING_MAX);
+	} else if (params.in_len == STRING_MAX) {
+		ret = -E2BIG;
+	} else if (memchr(in, '\0', params.in_len) != NULL) {
+		ret = -EINVAL; /* a C string can't hold it */
+	} else {
+		in[params.in_len] = '\0';
+		out[0] = '\0';
+		ret = active->handler(in, out, STRING_MAX);
+		if (ret == 0) {
+			ret = strlen(out);
+		}
+	}
+	srcu_read_unlock(&plugins_srcu, idx);
+
+	if (ret < 0) {
+		goto out;
+	}
+	if (ret > STRING_MAX) {
+		ret = -E2BIG; /* more than we can ever hand out */
+		goto out;
+	}
+
+	if (put_user(ret, &arg->out_len)) {
+		ret = -EFAULT;
+	} else if (ret > params.out_size) {
+		ret = -ENOSPC;
+	} else {
+		ret = copy_to_user(params.out, out, ret) ? -EFAULT : 0;
+	}
+
+	out:
+		put_scratch(in);
+		return ret;
+}
+
+/*
+ * Copies the input in and queues the call, see IOCTL_SUBMIT_STRING.
+ * The output is kept in the call until read() copies it out.
+ */
+static long
+submit_plugin_call(struct string_plugin_ctx *ctx,
+		struct string_plugin_submit __user *arg) {
+	struct string_plugin_submit submit;
+	struct string_plugin_call *call;
+	unsigned int outsize;
+	long len;
+
+	if (copy_from_user(&submit, arg, sizeof(submit))) {
+		return -EFAULT;
+	}
+	if (submit.id >= PLUGINS_MAX || submit.string == NULL
+			|| submit.buffer == NULL || submit.bufsize < 1) {
+		return -EINVAL;
+	}
+
+	/* with the terminator */
+	len = strnlen_user(submit.string, STRING_MAX);
+	if (len == 0) {
+		return -EFAULT;
+	}
+	if (len > STRING_MAX) {
+		return -E2BIG;
+	}
+
+	outsize = min_t(unsigned int, submit.bufsize, STRING_MAX);
+	call = kmalloc(sizeof(struct string_plugin_call) + len + outsize,
+			GFP_KERNEL);
+	if (call == NULL) {
+		return -ENOMEM;
+	}
+
+	/* the string may have changed since it was measured */
+	if (strncpy_from_user(call->in, submit.string, len) != len - 1) {
+		kfree(call);
+		return -EFAULT;
+	}
+
+	INIT_WORK(&call->work, run_plugin_call);
+	call->ctx = ctx;
+	call->id = submit.id;
+	call->buffer = submit.buffer;
+	call->outsize = outsize;
+	call->out = call->in + len;
+
+	spin_lock(&ctx->lock);
+	if (ctx->inflight >= STRING_ASYNC_MAX) {
+		spin_unlock(&ctx->lock);
+		kfree(call);
+		return -EAGAIN;
+	}
+	++ctx->inflight;
+	call->ticket = ++ctx->ticket;
+	spin_unlock(&ctx->lock);
+
+	if (put_user(call->ticket, &arg->ticket)) {
+		spin_lock(&ctx->lock);
+		--ctx->inflight;
+		spin_unlock(&ctx->lock);
+		kfree(call);
+		return -EFAULT;
+	}
+
+	kref_get(&ctx->kref);
+	queue_work(plugins_wq, &call->work);
+	return 0;
+}
+
+/* workqueue side of an async call, see call_plugin() for the locking */
+static void
+run_plugin_call(struct work_struct *work) {
+	struct string_plugin_call *call =
+			container_of(work, struct string_plugin_call, work);
+	struct string_plugin_ctx *ctx = call->ctx;
+	struct string_plugin *active;
+	int idx;
+
+	idx = srcu_read_lock(&plugins_srcu);
+	active = srcu_dereference(plugins[call->id], &plugins_srcu);
+	call->out[0] = '\0';
+	call->status = active != NULL
+			? active->handler(call->in, call->out, call->outsize) : -EINVAL;
+	srcu_read_unlock(&plugins_srcu, idx);
+	call->outlen = call->status == 0 ? strlen(call->out) : 0;
+
+	spin_lock(&ctx->lock);
+	list_add_tail(&call->list, &ctx->done);
+	spin_unlock(&ctx->lock);
+	wake_up_interruptible(&ctx->wait);
+
+	/* the file may be gone, the call is freed with the context then */
+	kref_put(&ctx->kref, release_plugin_ctx);
+}
+
+static void
+release_plugin_ctx(struct kref *kref) {
+	struct string_plugin_ctx *ctx =
+			container_of(kref, struct string_plugin_ctx, kref);
+	struct string_plugin_call *call, *tmp;
+
+	list_for_each_entry_safe(call, tmp, &ctx->done, list) {
+		kfree(call);
+	}
+	kfree(ctx);
+}
+
+/* entries the SQ has for us and the CQ has room for */
+static unsigned int
+ring_pending(struct string_plugin_ring *ring) {
+	struct string_rings *rings = ring->rings;
+	unsigned int todo, used;
+
+	/* the user may have written anything there */
+	todo = min(smp_load_acquire(&rings->sq_tail) - ring->sq_head,
+			ring->sq_entries);
+	used = ring->cq_tail - smp_load_acquire(&rings->cq_head);
+	return used < ring->cq_entries ? min(todo, ring->cq_entries - used) : 0;
+}
+
+/* the arena is mapped by the user, work on copies */
+static int
+exec_ring_entry(struct string_plugin_ring *ring,
+		struct string_ring_sqe *sqe, unsigned int *outlen) {
+	struct string_plugin *active;
+	char *in = ring->scratch, *out = ring->scratch + STRING_MAX;
+	unsigned int outsize;
+	size_t len;
+	int err;
+
+	active = sqe->id < PLUGINS_MAX
+			? srcu_dereference(plugins[sqe->id], &plugins_srcu) : NULL;
+	if (active == NULL || sqe->out_size < 1
+			|| sqe->in_off >= ring->arena_size
+			|| sqe->out_off >= ring->arena_size
+			|| sqe->out_size > ring->arena_size - sqe->out_off) {
+		return -EINVAL;
+	}
+
+	len = strnlen(ring->arena + sqe->in_off,
+			min_t(unsigned int, ring->arena_size - sqe->in_off, STRING_MAX));
+	if (len == STRING_MAX || sqe->in_off + len == ring->arena_size) {
+		return -E2BIG;
+	}
+	memcpy(in, ring->arena + sqe->in_off, len);
+	in[len] = '\0';
+
+	outsize = min_t(unsigned int, sqe->out_size, STRING_MAX);
+	out[0] = '\0';
+	err = active->handler(in, out, outsize);
+	if (err == 0) {
+		*outlen = strlen(out);
+		memcpy(ring->arena + sqe->out_off, out, *outlen + 1);
+	}
+	return err;
+}
+
+/*
+ * Runs what's pending in the SQ, posting a completion for each entry,
+ * and returns how many. Called with ring->lock held.
+ */
+static unsigned int
+process_ring(struct string_plugin_ring *ring) {
+	struct string_rings *rings = ring->rings;
+	struct string_ring_sqe sqe, *shared;
+	struct string_ring_cqe *cqe;
+	unsigned int i, todo;
+	int idx;
+
+	todo = ring_pending(ring);
+	if (todo == 0) {
+		return 0;
+	}
+
+	idx = srcu_read_lock(&plugins_srcu);
+	for (i = 0; i < todo; ++i) {
+		shared = &ring->sqes[ring->sq_head++ & (ring->sq_entries - 1)];
+		sqe.id = ACCESS_ONCE(shared->id);
+		sqe.in_off = ACCESS_ONCE(shared->in_off);
+		sqe.out_off = ACCESS_ONCE(shared->out_off);
+		sqe.out_size = ACCESS_ONCE(shared->out_size);
+		sqe.user_data = ACCESS_ONCE(shared->user_data);
+
+		cqe = &ring->cqes[ring->cq_tail++ & (ring->cq_entries - 1)];
+		cqe->user_data = sqe.user_data;
+		cqe->outlen = 0;
+		cqe->status = exec_ring_entry(ring, &sqe, &cqe->outlen);
+	}
+	srcu_read_unlock(&plugins_srcu, idx);
+
+	/* entries are free to reuse, completions are there to read */
+	smp_store_release(&rings->sq_head, ring->sq_head);
+	smp_store_release(&rings->cq_tail, ring->cq_tail);
+	wake_up_interruptible(&ring->ctx->wait);
+	return todo;
+}
+
+/*
+ * SQPOLL: consumes the SQ as it's filled, spinning for ring->idle after
+ * the last entry. Then it asks for a wake up and sleeps.
+ */
+static int
+poll_plugin_ring(void *data) {
+	struct string_plugin_ring *ring = data;
+	unsigned long timeout = jiffies + ring->idle;
+	unsigned int done;
+
+	while (!kthread_should_stop()) {
+		mutex_lock(&ring->lock);
+		done = process_ring(ring);
+		mutex_unlock(&ring->lock);
+
+		if (done) {
+			timeout = jiffies + ring->idle;
+		}
+		if (done || time_before(jiffies, timeout)) {
+			cond_resched();
+			continue;
+		}
+
+		/* pairs with the barrier of the user after bumping sq_tail */
+		smp_store_release(&ring->rings->flags, STRING_RING_NEED_WAKEUP);
+		smp_mb();
+		wait_event_interruptible(ring->wait,
+				kthread_should_stop() || ring_pending(ring));
+		smp_store_release(&ring->rings->flags, 0);
+		timeout = jiffies + ring->idle;
+	}
+	return 0;
+}
+
+static long
+setup_plugin_ring(struct string_plugin_ctx *ctx,
+		struct string_ring_params __user *arg) {
+	struct string_ring_params params;
+	struct string_plugin_ring *ring;
+	struct string_rings *rings;
+	unsigned int sq_off, cq_off, arena_off;
+	long err = 0;
+
+	if (copy_from_user(&params, arg, sizeof(params))) {
+		return -EFAULT;
+	}
+	if (params.cq_entries == 0) {
+		params.cq_entries = 2 * params.sq_entries;
+	}
+	if (!is_power_of_2(params.sq_entries)
+			|| params.sq_entries > STRING_RING_MAX
+			|| !is_power_of_2(params.cq_entries)
+			|| params.cq_entries > 2 * STRING_RING_MAX
+			|| params.arena_size < 1 || params.arena_size > STRING_ARENA_MAX
+			|| (params.flags & ~STRING_RING_SQPOLL)) {
+		return -EINVAL;
+	}
+	/* a poller keeps a CPU busy on behalf of the user */
+	if ((params.flags & STRING_RING_SQPOLL) && !capable(CAP_SYS_NICE)) {
+		return -EPERM;
+	}
+	if (ACCESS_ONCE(ctx->ring) != NULL) {
+		return -EBUSY;
+	}
+
+	/* indices of the user and ours on separate cache lines */
+	sq_off = ALIGN(sizeof(struct string_rings), 64);
+	cq_off = sq_off + params.sq_entries * sizeof(struct string_ring_sqe);
+	arena_off = PAGE_ALIGN(cq_off
+			+ params.cq_entries * sizeof(struct string_ring_cqe));
+	params.size = arena_off + PAGE_ALIGN(params.arena_size);
+
+	ring = kzalloc(sizeof(struct string_plugin_ring), GFP_KERNEL);
+	if (ring == NULL) {
+		return -ENOMEM;
+	}
+	mutex_init(&ring->lock);
+	init_waitqueue_head(&ring->wait);
+	ring->ctx = ctx;
+	ring->sq_entries = params.sq_entries;
+	ring->cq_entries = params.cq_entries;
+	ring->arena_size = params.arena_size;
+	ring->idle = msecs_to_jiffies(min_t(unsigned int, params.sq_idle,
+			STRING_RING_IDLE_MAX));
+
+	ring->scratch = kmalloc(2 * STRING_MAX, GFP_KERNEL);
+	rings = ring->rings = vmalloc_user(params.size);
+	if (ring->scratch == NULL || rings == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	rings->sq_entries = params.sq_entries;
+	rings->cq_entries = params.cq_entries;
+	rings->arena_size = params.arena_size;
+	rings->sq_off = sq_off;
+	rings->cq_off = cq_off;
+	rings->arena_off = arena_off;
+	ring->sqes = (void *) rings + sq_off;
+	ring->cqes = (void *) rings + cq_off;
+	ring->arena = (void *) rings + arena_off;
+
+	if (put_user(params.size, &arg->size)) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	if (params.flags & STRING_RING_SQPOLL) {
+		ring->poller = kthread_run(poll_plugin_ring, ring, "task24_sqpoll");
+		if (IS_ERR(ring->poller)) {
+			err = PTR_ERR(ring->poller);
+			ring->poller = NULL;
+			goto out;
+		}
+	}
+
+	/* mmap, enter and poll look it up without the lock */
+	spin_lock(&ctx->lock);
+	if (ctx->ring != NULL) {
+		spin_unlock(&ctx->lock);
+		err = -EBUSY;
+		goto out;
+	}
+	smp_store_release(&ctx->ring, ring);
+	spin_unlock(&ctx->lock);
+	return 0;
+
+	out:
+		free_plugin_ring(ring);
+		return err;
+}
+
+static long
+enter_plugin_ring(struct string_plugin_ctx *ctx, unsigned long flags) {
+	struct string_plugin_ring *ring = smp_load_acquire(&ctx->ring);
+	long ret;
+
+	if (ring == NULL) {
+		return -EINVAL;
+	}
+
+	if (ring->poller != NULL) {
+		if (flags & STRING_ENTER_WAKEUP) {
+			wake_up(&ring->wait);
+		}
+		return 0;
+	}
+
+	mutex_lock(&ring->lock);
+	ret = process_ring(ring);
+	mutex_unlock(&ring->lock);
+	return ret;
+}
+
+static void
+free_plugin_ring(struct string_plugin_ring *ring) {
+	if (ring->poller != NULL) {
+		kthread_stop(ring->poller);
+	}
+	vfree(ring->rings);
+	kfree(ring->scratch);
+	kfree(ring);
+}
+
 static int
 check_plugin(struct string_plugin *plugin) {
 	if (plugin == NULL ) {
@@ -136,49 +987,69 @@ check_plugin(struct string_plugin *plugin) {
 
 extern int
 string_op_plugin_register(struct string_plugin *plugin) {
-	if (check_plugin(plugin) > 0) {
+	int err = check_plugin(plugin);
+
+	if (err < 0) {
 		pr_err(LOG "unable to register plugin (see above)\n");
+		return err;
 	}
 
-	if (plugins[plugin->id] != NULL) {
+	mutex_lock(&plugins_lock);
+	if (rcu_dereference_protected(plugins[plugin->id],
+			lockdep_is_held(&plugins_lock)) != NULL) {
+		mutex_unlock(&plugins_lock);
 		pr_err(LOG "such plugin is already registered: %s\n", plugin->name);
 		return -EINVAL;
 	}
 
 	// TODO: check name collision (unnecessary imho)
 
-	plugins[plugin->id] = plugin;
+	rcu_assign_pointer(plugins[plugin->id], plugin);
+	mutex_unlock(&plugins_lock);
 	pr_info(LOG "registered plugin: %s (id: %d)\n", plugin->name, plugin->id);
 	return 0;
 }
 
 extern int
 string_op_plugin_unregister(struct string_plugin *plugin) {
-	int id;
+	int id, err = check_plugin(plugin);
 	struct string_plugin *pref;
 
-	if (check_plugin(plugin) > 0) {
+	if (err < 0) {
 		pr_err(LOG "unable to unregister plugin (see above)\n");
+		return err;
 	}
 
 	id = plugin->id;
-	pref = plugins[id];
+	mutex_lock(&plugins_lock);
+	pref = rcu_dereference_protected(plugins[id],
+			lockdep_is_held(&plugins_lock));
 	if (pref == NULL ) {
 		pr_err(LOG "such plugin is not registered: %s (id: %d)\n",
 				plugin->name, id);
-		return -EINVAL;
+		err = -EINVAL;
+		goto out;
 	}
 
 	if (pref->handler != plugin->handler) {
 		pr_err(
 				LOG "plugin tried to unregister foreign instance of %s (id: %d)\n",
 				plugin->name, id);
-		return -EINVAL;
+		err = -EINVAL;
+		goto out;
 	}
 
+	RCU_INIT_POINTER(plugins[id], NULL);
+	mutex_unlock(&plugins_lock);
+
+	/* new calls can't find it, wait for the ones in flight */
+	synchronize_srcu(&plugins_srcu);
 	pr_info(LOG "unregistered plugin: %s (id: %d)\n", plugin->name, id);
-	plugins[id] = NULL;
 	return 0;
+
+	out:
+		mutex_unlock(&plugins_lock);
+		return err;
 }
 
 static void
@@ -265,7 +1136,7 @@ static int __init task24_init(void) {
 	int err = 0;
 	pr_info(LOG "plugin manager started\n");
 
-	plugins = (struct string_plugin **) kcalloc(PLUGINS_MAX,
+	plugins = (struct string_plugin __rcu **) kcalloc(PLUGINS_MAX,
 			sizeof(struct string_plugin *), GFP_KERNEL);
 
 	if (plugins == NULL ) {
@@ -273,21 +1144,55 @@ static int __init task24_init(void) {
 		return -ENOMEM;
 	}
 
+	err = init_srcu_struct(&plugins_srcu);
+	if (err) {
+		pr_err(LOG "unable to init srcu for handlers\n");
+		goto out;
+	}
+
+	plugins_wq = alloc_workqueue("task24", WQ_UNBOUND, workers);
+	if (plugins_wq == NULL) {
+		pr_err(LOG "unable to allocate workqueue for async calls\n");
+		err = -ENOMEM;
+		goto out_srcu;
+	}
+
+	scratch_cache = kmem_cache_create("task24_scratch", 2 * STRING_MAX,
+			0, 0, NULL);
+	if (scratch_cache == NULL) {
+		pr_err(LOG "unable to create cache of scratch buffers\n");
+		err = -ENOMEM;
+		goto out_wq;
+	}
+
 	err = task24_create_device();
 	if(err) {
 		pr_err(LOG "unable to create plugin's interface in dev\n");
 		err = -ENODEV;
-		goto out;
+		goto out_cache;
 	}
 
 	return 0;
+	out_cache: kmem_cache_destroy(scratch_cache);
+	out_wq: destroy_workqueue(plugins_wq);
+	out_srcu: cleanup_srcu_struct(&plugins_srcu);
 	out:
 		kfree(plugins);
 		return err;
 }
 
 static void __exit task24_exit(void) {
+	int cpu;
+
 	task24_destroy_device();
+	destroy_workqueue(plugins_wq); /* waits for the calls of closed files */
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(scratch_spare, cpu) != NULL) {
+			kmem_cache_free(scratch_cache, per_cpu(scratch_spare, cpu));
+		}
+	}
+	kmem_cache_destroy(scratch_cache);
+	cleanup_srcu_struct(&plugins_srcu); /* plugins are gone, they hold us */
 	kfree(plugins);
 	pr_info(LOG "plugin manager exit\n");
 }
@@ -296,44 +1201,174 @@ static void __exit task24_exit(void) {
 
 static int
 poums_open(struct inode* inode, struct file* filp) {
+    struct string_plugin_ctx *ctx;
+
+    ctx = kzalloc(sizeof(struct string_plugin_ctx), GFP_KERNEL);
+    if (ctx == NULL) {
+    	return -ENOMEM;
+    }
+
+    spin_lock_init(&ctx->lock);
+    INIT_LIST_HEAD(&ctx->done);
+    init_waitqueue_head(&ctx->wait);
+    kref_init(&ctx->kref);
+    filp->private_data = ctx;
     return 0;
 }
 
+/* calls in flight finish and are dropped with the context */
 static int
 poums_release(struct inode* inode, struct file* filp) {
+    struct string_plugin_ctx *ctx = filp->private_data;
+
+    /* the mappings are gone by now, they hold the file */
+    if (ctx->ring != NULL) {
+    	free_plugin_ring(ctx->ring);
+    }
+    kref_put(&ctx->kref, release_plugin_ctx);
     return 0;
 }
 
-static long
-poums_ioctl_func(struct file* filp, unsigned int cmd, unsigned long arg) {
-    int err = 0;
-    struct string_plugin_call_params *from =
-    		(struct string_plugin_call_params __user *)arg;
+static bool
+has_completions(struct string_plugin_ctx *ctx) {
+    bool ret;
 
-    struct string_plugin_call_params *params =
-    		(struct string_plugin_call_params *)
-    		kzalloc(sizeof(struct string_plugin_call_params), GFP_KERNEL);
+    spin_lock(&ctx->lock);
+    ret = !list_empty(&ctx->done);
+    spin_unlock(&ctx->lock);
+    return ret;
+}
 
-    if(params == NULL) {
-    	pr_err(LOG "unable to allocate space to store data from userspace\n");
-    	return -ENOMEM;
+/*
+ * Returns as many struct string_plugin_completion as fit, writing the
+ * output of each call to its buffer on the way. Blocks until there is
+ * at least one unless the file is O_NONBLOCK.
+ */
+static ssize_t
+poums_read(struct file* filp, char __user *buf, size_t count, loff_t *off) {
+    struct string_plugin_ctx *ctx = filp->private_data;
+    struct string_plugin_completion done;
+    struct string_plugin_call *call;
+    ssize_t ret = 0;
+
+    if (count < sizeof(done)) {
+    	return -EINVAL;
     }
 
-    copy_from_user(params, from,
-    		sizeof(struct string_plugin_call_params));
+    for (;;) {
+    	while (ret + sizeof(done) <= count) {
+    		spin_lock(&ctx->lock);
+    		call = list_first_entry_or_null(&ctx->done,
+    				struct string_plugin_call, list);
+    		if (call != NULL) {
+    			list_del(&call->list);
+    		}
+    		spin_unlock(&ctx->lock);
+    		if (call == NULL) {
+    			break;
+    		}
+
+    		done.ticket = call->ticket;
+    		done.status = call->status;
+    		done.outlen = call->outlen;
+    		if (call->status == 0 && copy_to_user(call->buffer, call->out,
+    				call->outlen + 1)) {
+    			done.status = -EFAULT;
+    			done.outlen = 0;
+    		}
+
+    		if (copy_to_user(buf + ret, &done, sizeof(done))) {
+    			/* keep it for the next read */
+    			spin_lock(&ctx->lock);
+    			list_add(&call->list, &ctx->done);
+    			spin_unlock(&ctx->lock);
+    			return ret ? ret : -EFAULT;
+    		}
+
+    		spin_lock(&ctx->lock);
+    		--ctx->inflight;
+    		spin_unlock(&ctx->lock);
+    		kfree(call);
+    		ret += sizeof(done);
+    	}
+
+    	if (ret > 0) {
+    		wake_up_interruptible(&ctx->wait); /* room to submit */
+    		return ret;
+    	}
+    	if (filp->f_flags & O_NONBLOCK) {
+    		return -EAGAIN;
+    	}
+    	if (wait_event_interruptible(ctx->wait, has_completions(ctx))) {
+    		return -ERESTARTSYS;
+    	}
+    }
+}
 
-    switch (cmd) {
-        case IOCTL_HANDLE_STRING:
-        	err = exec_plugin(params);
-            break;
+static unsigned int
+poums_poll(struct file* filp, poll_table *wait) {
+    struct string_plugin_ctx *ctx = filp->private_data;
+    struct string_plugin_ring *ring = smp_load_acquire(&ctx->ring);
+    unsigned int mask = 0;
+
+    poll_wait(filp, &ctx->wait, wait);
+    if (ring != NULL && smp_load_acquire(&ring->rings->cq_tail)
+    		!= ACCESS_ONCE(ring->rings->cq_head)) {
+    	mask |= POLLIN | POLLRDNORM;
+    }
+    spin_lock(&ctx->lock);
+    if (!list_empty(&ctx->done)) {
+    	mask |= POLLIN | POLLRDNORM;
+    }
+    if (ctx->inflight < STRING_ASYNC_MAX) {
+    	mask |= POLLOUT | POLLWRNORM;
     }
+    spin_unlock(&ctx->lock);
+    return mask;
+}
 
-    if(!err) {
-        copy_to_user(from, params,
-        		sizeof(struct string_plugin_call_params));
+/* the rings and the arena, see IOCTL_SETUP_RINGS for the layout */
+static int
+poums_mmap(struct file* filp, struct vm_area_struct *vma) {
+    struct string_plugin_ctx *ctx = filp->private_data;
+    struct string_plugin_ring *ring = smp_load_acquire(&ctx->ring);
+
+    if (ring == NULL) {
+    	return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, ring->rings, vma->vm_pgoff);
+}
+
+static long
+poums_ioctl_func(struct file* filp, unsigned int cmd, unsigned long arg) {
+    struct string_plugin_call_params params;
+
+    switch (cmd) {
+        case IOCTL_HANDLE_STRING:
+            /* the strings are copied by exec_plugin() itself */
+            if (copy_from_user(&params, (void __user *)arg, sizeof(params))) {
+            	return -EFAULT;
+            }
+            return exec_plugin(&params);
+        case IOCTL_HANDLE_STRING_BATCH:
+            return exec_plugin_batch((struct string_plugin_batch __user *)arg);
+        case IOCTL_SUBMIT_STRING:
+            return submit_plugin_call(filp->private_data,
+            		(struct string_plugin_submit __user *)arg);
+        case IOCTL_HANDLE_STRING_PIPELINE:
+            return exec_plugin_pipeline(
+            		(struct string_plugin_pipeline __user *)arg);
+        case IOCTL_SETUP_RINGS:
+            return setup_plugin_ring(filp->private_data,
+            		(struct string_ring_params __user *)arg);
+        case IOCTL_RING_ENTER:
+            return enter_plugin_ring(filp->private_data, arg);
+        case IOCTL_HANDLE_BUFFER:
+            return exec_plugin_buffer(
+            		(struct string_plugin_buffer __user *)arg);
     }
 
-    return err;
+    return -ENOTTY;
 }
 
 /* =============================================== */
@@ -21,6 +21,19 @@ struct string_plugin {
 	unsigned int id;
 	const char *name;
 	int (*handler)(const char *in, char *out, size_t out_size);
+	/*
+	 * Optional, for IOCTL_HANDLE_BUFFER: @len bytes in, no terminators
+	 * either way. Returns the length of the whole output, written only
+	 * if it fits in @out_size, or -errno.
+	 */
+	long (*handler_v2)(const char *in, size_t len, char *out,
+			size_t out_size);
+	/*
+	 * Optional, for plugins mapping each byte on its own: out[i] is
+	 * map[in[i]], non-zero bytes stay non-zero. Lets pipelines run
+	 * several such plugins in one pass.
+	 */
+	const unsigned char *map;
 };
 
 struct string_plugin_call_params {
@@ -30,6 +43,126 @@ struct string_plugin_call_params {
 	unsigned int bufsize;
 };
 
+/* one call of a batch */
+struct string_plugin_batch_item {
+	unsigned int id;
+	const char *string;
+	char *buffer;
+	unsigned int bufsize;
+	int status; /* out: 0 or -errno of this call */
+	unsigned int outlen; /* out: length of the output, without '\0' */
+};
+
+#define STRING_MAX 4096 /* longest string of a batch item, with '\0' */
+#define STRING_CALL_MAX (64 * 1024) /* of a single call, with '\0' */
+#define STRING_BATCH_MAX 1024 /* items per call */
+
+struct string_plugin_batch {
+	struct string_plugin_batch_item *items;
+	unsigned int count;
+};
+
+/* plugins applied one after another, only the last output is copied out */
+#define STRING_PIPELINE_MAX 8
+
+struct string_plugin_pipeline {
+	unsigned int ids[STRING_PIPELINE_MAX]; /* in order of application */
+	unsigned int count;
+	const char *string;
+	char *buffer;
+	unsigned int bufsize; /* every stage is cut to it, as one by one */
+	unsigned int outlen; /* out: length of the output, without '\0' */
+};
+
+/* a call on bytes rather than a string, see IOCTL_HANDLE_BUFFER */
+struct string_plugin_buffer {
+	unsigned int id;
+	const void *in;
+	unsigned int in_len; /* up to STRING_MAX */
+	void *out; /* may be NULL with out_size 0, to ask for the size */
+	unsigned int out_size;
+	unsigned int out_len; /* out: bytes written, or needed on -ENOSPC */
+};
+
+/* an asynchronous call */
+struct string_plugin_submit {
+	unsigned int id;
+	const char *string; /* copied in by the submit */
+	char *buffer; /* written when the completion is read */
+	unsigned int bufsize;
+	unsigned long long ticket; /* out: identifies the completion */
+};
+
+/* read() from the device returns these, in order of completion */
+struct string_plugin_completion {
+	unsigned long long ticket;
+	int status; /* 0 or -errno of the call */
+	unsigned int outlen; /* length of the output, without '\0' */
+};
+
+#define STRING_ASYNC_MAX 1024 /* calls not yet read back, per open file */
+
+/*
+ * Shared memory rings: the file is mmap()ed at offset 0 after
+ * IOCTL_SETUP_RINGS. The user fills the arena and submission entries
+ * and bumps sq_tail, the kernel consumes them in order and posts one
+ * completion each, bumping cq_tail, the user consumes those and bumps
+ * cq_head. Entries are only consumed while the CQ has room for them.
+ */
+struct string_ring_sqe {
+	unsigned int id;
+	unsigned int in_off; /* of the input string in the arena */
+	unsigned int out_off; /* of the output buffer in the arena */
+	unsigned int out_size;
+	unsigned long long user_data; /* copied to the completion */
+};
+
+struct string_ring_cqe {
+	unsigned long long user_data;
+	int status; /* 0 or -errno of the call */
+	unsigned int outlen; /* length of the output, without '\0' */
+};
+
+/* at the start of the mapping, indices run freely and wrap */
+struct string_rings {
+	/* written by the user */
+	unsigned int sq_tail;
+	unsigned int cq_head;
+	unsigned int user_pad[14];
+	/* written by the kernel */
+	unsigned int sq_head;
+	unsigned int cq_tail;
+	unsigned int flags; /* STRING_RING_NEED_WAKEUP */
+	unsigned int kernel_pad[13];
+	/* layout, set up once */
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+	unsigned int arena_size;
+	unsigned int sq_off; /* struct string_ring_sqe[sq_entries] */
+	unsigned int cq_off; /* struct string_ring_cqe[cq_entries] */
+	unsigned int arena_off;
+};
+
+#define STRING_RING_MAX 4096 /* entries per ring */
+#define STRING_ARENA_MAX (16 << 20) /* bytes */
+
+#define STRING_RING_SQPOLL 1 /* setup: a kthread consumes the SQ */
+#define STRING_RING_IDLE_MAX 1000 /* ms, longer sq_idle is cut down */
+/* flags: the poller sleeps, enter with STRING_ENTER_WAKEUP after bumping
+ * sq_tail or cq_head (it also sleeps on a full CQ) */
+#define STRING_RING_NEED_WAKEUP 1
+#define STRING_ENTER_WAKEUP 1
+
+struct string_ring_params {
+	unsigned int sq_entries; /* power of two */
+	unsigned int cq_entries; /* power of two, 0 means 2 * sq_entries */
+	unsigned int arena_size;
+	unsigned int flags; /* STRING_RING_SQPOLL, needs CAP_SYS_NICE */
+	unsigned int sq_idle; /* ms the poller spins idle before sleeping,
+			up to STRING_RING_IDLE_MAX */
+	unsigned int size; /* out: bytes to mmap */
+};
+
 extern int
 string_op_plugin_register(struct string_plugin *plugin);
 
@@ -37,6 +170,54 @@ extern int
 string_op_plugin_unregister(struct string_plugin *plugin);
 
 #define IOC_MAGIC ('h')
+/*
+ * Runs one plugin on a string of up to STRING_CALL_MAX bytes with the
+ * '\0', -E2BIG past it. The output is cut to bufsize.
+ */
 #define IOCTL_HANDLE_STRING _IOWR(IOC_MAGIC, 0x01, \
 		struct string_plugin_call_params *)
 
+/*
+ * Runs calls to any plugins in a single syscall. Each item gets its own
+ * status, a failed one doesn't stop the batch. Returns count, or -errno
+ * if the array itself can't be read or written back.
+ */
+#define IOCTL_HANDLE_STRING_BATCH _IOWR(IOC_MAGIC, 0x02, \
+		struct string_plugin_batch *)
+
+/*
+ * Queues a call to run in the background and returns its ticket right
+ * away, or -EAGAIN with STRING_ASYNC_MAX calls not yet read back. The
+ * buffer must stay valid until the completion is read from the same
+ * file, poll() tells when there are completions to read.
+ */
+#define IOCTL_SUBMIT_STRING _IOWR(IOC_MAGIC, 0x03, \
+		struct string_plugin_submit *)
+
+/* allocates the rings of this file, once, see struct string_rings */
+#define IOCTL_SETUP_RINGS _IOWR(IOC_MAGIC, 0x04, struct string_ring_params *)
+
+/*
+ * Consumes the SQ in the calling thread and returns the number of
+ * entries done. With SQPOLL it only wakes the poller up if the argument
+ * has STRING_ENTER_WAKEUP. poll() reports POLLIN while the CQ has entries.
+ */
+#define IOCTL_RING_ENTER _IOW(IOC_MAGIC, 0x05, unsigned int)
+
+/*
+ * Runs the plugins over the string in order, as if each took the output
+ * of the one before it, and returns 0 or -errno of the first failing one.
+ */
+#define IOCTL_HANDLE_STRING_PIPELINE _IOWR(IOC_MAGIC, 0x06, \
+		struct string_plugin_pipeline *)
+
+/*
+ * Runs a plugin on in_len bytes, '\0' included, and returns 0 with
+ * out_len bytes written. If they don't fit it fails with -ENOSPC and
+ * out_len set to the size needed, nothing is written. Plugins without
+ * handler_v2 take no '\0' in the input (-EINVAL) and up to
+ * STRING_MAX - 1 bytes.
+ */
+#define IOCTL_HANDLE_BUFFER _IOWR(IOC_MAGIC, 0x07, \
+		struct string_plugin_buffer *)
+
@@ -10,34 +10,53 @@
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/err.h>
+#include <linux/string.h>
+#include <linux/swab.h>
+#include <asm/unaligned.h>
 
 #include "task24.h"
 
 #define PLUGIN_NAME "plugin_reverse"
 #define LOG "task24_plugin_reverse: "
 
-static int handle(const char *in, char *out, size_t out_size) {
-	int limit, i = 0;
-
-	pr_info(LOG "handling string: %s\n", in);
-	limit = strlen(in) < out_size - 1 ? strlen(in) : out_size - 1;
-	while(i < limit) {
-		out[i] = in[limit - (i + 1)];
-		++i;
+/* eight bytes at a time from both ends, byte swapped */
+static void reverse(const char *in, char *out, size_t len) {
+	size_t i = 0;
 
-		if(i == limit) {
-			out[i] = '\0';
-		}
+	for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+		put_unaligned(swab64(get_unaligned((const u64 *)
+				(in + len - i - sizeof(u64)))), (u64 *) (out + i));
+	}
+	for (; i < len; ++i) {
+		out[i] = in[len - (i + 1)];
 	}
+}
+
+static int handle(const char *in, char *out, size_t out_size) {
+	size_t len;
+
+	pr_debug(LOG "handling string: %s\n", in);
+	len = strnlen(in, out_size - 1);
+	reverse(in, out, len);
+	out[len] = '\0';
 
 	return 0;
 }
 
+static long handle_buffer(const char *in, size_t len, char *out,
+		size_t out_size) {
+	if (len <= out_size) {
+		reverse(in, out, len);
+	}
+	return len;
+}
+
 static struct string_plugin plugin = {
 		.owner = THIS_MODULE,
 		.id = PLUGIN_REVERSE,
 		.name = PLUGIN_NAME,
-		.handler = &handle
+		.handler = &handle,
+		.handler_v2 = &handle_buffer
 };
 
 static int __init plugin_init(void) {
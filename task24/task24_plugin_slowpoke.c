@@ -18,7 +18,7 @@
 #define LOG "task24_plugin_slowpoke: "
 
 static int handle(const char *in, char *out, size_t out_size) {
-	pr_info(LOG "handling string: %s\n", in);
+	pr_debug(LOG "handling string: %s\n", in);
 	msleep_interruptible(30000);
 	snprintf(out, out_size, "slowpoke is sooo sloooow");
 
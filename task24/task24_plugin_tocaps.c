@@ -10,43 +10,80 @@
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/err.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
 
 #include "task24.h"
 
 #define PLUGIN_NAME "plugin_tocaps"
 #define LOG "task24_plugin_tocaps: "
+#define ONES 0x0101010101010101ULL /* a byte repeated over a u64 */
 
-static int handle(const char *in, char *out, size_t out_size) {
-	int limit, i = 0;
+/*
+ * Eight bytes at a time: the high bit of each byte in the 7 bit sums
+ * tells whether it's past 'z' and whether it's from 'a' on, non-ASCII
+ * bytes are left alone. Flipping 0x20 switches the case.
+ */
+static inline u64 tocaps_word(u64 w) {
+	u64 heptets = w & ONES * 0x7f;
+	u64 past = heptets + ONES * (0x7f - 'z');
+	u64 from = heptets + ONES * (0x80 - 'a');
+	u64 lower = ~w & (from ^ past) & ONES * 0x80;
 
-	pr_info(LOG "handling string: %s\n", in);
-	limit = strlen(in) < out_size - 1 ? strlen(in) : out_size - 1;
-	while(i < limit) {
-		char c = in[i];
+	return w ^ (lower >> 2);
+}
 
-		if(c >= 'a' && c <= 'z') {
-			out[i++] = c - 32;
-		} else {
-			out[i++] = c;
-		}
+static void convert(const char *in, char *out, size_t len) {
+	size_t i = 0;
 
-		if(i == limit) {
-			out[i] = '\0';
-		}
+	for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+		put_unaligned(tocaps_word(get_unaligned((const u64 *) (in + i))),
+				(u64 *) (out + i));
 	}
+	for (; i < len; ++i) {
+		char c = in[i];
+
+		out[i] = c >= 'a' && c <= 'z' ? c - 32 : c;
+	}
+}
+
+static int handle(const char *in, char *out, size_t out_size) {
+	size_t len;
+
+	pr_debug(LOG "handling string: %s\n", in);
+	len = strnlen(in, out_size - 1);
+	convert(in, out, len);
+	out[len] = '\0';
 
 	return 0;
 }
 
+static long handle_buffer(const char *in, size_t len, char *out,
+		size_t out_size) {
+	if (len <= out_size) {
+		convert(in, out, len);
+	}
+	return len;
+}
+
+/* the same, byte by byte, for pipelines */
+static unsigned char map[256];
+
 static struct string_plugin plugin = {
 		.owner = THIS_MODULE,
 		.id = PLUGIN_TOCAPS,
 		.name = PLUGIN_NAME,
-		.handler = &handle
+		.handler = &handle,
+		.handler_v2 = &handle_buffer,
+		.map = map
 };
 
 static int __init plugin_init(void) {
-	int err = 0;
+	int i, err = 0;
+
+	for (i = 0; i < 256; ++i) {
+		map[i] = i >= 'a' && i <= 'z' ? i - 32 : i;
+	}
 
 	pr_info(LOG "plugin init\n");
 	pr_info(LOG "trying to register in manager\n");
@@ -0,0 +1,82 @@
+/*
+ *  Task 2.4
+ *  Async test: a slowpoke call in flight doesn't hold up the calls
+ *  submitted after it, completions come through poll() and read()
+ */
+
+#include "task24.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG "test_async_task24: "
+#define MAXLEN 256
+#define CALLS 100
+
+int main(void) {
+	struct string_plugin_submit submit = { .bufsize = MAXLEN };
+	struct string_plugin_completion done[CALLS];
+	unsigned long long slowpoke;
+	char out[CALLS + 1][MAXLEN];
+	struct pollfd pfd;
+	int fd, i, n = 0;
+	ssize_t ret;
+
+	fd = open("/dev/" DEVNAME, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		printf(LOG "can't open plugin manager\n");
+		return -1;
+	}
+
+	submit.id = PLUGIN_SLOWPOKE;
+	submit.string = "zzz";
+	submit.buffer = out[CALLS];
+	if (ioctl(fd, IOCTL_SUBMIT_STRING, &submit) < 0) {
+		printf(LOG "slowpoke submit failed\n");
+		return -1;
+	}
+	slowpoke = submit.ticket;
+
+	for (i = 0; i < CALLS; ++i) {
+		submit.id = PLUGIN_TOLOWER;
+		submit.string = "Hello World";
+		submit.buffer = out[i];
+		if (ioctl(fd, IOCTL_SUBMIT_STRING, &submit) < 0) {
+			printf(LOG "submit #%d failed\n", i);
+			return -1;
+		}
+	}
+
+	/* well before the slowpoke wakes up */
+	pfd = (struct pollfd) { .fd = fd, .events = POLLIN };
+	while (n < CALLS && poll(&pfd, 1, 10000) == 1) {
+		ret = read(fd, done, sizeof(done));
+		for (i = 0; i < ret / (ssize_t) sizeof(done[0]); ++i, ++n) {
+			if (done[i].ticket == slowpoke || done[i].status != 0
+					|| strcmp(out[done[i].ticket - slowpoke - 1],
+							"hello world")) {
+				printf(LOG "bad completion of #%llu\n", done[i].ticket);
+				return -1;
+			}
+		}
+	}
+	if (n < CALLS) {
+		printf(LOG "only %d calls done\n", n);
+		return -1;
+	}
+
+	printf(LOG "%d calls done, waiting for slowpoke\n", n);
+	if (poll(&pfd, 1, 60000) != 1 || read(fd, done, sizeof(done))
+			!= sizeof(done[0]) || done[0].ticket != slowpoke) {
+		printf(LOG "slowpoke didn't complete\n");
+		return -1;
+	}
+
+	close(fd);
+	printf(LOG "OK: %s\n", out[CALLS]);
+	return 0;
+}
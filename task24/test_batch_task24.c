@@ -0,0 +1,58 @@
+/*
+ *  Task 2.4
+ *  Batch test: calls to different plugins in a single ioctl,
+ *  per-item status and output length included
+ */
+
+#include "task24.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG "test_batch_task24: "
+#define MAXLEN 256
+#define ITEMS 64
+
+int main(void) {
+	struct string_plugin_batch_item items[ITEMS + 1];
+	struct string_plugin_batch batch = { .items = items, .count = ITEMS + 1 };
+	const char *expected[] = { "dlroW olleH", "hello world", "HELLO WORLD" };
+	char out[ITEMS][MAXLEN];
+	int fd, i;
+
+	fd = open("/dev/" DEVNAME, 0);
+	if (fd < 0) {
+		printf(LOG "can't open plugin manager\n");
+		return -1;
+	}
+
+	for (i = 0; i < ITEMS; ++i) {
+		items[i] = (struct string_plugin_batch_item) { .id = i % 3,
+				.string = "Hello World", .buffer = out[i], .bufsize = MAXLEN };
+	}
+
+	/* a bad item doesn't stop the others */
+	items[ITEMS] = items[1];
+	items[ITEMS].id = PLUGIN_SLOWPOKE - 1;
+
+	if (ioctl(fd, IOCTL_HANDLE_STRING_BATCH, &batch) != ITEMS + 1
+			|| items[ITEMS].status != -EINVAL) {
+		printf(LOG "batch failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < ITEMS; ++i) {
+		if (items[i].status != 0 || items[i].outlen != 11
+				|| strcmp(out[i], expected[i % 3])) {
+			printf(LOG "item #%d: %d %s\n", i, items[i].status, out[i]);
+			return -1;
+		}
+	}
+
+	close(fd);
+	printf(LOG "OK: %d items handled\n", ITEMS);
+	return 0;
+}
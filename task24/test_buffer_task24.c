@@ -0,0 +1,54 @@
+/*
+ *  Task 2.4
+ *  Buffer test: bytes with '\0' in them go through a plugin, a buffer
+ *  too small gets the size needed and one retry does it
+ */
+
+#include "task24.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG "test_buffer_task24: "
+
+int main(void) {
+	static const char in[] = "Binary\0DATA\0\xff";
+	struct string_plugin_buffer params = {
+			.id = PLUGIN_TOLOWER,
+			.in = in,
+			.in_len = sizeof(in) - 1,
+	};
+	char *out;
+	int fd;
+
+	fd = open("/dev/" DEVNAME, O_RDONLY);
+	if (fd < 0) {
+		printf(LOG "can't open plugin manager\n");
+		return -1;
+	}
+
+	/* no buffer at all, just the size */
+	if (ioctl(fd, IOCTL_HANDLE_BUFFER, &params) != -1 || errno != ENOSPC
+			|| params.out_len != sizeof(in) - 1) {
+		printf(LOG "no size reported\n");
+		return -1;
+	}
+
+	params.out = out = malloc(params.out_len);
+	params.out_size = params.out_len;
+	if (ioctl(fd, IOCTL_HANDLE_BUFFER, &params) < 0
+			|| params.out_len != sizeof(in) - 1
+			|| memcmp(out, "binary\0data\0\xff", params.out_len)) {
+		printf(LOG "bad output\n");
+		return -1;
+	}
+
+	free(out);
+	close(fd);
+	printf(LOG "OK: %u bytes\n", params.out_len);
+	return 0;
+}
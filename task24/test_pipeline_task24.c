@@ -0,0 +1,65 @@
+/*
+ *  Task 2.4
+ *  Pipeline test: tolower then reverse in one call gives the same as
+ *  the two calls one after another
+ */
+
+#include "task24.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG "test_pipeline_task24: "
+#define MAXLEN 256
+
+int main(int argc, char **argv) {
+	const char *in = argc > 1 ? argv[1] : "Hello World";
+	char out[MAXLEN], tmp[MAXLEN], want[MAXLEN];
+	struct string_plugin_pipeline pipe = {
+			.ids = { PLUGIN_TOLOWER, PLUGIN_REVERSE },
+			.count = 2,
+			.string = in,
+			.buffer = out,
+			.bufsize = MAXLEN
+	};
+	struct string_plugin_call_params params = { .bufsize = MAXLEN };
+	int fd;
+
+	fd = open("/dev/" DEVNAME, O_RDONLY);
+	if (fd < 0) {
+		printf(LOG "can't open plugin manager\n");
+		return -1;
+	}
+
+	params.id = PLUGIN_TOLOWER;
+	params.string = in;
+	params.buffer = tmp;
+	tmp[0] = '\0';
+	if (ioctl(fd, IOCTL_HANDLE_STRING, &params) < 0) {
+		printf(LOG "tolower failed\n");
+		return -1;
+	}
+	params.id = PLUGIN_REVERSE;
+	params.string = tmp;
+	params.buffer = want;
+	want[0] = '\0';
+	if (ioctl(fd, IOCTL_HANDLE_STRING, &params) < 0) {
+		printf(LOG "reverse failed\n");
+		return -1;
+	}
+
+	if (ioctl(fd, IOCTL_HANDLE_STRING_PIPELINE, &pipe) < 0) {
+		printf(LOG "pipeline failed\n");
+		return -1;
+	}
+	if (strcmp(out, want) || pipe.outlen != strlen(want)) {
+		printf(LOG "pipeline gave \"%s\", calls gave \"%s\"\n", out, want);
+		return -1;
+	}
+
+	close(fd);
+	printf(LOG "OK: %s\n", out);
+	return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ *  Task 2.4
+ *  Ring test: calls go through the mmap()ed rings, first entered by
+ *  hand, then consumed by the SQPOLL kthread (needs CAP_SYS_NICE, run
+ *  as root)
+ */
+
+#include "task24.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG "test_ring_task24: "
+#define SLOT 64
+#define CALLS 1000
+
+static struct string_rings *rings;
+static struct string_ring_sqe *sqes;
+static struct string_ring_cqe *cqes;
+static char *arena;
+
+static int
+setup(int fd, unsigned int flags) {
+	struct string_ring_params params = { .sq_entries = 64,
+			.arena_size = 64 * 2 * SLOT, .flags = flags, .sq_idle = 10 };
+	void *p;
+
+	if (ioctl(fd, IOCTL_SETUP_RINGS, &params) < 0) {
+		return -1;
+	}
+	p = mmap(NULL, params.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		return -1;
+	}
+
+	rings = p;
+	sqes = p + rings->sq_off;
+	cqes = p + rings->cq_off;
+	arena = p + rings->arena_off;
+	return 0;
+}
+
+/* the whole SQ at once, slots of the arena are reused */
+static int
+run(int fd, unsigned int base) {
+	unsigned int i, tail = rings->sq_tail, n = rings->sq_entries;
+	struct string_ring_cqe *cqe;
+	char want[SLOT];
+
+	for (i = 0; i < n; ++i) {
+		snprintf(arena + 2 * SLOT * i, SLOT, "Call #%u", base + i);
+		sqes[(tail + i) & (n - 1)] = (struct string_ring_sqe) {
+				.id = PLUGIN_TOLOWER, .in_off = 2 * SLOT * i,
+				.out_off = 2 * SLOT * i + SLOT, .out_size = SLOT,
+				.user_data = base + i };
+	}
+	__atomic_store_n(&rings->sq_tail, tail + n, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&rings->flags, __ATOMIC_SEQ_CST)
+			& STRING_RING_NEED_WAKEUP) {
+		ioctl(fd, IOCTL_RING_ENTER, STRING_ENTER_WAKEUP);
+	} else if (ioctl(fd, IOCTL_RING_ENTER, 0) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < n; ) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		if (__atomic_load_n(&rings->cq_tail, __ATOMIC_ACQUIRE)
+				== rings->cq_head) {
+			if (poll(&pfd, 1, 10000) != 1) {
+				return -1;
+			}
+			continue;
+		}
+
+		cqe = &cqes[rings->cq_head & (rings->cq_entries - 1)];
+		snprintf(want, SLOT, "call #%llu", cqe->user_data);
+		if (cqe->status != 0 || strcmp(arena + 2 * SLOT
+				* (cqe->user_data - base) + SLOT, want)) {
+			printf(LOG "bad completion of #%llu\n", cqe->user_data);
+			return -1;
+		}
+		__atomic_store_n(&rings->cq_head, rings->cq_head + 1,
+				__ATOMIC_RELEASE);
+		++i;
+	}
+	return n;
+}
+
+int main(void) {
+	unsigned int flags[] = { 0, STRING_RING_SQPOLL };
+	int fd, i, n, ret;
+
+	for (i = 0; i < 2; ++i) {
+		fd = open("/dev/" DEVNAME, O_RDONLY);
+		if (fd < 0) {
+			printf(LOG "can't open plugin manager\n");
+			return -1;
+		}
+		if (setup(fd, flags[i]) < 0) {
+			printf(LOG "can't set up the rings: %s\n", strerror(errno));
+			return -1;
+		}
+
+		for (n = 0; n < CALLS; n += ret) {
+			if ((ret = run(fd, n)) < 0) {
+				printf(LOG "ring calls failed%s\n",
+						flags[i] ? " (sqpoll)" : "");
+				return -1;
+			}
+		}
+
+		munmap(rings, rings->arena_off + rings->arena_size);
+		close(fd);
+	}
+
+	printf(LOG "OK: %d calls entered, %d polled\n", n, n);
+	return 0;
+}
@@ -0,0 +1,869 @@
+/*
+ *  Task 2.4
+ *  Unit tests and microbenchmarks of the plugin manager and the sample
+ *  plugins, built in userspace against ../shim (make unit)
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+
+#include "task24.h"
+
+#define LOG "unit_task24: "
+#define MAXLEN 8192
+#define PLUGIN_BLOCKER 10 /* test plugin of this file */
+#define PLUGIN_OLD 11 /* the byte at a time plugins of before, 11-13 */
+#define PLUGIN_ROT13 14
+
+extern struct file_operations fops; /* task24.c */
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf(LOG "FAIL %s:%d: %s\n", __func__, __LINE__, #cond); \
+		++failed; \
+	} \
+} while (0)
+
+static const char *modules[] = { "task24", "task24_plugin_reverse",
+		"task24_plugin_tolower", "task24_plugin_tocaps" };
+
+static int
+handle_string(unsigned int id, const char *in, char *out, unsigned int size) {
+	struct string_plugin_call_params params = { .id = id, .string = in,
+			.buffer = out, .bufsize = size };
+	return fops.unlocked_ioctl(NULL, IOCTL_HANDLE_STRING,
+			(unsigned long) &params);
+}
+
+static long
+handle_batch(struct string_plugin_batch_item *items, unsigned int count) {
+	struct string_plugin_batch batch = { .items = items, .count = count };
+	return fops.unlocked_ioctl(NULL, IOCTL_HANDLE_STRING_BATCH,
+			(unsigned long) &batch);
+}
+
+static long
+submit(struct file *fp, unsigned int id, const char *in, char *out,
+		unsigned long long *ticket) {
+	struct string_plugin_submit submit = { .id = id, .string = in,
+			.buffer = out, .bufsize = MAXLEN };
+	long err = fops.unlocked_ioctl(fp, IOCTL_SUBMIT_STRING,
+			(unsigned long) &submit);
+	*ticket = submit.ticket;
+	return err;
+}
+
+static long
+handle_pipeline(const unsigned int *ids, unsigned int count, const char *in,
+		char *out, unsigned int size, unsigned int *outlen) {
+	struct string_plugin_pipeline pipe = { .count = count, .string = in,
+			.buffer = out, .bufsize = size };
+	long err;
+
+	memcpy(pipe.ids, ids, min_t(unsigned int, count,
+			STRING_PIPELINE_MAX) * sizeof(ids[0]));
+	err = fops.unlocked_ioctl(NULL, IOCTL_HANDLE_STRING_PIPELINE,
+			(unsigned long) &pipe);
+	*outlen = pipe.outlen;
+	return err;
+}
+
+static long
+handle_buffer(unsigned int id, const void *in, unsigned int len, void *out,
+		unsigned int size, unsigned int *outlen) {
+	struct string_plugin_buffer params = { .id = id, .in = in,
+			.in_len = len, .out = out, .out_size = size, .out_len = ~0u };
+	long err = fops.unlocked_ioctl(NULL, IOCTL_HANDLE_BUFFER,
+			(unsigned long) &params);
+	*outlen = params.out_len;
+	return err;
+}
+
+static void
+test_plugins(void) {
+	char out[MAXLEN];
+
+	CHECK(handle_string(PLUGIN_TOLOWER, "Hello World", out, MAXLEN) == 0);
+	CHECK(!strcmp(out, "hello world"));
+	CHECK(handle_string(PLUGIN_TOCAPS, "Hello World", out, MAXLEN) == 0);
+	CHECK(!strcmp(out, "HELLO WORLD"));
+	CHECK(handle_string(PLUGIN_REVERSE, "Hello World", out, MAXLEN) == 0);
+	CHECK(!strcmp(out, "dlroW olleH"));
+
+	/* output is cut to fit the buffer */
+	CHECK(handle_string(PLUGIN_TOLOWER, "Hello World", out, 6) == 0);
+	CHECK(!strcmp(out, "hello"));
+}
+
+static void
+test_errors(void) {
+	static char out[MAXLEN], big[STRING_MAX + 1], huge[STRING_CALL_MAX + 1];
+
+	CHECK(handle_string(PLUGIN_SLOWPOKE + 1, "x", out, MAXLEN) == -EINVAL);
+	CHECK(handle_string(PLUGIN_SLOWPOKE, "x", out, MAXLEN) == -EINVAL);
+	CHECK(handle_string(PLUGIN_TOLOWER, NULL, out, MAXLEN) == -EINVAL);
+	CHECK(handle_string(PLUGIN_TOLOWER, "x", NULL, MAXLEN) == -EINVAL);
+	CHECK(handle_string(PLUGIN_TOLOWER, "x", out, 0) == -EINVAL);
+	CHECK(fops.unlocked_ioctl(NULL, 0, 0) == -ENOTTY);
+
+	/* strings past the scratch get copies of their own, up to a limit */
+	memset(big, 'A', STRING_MAX);
+	CHECK(handle_string(PLUGIN_TOLOWER, big, out, MAXLEN) == 0);
+	CHECK(strlen(out) == STRING_MAX && out[STRING_MAX - 1] == 'a');
+	CHECK(handle_string(PLUGIN_TOLOWER, big, out, 6) == 0);
+	CHECK(!strcmp(out, "aaaaa"));
+	memset(huge, 'A', STRING_CALL_MAX);
+	CHECK(handle_string(PLUGIN_TOLOWER, huge, out, MAXLEN) == -E2BIG);
+	huge[STRING_CALL_MAX - 1] = '\0';
+	CHECK(handle_string(PLUGIN_TOLOWER, huge, out, MAXLEN) == 0);
+	CHECK(strlen(out) == MAXLEN - 1 && out[0] == 'a');
+	big[STRING_MAX - 1] = '\0';
+	CHECK(handle_string(PLUGIN_TOLOWER, big, out, MAXLEN) == 0);
+	CHECK(strlen(out) == STRING_MAX - 1 && out[0] == 'a');
+	out[0] = 'x';
+	CHECK(handle_string(PLUGIN_TOLOWER, big, out, 1) == 0 && out[0] == '\0');
+
+	/* unloaded plugin is gone, loading it again brings it back */
+	shim_unload_module("task24_plugin_tocaps");
+	CHECK(handle_string(PLUGIN_TOCAPS, "x", out, MAXLEN) == -EINVAL);
+	CHECK(shim_load_module("task24_plugin_tocaps") == 0);
+	CHECK(handle_string(PLUGIN_TOCAPS, "x", out, MAXLEN) == 0);
+}
+
+static void
+test_batch(void) {
+	static char out[5][MAXLEN], big[STRING_MAX + 1];
+	struct string_plugin_batch_item items[] = {
+		{ PLUGIN_TOLOWER, "Hello World", out[0], MAXLEN },
+		{ PLUGIN_TOCAPS, "Hello World", out[1], MAXLEN },
+		{ PLUGIN_REVERSE, "Hello World", out[2], 6 },
+		{ PLUGIN_SLOWPOKE, "x", out[3], MAXLEN },
+		{ PLUGIN_TOLOWER, big, out[4], MAXLEN },
+		{ PLUGIN_TOLOWER, "", out[4], MAXLEN },
+	};
+
+	memset(big, 'A', STRING_MAX);
+	CHECK(handle_batch(items, ARRAY_SIZE(items)) == ARRAY_SIZE(items));
+	CHECK(items[0].status == 0 && items[0].outlen == 11);
+	CHECK(!strcmp(out[0], "hello world"));
+	CHECK(items[1].status == 0 && !strcmp(out[1], "HELLO WORLD"));
+	CHECK(items[2].status == 0 && items[2].outlen == 5);
+	CHECK(!strcmp(out[2], "olleH"));
+
+	/* failed items don't stop the others */
+	CHECK(items[3].status == -EINVAL && items[3].outlen == 0);
+	CHECK(items[4].status == -E2BIG);
+	CHECK(items[5].status == 0 && items[5].outlen == 0 && out[4][0] == '\0');
+
+	CHECK(handle_batch(items, 0) == 0);
+	CHECK(handle_batch(items, STRING_BATCH_MAX + 1) == -EINVAL);
+}
+
+/* a byte-wise plugin none of the others compose into */
+static int
+rot13_handle(const char *in, char *out, size_t out_size);
+
+static unsigned char rot13_map[256];
+
+static struct string_plugin rot13 = { .owner = THIS_MODULE,
+		.id = PLUGIN_ROT13, .name = "rot13", .handler = rot13_handle,
+		.map = rot13_map };
+
+static int
+rot13_handle(const char *in, char *out, size_t out_size) {
+	size_t i, len = strnlen(in, out_size - 1);
+
+	for (i = 0; i < len; ++i) {
+		out[i] = rot13_map[(unsigned char) in[i]];
+	}
+	out[len] = '\0';
+	return 0;
+}
+
+/* the same as one by one, fused stages included */
+static void
+test_pipeline(void) {
+	static const struct {
+		unsigned int count, ids[4];
+	} pipes[] = {
+		{ 2, { PLUGIN_TOLOWER, PLUGIN_REVERSE } },
+		{ 4, { PLUGIN_REVERSE, PLUGIN_TOCAPS, PLUGIN_TOLOWER,
+				PLUGIN_REVERSE } },
+		{ 3, { PLUGIN_TOCAPS, PLUGIN_TOLOWER, PLUGIN_TOCAPS } },
+		{ 3, { PLUGIN_ROT13, PLUGIN_TOLOWER, PLUGIN_ROT13 } },
+		{ 2, { PLUGIN_ROT13, PLUGIN_REVERSE } },
+		{ 1, { PLUGIN_REVERSE } },
+	};
+	static char mixed[600]; /* composed tables from 256 bytes on */
+	static const char *in[] = { "Hello World", "", "\xc0Mixed\x7f CASE 42",
+			mixed };
+	static const unsigned int sizes[] = { 1, 6, MAXLEN };
+	char out[MAXLEN], want[MAXLEN], tmp[MAXLEN];
+	unsigned int i, j, k, n, outlen;
+
+	for (i = 0; i < 256; ++i) {
+		k = i | 0x20; /* lower case */
+		rot13_map[i] = k < 'a' || k > 'z' ? i : k < 'n' ? i + 13 : i - 13;
+	}
+	CHECK(string_op_plugin_register(&rot13) == 0);
+	for (i = 0; i < sizeof(mixed) - 1; ++i) {
+		mixed[i] = "Mixed CASE, \xe9t\xe9 42 "[i % 19];
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pipes); ++i) {
+		for (j = 0; j < ARRAY_SIZE(in); ++j) {
+			for (k = 0; k < ARRAY_SIZE(sizes); ++k) {
+				strcpy(want, in[j]);
+				for (n = 0; n < pipes[i].count; ++n) {
+					tmp[0] = '\0'; /* not written for empty outputs */
+					handle_string(pipes[i].ids[n], want, tmp, sizes[k]);
+					strcpy(want, tmp);
+				}
+				memset(out, 'x', sizeof(out));
+				CHECK(handle_pipeline(pipes[i].ids, pipes[i].count, in[j],
+						out, sizes[k], &outlen) == 0);
+				CHECK(!strcmp(out, want) && outlen == strlen(want));
+			}
+		}
+	}
+	CHECK(string_op_plugin_unregister(&rot13) == 0);
+
+	CHECK(handle_pipeline(pipes[0].ids, 2, "Hello World", out, MAXLEN,
+			&outlen) == 0);
+	CHECK(!strcmp(out, "dlrow olleh") && outlen == 11);
+
+	CHECK(handle_pipeline(pipes[0].ids, 0, "x", out, MAXLEN, &outlen) == -EINVAL);
+	CHECK(handle_pipeline(pipes[0].ids, STRING_PIPELINE_MAX + 1, "x", out,
+			MAXLEN, &outlen) == -EINVAL);
+	CHECK(handle_pipeline((unsigned int []) { PLUGIN_TOLOWER,
+			PLUGIN_SLOWPOKE }, 2, "x", out, MAXLEN, &outlen) == -EINVAL);
+	CHECK(handle_pipeline(pipes[0].ids, 2, NULL, out, MAXLEN, &outlen) == -EINVAL);
+}
+
+/* the plugins as they were, byte by byte, to check and bench against */
+static int old_reverse(const char *in, char *out, size_t out_size) {
+	int limit, i = 0;
+
+	limit = strlen(in) < out_size - 1 ? strlen(in) : out_size - 1;
+	while(i < limit) {
+		out[i] = in[limit - (i + 1)];
+		++i;
+
+		if(i == limit) {
+			out[i] = '\0';
+		}
+	}
+
+	return 0;
+}
+
+static int old_tolower(const char *in, char *out, size_t out_size) {
+	int limit, i = 0;
+
+	limit = strlen(in) < out_size - 1 ? strlen(in) : out_size - 1;
+	while(i < limit) {
+		char c = in[i];
+
+		if(c >= 'A' && c <= 'Z') {
+			out[i++] = c + 32;
+		} else {
+			out[i++] = c;
+		}
+
+		if(i == limit) {
+			out[i] = '\0';
+		}
+	}
+
+	return 0;
+}
+
+static int old_tocaps(const char *in, char *out, size_t out_size) {
+	int limit, i = 0;
+
+	limit = strlen(in) < out_size - 1 ? strlen(in) : out_size - 1;
+	while(i < limit) {
+		char c = in[i];
+
+		if(c >= 'a' && c <= 'z') {
+			out[i++] = c - 32;
+		} else {
+			out[i++] = c;
+		}
+
+		if(i == limit) {
+			out[i] = '\0';
+		}
+	}
+
+	return 0;
+}
+
+static struct string_plugin old_plugins[] = {
+	{ .owner = THIS_MODULE, .id = PLUGIN_OLD + PLUGIN_REVERSE,
+			.name = "old_reverse", .handler = old_reverse },
+	{ .owner = THIS_MODULE, .id = PLUGIN_OLD + PLUGIN_TOLOWER,
+			.name = "old_tolower", .handler = old_tolower },
+	{ .owner = THIS_MODULE, .id = PLUGIN_OLD + PLUGIN_TOCAPS,
+			.name = "old_tocaps", .handler = old_tocaps },
+};
+
+/* word at a time plugins give the same bytes for any input and size */
+static void
+check_words(const char *in, unsigned int size) {
+	static char out[MAXLEN], want[MAXLEN];
+	unsigned int id;
+
+	for (id = PLUGIN_REVERSE; id <= PLUGIN_TOCAPS; ++id) {
+		out[0] = want[0] = '\0';
+		CHECK(handle_string(id, in, out, size) == 0);
+		CHECK(handle_string(PLUGIN_OLD + id, in, want, size) == 0);
+		CHECK(!strcmp(out, want));
+
+		/* no terminator, no cut */
+		if (size > strlen(in)) {
+			CHECK(handle_buffer(id, in, strlen(in), out, MAXLEN, &size) == 0);
+			CHECK(size == strlen(want) && !memcmp(out, want, size));
+			size = strlen(in) + 1;
+		}
+	}
+}
+
+static void
+test_words(void) {
+	static char in[1024];
+	unsigned int len, i;
+
+	/* every byte at every spot of a word, among letters of either case */
+	for (i = 0; i < 255 * 8; ++i) {
+		memset(in, i & 1 ? 'q' : 'Q', 16);
+		in[i % 8] = 1 + i / 8;
+		in[16] = '\0';
+		check_words(in, MAXLEN);
+	}
+
+	srand(24);
+	for (len = 0; len < sizeof(in); ++len) {
+		for (i = 0; i < len; ++i) {
+			in[i] = 1 + rand() % 255;
+		}
+		in[len] = '\0';
+		check_words(in, len + 1);
+		check_words(in, 1 + rand() % (len + 8));
+	}
+}
+
+/* bytes in, bytes out, and the size needed when they don't fit */
+static void
+test_buffer(void) {
+	static char big[STRING_MAX + 1];
+	char out[MAXLEN];
+	unsigned int len;
+
+	memset(out, 'x', sizeof(out));
+	CHECK(handle_buffer(PLUGIN_TOLOWER, "AB\0CD", 5, out, 5, &len) == 0);
+	CHECK(len == 5 && !memcmp(out, "ab\0cdx", 6));
+	CHECK(handle_buffer(PLUGIN_REVERSE, "a\0bc", 4, out, 8, &len) == 0);
+	CHECK(len == 4 && !memcmp(out, "cb\0a", 4));
+	CHECK(handle_buffer(PLUGIN_TOCAPS, "", 0, NULL, 0, &len) == 0 && len == 0);
+
+	/* too small: the size needed, nothing written */
+	memset(out, 'x', sizeof(out));
+	CHECK(handle_buffer(PLUGIN_TOCAPS, "abcd", 4, out, 3, &len) == -ENOSPC);
+	CHECK(len == 4 && out[0] == 'x');
+	CHECK(handle_buffer(PLUGIN_TOCAPS, "abcd", 4, NULL, 0, &len) == -ENOSPC);
+	CHECK(len == 4);
+
+	/* plugins of before take C strings */
+	CHECK(handle_buffer(PLUGIN_OLD + PLUGIN_TOCAPS, "abcd", 4, out, 4,
+			&len) == 0);
+	CHECK(len == 4 && !memcmp(out, "ABCDx", 5));
+	CHECK(handle_buffer(PLUGIN_OLD + PLUGIN_TOCAPS, "abcd", 4, out, 2,
+			&len) == -ENOSPC && len == 4);
+	CHECK(handle_buffer(PLUGIN_OLD + PLUGIN_TOCAPS, "a\0b", 3, out, 3,
+			&len) == -EINVAL);
+
+	memset(big, 'A', STRING_MAX);
+	CHECK(handle_buffer(PLUGIN_TOLOWER, big, STRING_MAX + 1, NULL, 0,
+			&len) == -E2BIG);
+	CHECK(handle_buffer(PLUGIN_TOLOWER, big, STRING_MAX, NULL, 0,
+			&len) == -ENOSPC && len == STRING_MAX);
+	CHECK(handle_buffer(PLUGIN_OLD + PLUGIN_TOLOWER, big, STRING_MAX, NULL, 0,
+			&len) == -E2BIG);
+	CHECK(handle_buffer(PLUGIN_SLOWPOKE, "x", 1, out, 1, &len) == -EINVAL);
+	CHECK(handle_buffer(PLUGIN_SLOWPOKE + 1, "x", 1, out, 1, &len) == -EINVAL);
+	CHECK(handle_buffer(PLUGIN_TOLOWER, NULL, 1, out, 1, &len) == -EINVAL);
+	CHECK(handle_buffer(PLUGIN_TOLOWER, "x", 1, NULL, 1, &len) == -EINVAL);
+}
+
+static int blocked, released, unregistered;
+
+static int
+blocker_handle(const char *in, char *out, size_t out_size) {
+	/* only the first call blocks */
+	if (!__atomic_exchange_n(&blocked, 1, __ATOMIC_SEQ_CST)) {
+		while (!__atomic_load_n(&released, __ATOMIC_SEQ_CST)) {
+			sched_yield();
+		}
+	}
+	out[0] = '\0';
+	return 0;
+}
+
+static struct string_plugin blocker = { .owner = THIS_MODULE,
+		.id = PLUGIN_BLOCKER, .name = "blocker", .handler = blocker_handle };
+
+static void *
+blocker_call(void *arg) {
+	char out[MAXLEN];
+	return (void *) (long) handle_string(PLUGIN_BLOCKER, "x", out, MAXLEN);
+}
+
+static void *
+blocker_unregister(void *arg) {
+	long err = string_op_plugin_unregister(&blocker);
+	__atomic_store_n(&unregistered, 1, __ATOMIC_SEQ_CST);
+	return (void *) err;
+}
+
+/* unregister returns only after the calls in flight are done */
+static void
+test_unregister(void) {
+	pthread_t call, unreg;
+	char out[MAXLEN];
+	void *ret;
+
+	CHECK(string_op_plugin_register(NULL) == -EINVAL);
+	CHECK(string_op_plugin_register(&blocker) == 0);
+	CHECK(string_op_plugin_register(&blocker) == -EINVAL);
+
+	pthread_create(&call, NULL, blocker_call, NULL);
+	while (!__atomic_load_n(&blocked, __ATOMIC_SEQ_CST)) {
+		sched_yield();
+	}
+	pthread_create(&unreg, NULL, blocker_unregister, NULL);
+
+	/* new calls don't find it anymore, the old one holds unregister */
+	while (handle_string(PLUGIN_BLOCKER, "x", out, MAXLEN) != -EINVAL) {
+		sched_yield();
+	}
+	usleep(50000);
+	CHECK(!__atomic_load_n(&unregistered, __ATOMIC_SEQ_CST));
+
+	__atomic_store_n(&released, 1, __ATOMIC_SEQ_CST);
+	pthread_join(call, &ret);
+	CHECK(ret == NULL);
+	pthread_join(unreg, &ret);
+	CHECK(ret == NULL && unregistered);
+}
+
+/* a slow call keeps a worker, not the caller nor the other calls */
+static void
+test_async(void) {
+	static char out[STRING_ASYNC_MAX][16], slow[MAXLEN];
+	struct string_plugin_completion done[8];
+	unsigned long long ticket, first, slow_ticket;
+	struct file fp = { .f_flags = O_NONBLOCK };
+	unsigned int i, n = 0;
+	ssize_t ret;
+
+	CHECK(fops.open(NULL, &fp) == 0);
+	CHECK(fops.read(&fp, (char *) done, sizeof(done), NULL) == -EAGAIN);
+	CHECK(fops.poll(&fp, NULL) == (POLLOUT | POLLWRNORM));
+
+	__atomic_store_n(&blocked, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&released, 0, __ATOMIC_SEQ_CST);
+	CHECK(string_op_plugin_register(&blocker) == 0);
+	CHECK(submit(&fp, PLUGIN_BLOCKER, "x", slow, &slow_ticket) == 0);
+	while (!__atomic_load_n(&blocked, __ATOMIC_SEQ_CST)) {
+		sched_yield();
+	}
+
+	CHECK(submit(&fp, PLUGIN_TOCAPS, "async", out[0], &first) == 0);
+	CHECK(first == slow_ticket + 1);
+	fp.f_flags = 0; /* blocking read */
+	CHECK(fops.read(&fp, (char *) done, sizeof(done), NULL)
+			== sizeof(done[0]));
+	CHECK(done[0].ticket == first && done[0].status == 0);
+	CHECK(done[0].outlen == 5 && !strcmp(out[0], "ASYNC"));
+
+	/* up to STRING_ASYNC_MAX not read back, then -EAGAIN */
+	for (i = 1; i < STRING_ASYNC_MAX; ++i) {
+		CHECK(submit(&fp, i % 3, "Hi", out[i], &ticket) == 0);
+		CHECK(ticket == first + i);
+	}
+	CHECK(submit(&fp, PLUGIN_TOLOWER, "Hi", out[0], &ticket) == -EAGAIN);
+	CHECK(submit(&fp, PLUGIN_SLOWPOKE - 1, "Hi", out[0], &ticket) == -EAGAIN);
+
+	while (n < STRING_ASYNC_MAX - 1) {
+		ret = fops.read(&fp, (char *) done, sizeof(done), NULL);
+		CHECK(ret > 0 && ret % sizeof(done[0]) == 0);
+		for (i = 0; i < ret / sizeof(done[0]); ++i, ++n) {
+			CHECK(done[i].status == 0 && done[i].outlen == 2);
+			CHECK(!strcmp(out[done[i].ticket - first],
+					(const char *[]) { "iH", "hi", "HI" }
+					[(done[i].ticket - first) % 3]));
+		}
+	}
+	CHECK(fops.poll(&fp, NULL) == (POLLOUT | POLLWRNORM));
+
+	/* closed with the slow call still running */
+	CHECK(fops.release(NULL, &fp) == 0);
+	__atomic_store_n(&released, 1, __ATOMIC_SEQ_CST);
+	CHECK(string_op_plugin_unregister(&blocker) == 0);
+}
+
+/* maps the rings of @fp, set up with @params */
+static struct string_rings *
+ring_map(struct file *fp, struct string_ring_params *params) {
+	struct vm_area_struct vma = { .vm_pgoff = 0 };
+
+	if (fops.unlocked_ioctl(fp, IOCTL_SETUP_RINGS, (unsigned long) params)
+			|| fops.mmap(fp, &vma)) {
+		return NULL;
+	}
+	return (struct string_rings *) vma.vm_start;
+}
+
+/* queues a call on @in (copied to the arena at @off), the output follows */
+static void
+ring_push(struct string_rings *rings, unsigned int id, unsigned int off,
+		const char *in, unsigned int out_size) {
+	struct string_ring_sqe *sqe = (void *) rings + rings->sq_off;
+	char *arena = (void *) rings + rings->arena_off;
+	unsigned int tail = rings->sq_tail;
+
+	strcpy(arena + off, in);
+	sqe[tail & (rings->sq_entries - 1)] = (struct string_ring_sqe) { id,
+			off, off + strlen(in) + 1, out_size, off };
+	smp_store_release(&rings->sq_tail, tail + 1);
+}
+
+static struct string_ring_cqe *
+ring_peek(struct string_rings *rings) {
+	struct string_ring_cqe *cqe = (void *) rings + rings->cq_off;
+
+	if (smp_load_acquire(&rings->cq_tail) == rings->cq_head) {
+		return NULL;
+	}
+	return &cqe[rings->cq_head & (rings->cq_entries - 1)];
+}
+
+static void
+test_ring(void) {
+	struct string_ring_params params = { .sq_entries = 4, .cq_entries = 4,
+			.arena_size = 4096 };
+	struct file fp = { .f_flags = 0 };
+	struct string_rings *rings;
+	struct string_ring_cqe *cqe;
+	char *arena;
+	unsigned int i;
+
+	CHECK(fops.open(NULL, &fp) == 0);
+	CHECK(fops.unlocked_ioctl(&fp, IOCTL_RING_ENTER, 0) == -EINVAL);
+	params.sq_entries = 3;
+	CHECK(fops.unlocked_ioctl(&fp, IOCTL_SETUP_RINGS,
+			(unsigned long) &params) == -EINVAL);
+	params.sq_entries = 4;
+	CHECK((rings = ring_map(&fp, &params)) != NULL);
+	if (rings == NULL) {
+		return;
+	}
+	CHECK(params.size == 2 * PAGE_SIZE);
+	CHECK(fops.unlocked_ioctl(&fp, IOCTL_SETUP_RINGS,
+			(unsigned long) &params) == -EBUSY);
+	arena = (void *) rings + rings->arena_off;
+
+	CHECK(fops.unlocked_ioctl(&fp, IOCTL_RING_ENTER, 0) == 0);
+	CHECK(fops.poll(&fp, NULL) == (POLLOUT | POLLWRNORM));
+	ring_push(rings, PLUGIN_REVERSE, 0, "ring", 16);
+	ring_push(rings, PLUGIN_TOCAPS, 64, "ring", 16);
+	ring_push(rings, PLUGIN_BLOCKER, 128, "ring", 16);
+	ring_push(rings, PLUGIN_TOLOWER, 192, "ring", 4096);
+	CHECK(fops.unlocked_ioctl(&fp, IOCTL_RING_ENTER, 0) == 4);
+	CHECK(rings->sq_head == 4 && rings->cq_tail == 4);
+	CHECK(fops.poll(&fp, NULL) & POLLIN);
+
+	/* the CQ is full, nothing is consumed until it's read */
+	ring_push(rings, PLUGIN_TOLOWER, 4000, "", 16);
+	memset(arena + 4000, 'x', 96);
+	CHECK(fops.unlocked_ioctl(&fp, IOCTL_RING_ENTER, 0) == 0);
+
+	for (i = 0; (cqe = ring_peek(rings)) != NULL; ++i) {
+		switch (cqe->user_data) {
+		case 0:
+			CHECK(cqe->status == 0 && cqe->outlen == 4);
+			CHECK(!strcmp(arena + 5, "gnir"));
+			break;
+		case 64:
+			CHECK(cqe->status == 0 && !strcmp(arena + 69, "RING"));
+			break;
+		default: /* bad plugin, output past the arena */
+			CHECK(cqe->status == -EINVAL && cqe->outlen == 0);
+		}
+		smp_store_release(&rings->cq_head, rings->cq_head + 1);
+	}
+	CHECK(i == 4);
+
+	/* the input runs off the arena */
+	CHECK(fops.unlocked_ioctl(&fp, IOCTL_RING_ENTER, 0) == 1);
+	CHECK((cqe = ring_peek(rings)) != NULL && cqe->status == -E2BIG);
+	++rings->cq_head;
+	CHECK(fops.release(NULL, &fp) == 0);
+
+	/* the poller wants a wake up once it's idle */
+	params = (struct string_ring_params) { .sq_entries = 64,
+			.arena_size = 4096, .flags = STRING_RING_SQPOLL };
+	CHECK(fops.open(NULL, &fp) == 0);
+
+	/* but not everybody gets a CPU spinning for them */
+	current->unprivileged = true;
+	CHECK(fops.unlocked_ioctl(&fp, IOCTL_SETUP_RINGS, (unsigned long) &params)
+			== -EPERM);
+	current->unprivileged = false;
+
+	CHECK((rings = ring_map(&fp, &params)) != NULL);
+	if (rings == NULL) {
+		return;
+	}
+	CHECK(rings->cq_entries == 128);
+	arena = (void *) rings + rings->arena_off;
+	for (i = 0; i < 200; ++i) {
+		while (!(smp_load_acquire(&rings->flags)
+				& STRING_RING_NEED_WAKEUP)) {
+			sched_yield();
+		}
+		ring_push(rings, PLUGIN_TOCAPS, (i % 32) * 64, "poll", 16);
+		smp_mb();
+		if (smp_load_acquire(&rings->flags) & STRING_RING_NEED_WAKEUP) {
+			CHECK(fops.unlocked_ioctl(&fp, IOCTL_RING_ENTER,
+					STRING_ENTER_WAKEUP) == 0);
+		}
+		while ((cqe = ring_peek(rings)) == NULL) {
+			sched_yield();
+		}
+		CHECK(cqe->status == 0 && cqe->user_data == (i % 32) * 64);
+		CHECK(!strcmp(arena + cqe->user_data + 5, "POLL"));
+		smp_store_release(&rings->cq_head, rings->cq_head + 1);
+	}
+	CHECK(fops.release(NULL, &fp) == 0);
+}
+
+/* =============================================== */
+
+/* @count calls per syscall, alternating between two plugins */
+static void
+bench_batch(unsigned int count, size_t len) {
+	static struct string_plugin_batch_item items[STRING_BATCH_MAX];
+	static char in[MAXLEN], out[MAXLEN];
+	unsigned long ops = 0;
+	u64 start, elapsed;
+	unsigned int i;
+
+	memset(in, 'a', len);
+	in[len] = '\0';
+	for (i = 0; i < count; ++i) {
+		items[i] = (struct string_plugin_batch_item) { i & 1 ? PLUGIN_TOCAPS
+				: PLUGIN_TOLOWER, in, out, MAXLEN };
+	}
+
+	start = local_clock();
+	do {
+		handle_batch(items, count);
+		ops += count;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+
+	printf(LOG "bench batch=%u len=%zu ns/op=%.1f MB/s=%.1f\n", count, len,
+			(double) elapsed / ops, ops * len * 1e3 / elapsed);
+}
+
+/* @depth calls in flight from a single thread */
+static void
+bench_async(unsigned int depth, size_t len) {
+	static struct string_plugin_completion done[STRING_ASYNC_MAX];
+	static char in[MAXLEN], out[MAXLEN];
+	struct file fp = { .f_flags = 0 };
+	unsigned long long ticket;
+	unsigned long ops = 0;
+	u64 start, elapsed;
+	unsigned int i, n;
+
+	memset(in, 'a', len);
+	in[len] = '\0';
+	fops.open(NULL, &fp);
+
+	start = local_clock();
+	do {
+		for (i = 0; i < depth; ++i) {
+			submit(&fp, PLUGIN_TOCAPS, in, out, &ticket);
+		}
+		for (n = 0; n < depth; ) {
+			n += fops.read(&fp, (char *) done, sizeof(done), NULL)
+					/ sizeof(done[0]);
+		}
+		ops += depth;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+
+	fops.release(NULL, &fp);
+	printf(LOG "bench async depth=%u len=%zu ns/op=%.1f MB/s=%.1f\n", depth,
+			len, (double) elapsed / ops, ops * len * 1e3 / elapsed);
+}
+
+/* tolower then reverse: one by one, then as one pipeline */
+static void
+bench_pipeline(size_t len) {
+	static const unsigned int ids[] = { PLUGIN_TOLOWER, PLUGIN_TOCAPS,
+			PLUGIN_REVERSE };
+	static char in[MAXLEN], tmp[MAXLEN], out[MAXLEN];
+	unsigned long ops = 0;
+	unsigned int outlen;
+	u64 start, elapsed;
+
+	memset(in, 'a', len);
+	in[len] = '\0';
+
+	start = local_clock();
+	do {
+		handle_string(PLUGIN_TOLOWER, in, tmp, MAXLEN);
+		handle_string(PLUGIN_TOCAPS, tmp, out, MAXLEN);
+		handle_string(PLUGIN_REVERSE, out, tmp, MAXLEN);
+		++ops;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+	printf(LOG "bench 3 calls len=%zu ns/op=%.1f MB/s=%.1f\n", len,
+			(double) elapsed / ops, ops * len * 1e3 / elapsed);
+
+	ops = 0;
+	start = local_clock();
+	do {
+		handle_pipeline(ids, ARRAY_SIZE(ids), in, out, MAXLEN, &outlen);
+		++ops;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+	printf(LOG "bench pipeline of 3 len=%zu ns/op=%.1f MB/s=%.1f\n", len,
+			(double) elapsed / ops, ops * len * 1e3 / elapsed);
+}
+
+/* @depth calls per enter, or none with a poller spinning */
+static void
+bench_ring(unsigned int depth, size_t len, unsigned int flags) {
+	struct string_ring_params params = { .sq_entries = STRING_RING_MAX,
+			.arena_size = 2 * MAXLEN, .flags = flags, .sq_idle = 1000 };
+	static char in[MAXLEN];
+	struct file fp = { .f_flags = 0 };
+	struct string_rings *rings;
+	unsigned long ops = 0;
+	u64 start, elapsed;
+	unsigned int i;
+
+	memset(in, 'a', len);
+	in[len] = '\0';
+	fops.open(NULL, &fp);
+	if ((rings = ring_map(&fp, &params)) == NULL) {
+		printf(LOG "bench ring: no rings\n");
+		return;
+	}
+
+	start = local_clock();
+	do {
+		for (i = 0; i < depth; ++i) {
+			ring_push(rings, PLUGIN_TOCAPS, 0, in, MAXLEN);
+		}
+		if (!(flags & STRING_RING_SQPOLL)) {
+			fops.unlocked_ioctl(&fp, IOCTL_RING_ENTER, 0);
+		}
+		while (rings->cq_head != rings->sq_tail) {
+			if (ring_peek(rings) == NULL) {
+				sched_yield();
+				continue;
+			}
+			smp_store_release(&rings->cq_head, rings->cq_head + 1);
+		}
+		ops += depth;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+
+	fops.release(NULL, &fp);
+	printf(LOG "bench ring%s depth=%u len=%zu ns/op=%.1f MB/s=%.1f\n",
+			flags & STRING_RING_SQPOLL ? " sqpoll" : "", depth, len,
+			(double) elapsed / ops, ops * len * 1e3 / elapsed);
+}
+
+static void
+bench_plugin(const char *name, unsigned int id, size_t len) {
+	static char in[MAXLEN], out[MAXLEN];
+	unsigned long ops = 0;
+	u64 start, elapsed;
+
+	memset(in, 'a', len);
+	in[len] = '\0';
+
+	start = local_clock();
+	do {
+		handle_string(id, in, out, MAXLEN);
+		++ops;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+
+	printf(LOG "bench %s len=%zu ns/op=%.1f MB/s=%.1f\n", name, len,
+			(double) elapsed / ops, ops * len * 1e3 / elapsed);
+}
+
+int main(int argc, char **argv) {
+	size_t lens[] = { 16, 256, STRING_MAX - 1 };
+	unsigned int i;
+
+	shim_loglevel = 0; /* error paths are tested on purpose */
+
+	for (i = 0; i < ARRAY_SIZE(modules); ++i) {
+		if (shim_load_module(modules[i]) != 0) {
+			printf(LOG "unable to load %s\n", modules[i]);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(old_plugins); ++i) {
+		string_op_plugin_register(&old_plugins[i]);
+	}
+
+	test_plugins();
+	test_words();
+	test_buffer();
+	test_errors();
+	test_batch();
+	test_pipeline();
+	test_unregister();
+	test_async();
+	test_ring();
+
+	if (failed) {
+		printf(LOG "FAILED: %d checks\n", failed);
+		return -1;
+	}
+	printf(LOG "OK: all tests passed\n");
+
+	if (argc < 2 || strcmp(argv[1], "--no-bench")) {
+		for (i = 0; i < ARRAY_SIZE(lens); ++i) {
+			bench_plugin("reverse", PLUGIN_REVERSE, lens[i]);
+			bench_plugin("tolower", PLUGIN_TOLOWER, lens[i]);
+			bench_plugin("tocaps", PLUGIN_TOCAPS, lens[i]);
+			bench_plugin("old reverse", PLUGIN_OLD + PLUGIN_REVERSE, lens[i]);
+			bench_plugin("old tolower", PLUGIN_OLD + PLUGIN_TOLOWER, lens[i]);
+			bench_plugin("old tocaps", PLUGIN_OLD + PLUGIN_TOCAPS, lens[i]);
+		}
+		bench_pipeline(16);
+		bench_pipeline(STRING_MAX - 1);
+		bench_batch(1, 16);
+		bench_batch(64, 16);
+		bench_batch(STRING_BATCH_MAX, 16);
+		bench_async(1, 16);
+		bench_async(256, 16);
+		bench_ring(1, 16, 0);
+		bench_ring(256, 16, 0);
+		bench_ring(256, 16, STRING_RING_SQPOLL);
+	}
+
+	for (i = ARRAY_SIZE(modules); i > 0; --i) {
+		shim_unload_module(modules[i - 1]);
+	}
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ *  Task 2.5
+ *  Unit tests and microbenchmarks of the compressor, built in userspace
+ *  against ../shim and liblzo2 (make unit)
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/lzo.h>
+
+#define LOG "unit_task25: "
+#define CHUNK (16 * 1024)
+
+extern struct file_operations compressor_fops; /* task25.c */
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf(LOG "FAIL %s:%d: %s\n", __func__, __LINE__, #cond); \
+		++failed; \
+	} \
+} while (0)
+
+static struct file fp = { .f_flags = O_NONBLOCK };
+
+static unsigned int
+read32(const unsigned char *in) {
+	return (in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+}
+
+/* drains the ring, decompressing frames into @out, returns their size */
+static long
+drain(unsigned char *out, size_t size) {
+	static unsigned char frames[128 * 1024];
+	size_t len = 0, done = 0, pos = 0;
+	lzo_uint plain;
+	ssize_t ret;
+
+	while ((ret = compressor_fops.read(&fp, (char *) frames + len,
+			sizeof(frames) - len, NULL)) > 0) {
+		len += ret;
+	}
+	if (ret != -EAGAIN) {
+		return -1;
+	}
+
+	while (pos + 8 <= len) {
+		plain = size - done;
+		if (lzo1x_decompress_safe(frames + pos + 8, read32(frames + pos + 4),
+				out + done, &plain, NULL) != LZO_E_OK
+				|| plain != read32(frames + pos)) {
+			return -1;
+		}
+
+		pos += 8 + read32(frames + pos + 4);
+		done += plain;
+	}
+
+	return pos == len ? (long) done : -1;
+}
+
+static void
+test_roundtrip(void) {
+	static unsigned char in[4 * CHUNK], out[4 * CHUNK];
+	size_t i, written = 0;
+	ssize_t ret;
+
+	for (i = 0; i < sizeof(in); ++i) {
+		in[i] = "poums compressor "[i % 17] ^ (i / 512);
+	}
+
+	/* nothing to read yet */
+	CHECK(drain(out, sizeof(out)) == 0);
+
+	while (written < sizeof(in)) {
+		ret = compressor_fops.write(&fp, (const char *) in + written,
+				sizeof(in) - written, NULL);
+		CHECK(ret > 0);
+		if (ret <= 0) {
+			return;
+		}
+
+		written += ret;
+		CHECK(drain(out + written - ret, sizeof(out) - written + ret) == ret);
+	}
+
+	CHECK(!memcmp(in, out, sizeof(in)));
+}
+
+static void
+test_poll(void) {
+	unsigned char out[CHUNK];
+
+	CHECK(compressor_fops.poll(&fp, NULL) == (POLLOUT | POLLWRNORM));
+	CHECK(compressor_fops.write(&fp, "abc", 3, NULL) == 3);
+	CHECK(compressor_fops.poll(&fp, NULL)
+			== (POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM));
+	CHECK(drain(out, sizeof(out)) == 3);
+	CHECK(!memcmp(out, "abc", 3));
+}
+
+/* =============================================== */
+
+static void
+bench_write(size_t chunk) {
+	static unsigned char in[CHUNK], out[CHUNK];
+	unsigned long ops = 0;
+	u64 start, elapsed;
+	size_t i;
+
+	for (i = 0; i < chunk; ++i) {
+		in[i] = "some text to squeeze "[i % 21];
+	}
+
+	start = local_clock();
+	do {
+		compressor_fops.write(&fp, (const char *) in, chunk, NULL);
+		drain(out, sizeof(out));
+		++ops;
+	} while ((elapsed = local_clock() - start) < 200000000ULL);
+
+	printf(LOG "bench write+read chunk=%zu ns/op=%.1f MB/s=%.1f\n", chunk,
+			(double) elapsed / ops, ops * chunk * 1e3 / elapsed);
+}
+
+int main(int argc, char **argv) {
+	size_t chunks[] = { 64, 4096, CHUNK };
+	unsigned int i;
+
+	shim_loglevel = 3;
+
+	if (shim_load_module("task25") != 0) {
+		printf(LOG "unable to load task25\n");
+		return -1;
+	}
+
+	test_roundtrip();
+	test_poll();
+
+	if (failed) {
+		printf(LOG "FAILED: %d checks\n", failed);
+		return -1;
+	}
+	printf(LOG "OK: all tests passed\n");
+
+	if (argc < 2 || strcmp(argv[1], "--no-bench")) {
+		for (i = 0; i < ARRAY_SIZE(chunks); ++i) {
+			bench_write(chunks[i]);
+		}
+	}
+
+	shim_unload_module("task25");
+	return 0;
+}